@@ -0,0 +1,230 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "sepulca.h"
+#include "thread_pool.h"
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace cosmica
+{
+
+/**
+ * Asynchronous interface to a storage: operations return futures instead
+ * of blocking the caller.
+ *
+ * Loads are queued to a reader thread, which passes all loads queued
+ * meanwhile to the storage at once, so that their I/O overlaps (e.g. file
+ * storage reads them through an io_uring). Storages which cannot overlap
+ * loads, and all other operations, run on a pool of worker threads.
+ */
+class async_storage
+{
+public:
+    /**
+     * Wraps the storage, which must outlive this object, running
+     * operations on the given number of worker threads; zero means
+     * the number of hardware threads.
+     */
+    explicit async_storage(storage &stor, size_t threads = 0) :
+        m_stor(stor),
+        m_pool(threads)
+    {
+        m_reader = std::thread([this] { reader_loop(); });
+    }
+
+    // Disable copy and move of asynchronous storages.
+    async_storage(const async_storage &) = delete;
+    async_storage(async_storage &&) = delete;
+
+    /**
+     * Finishes all pending operations.
+     */
+    ~async_storage()
+    {
+        {
+            std::lock_guard guard(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        m_reader.join();
+    }
+
+    storage &get_storage() const noexcept {
+        return m_stor;
+    }
+
+    /**
+     * Loads a sepulca, see storage::get().
+     */
+    std::future<sepulca_ptr> async_get(const sepulca_id &sid)
+    {
+        std::promise<sepulca_ptr> p;
+        auto res = p.get_future();
+        {
+            std::lock_guard guard(m_mutex);
+            m_loads.push_back(load{sid, std::move(p)});
+        }
+        m_cv.notify_one();
+        return res;
+    }
+
+    /**
+     * Checks if a sepulca exists, see storage::exists().
+     */
+    std::future<bool> async_exists(const sepulca_id &sid)
+    {
+        return m_pool.submit([this, sid] {
+            return m_stor.exists(sid);
+        });
+    }
+
+    /**
+     * Creates a sepulca, see storage::create().
+     */
+    std::future<sepulca_ptr> async_create(attributes attrs = {})
+    {
+        return m_pool.submit([this, attrs = std::move(attrs)]() mutable {
+            return m_stor.create(std::move(attrs));
+        });
+    }
+
+    /**
+     * Commits a sepulca, see sepulca::commit(). The sepulca is returned
+     * by the future once committed.
+     */
+    std::future<sepulca_ptr> async_commit(sepulca_ptr s)
+    {
+        return m_pool.submit([s = std::move(s)]() mutable {
+            s->commit();
+            return std::move(s);
+        });
+    }
+
+    /**
+     * Erases a sepulca, see sepulca::erase(). The sepulca is returned
+     * by the future once erased.
+     */
+    std::future<sepulca_ptr> async_erase(sepulca_ptr s)
+    {
+        return m_pool.submit([s = std::move(s)]() mutable {
+            s->erase();
+            return std::move(s);
+        });
+    }
+
+    /**
+     * Applies a batch, see storage::apply().
+     */
+    std::future<std::vector<sepulca_ptr>> async_apply(write_batch batch)
+    {
+        return m_pool.submit([this, batch = std::move(batch)] {
+            return m_stor.apply(batch);
+        });
+    }
+
+private:
+    struct load
+    {
+        sepulca_id sid;
+        std::promise<sepulca_ptr> result;
+    };
+
+    // Maximum number of loads passed to the storage at once.
+    static constexpr size_t max_loads = 1024;
+
+    void reader_loop()
+    {
+        std::vector<load> loads;
+        std::vector<sepulca_id> ids;
+        std::vector<sepulca_ptr> res;
+
+        for (;;) {
+            {
+                std::unique_lock guard(m_mutex);
+                m_cv.wait(guard, [this] { return m_stop || !m_loads.empty(); });
+                if (m_loads.empty()) {
+                    return;
+                }
+
+                const size_t n = std::min(m_loads.size(), max_loads);
+                loads.clear();
+                for (size_t i = 0; i < n; ++i) {
+                    loads.push_back(std::move(m_loads.front()));
+                    m_loads.pop_front();
+                }
+            }
+
+            ids.clear();
+            for (const auto &l : loads) {
+                ids.push_back(l.sid);
+            }
+
+            bool loaded;
+            try {
+                loaded = m_stor.load_many(ids, res);
+            } catch (...) {
+                for (auto &l : loads) {
+                    l.result.set_exception(std::current_exception());
+                }
+                continue;
+            }
+
+            if (!loaded) {
+                for (auto &l : loads) {
+                    m_pool.submit([this, l = std::move(l)]() mutable {
+                        try {
+                            l.result.set_value(m_stor.get(l.sid));
+                        } catch (...) {
+                            l.result.set_exception(std::current_exception());
+                        }
+                    });
+                }
+                continue;
+            }
+
+            for (size_t i = 0; i < loads.size(); ++i) {
+                if (res[i]) {
+                    loads[i].result.set_value(std::move(res[i]));
+                } else {
+                    loads[i].result.set_exception(std::make_exception_ptr(
+                        std::runtime_error("Sepulca '" +
+                            loads[i].sid.to_string() + "' not found")));
+                }
+            }
+        }
+    }
+
+    storage &m_stor;
+    thread_pool m_pool;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<load> m_loads;
+    bool m_stop = false;
+    std::thread m_reader;
+};
+
+}
@@ -0,0 +1,344 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <initializer_list>
+#include <compare>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace cosmica
+{
+
+/**
+ * Process-wide pool of attribute names, see intern_attribute_name().
+ */
+struct attribute_name_pool
+{
+    struct string_hash
+    {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view s) const noexcept {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+
+    std::shared_mutex mutex;
+    std::unordered_set<std::string, string_hash, std::equal_to<>> names;
+
+    static attribute_name_pool &get() noexcept
+    {
+        static attribute_name_pool pool;
+        return pool;
+    }
+
+    /**
+     * Returns the pooled copy of the name, or null if the name is not
+     * pooled.
+     */
+    const std::string *find(std::string_view name)
+    {
+        std::shared_lock guard(mutex);
+        auto i = names.find(name);
+        return i != names.end() ? &*i : nullptr;
+    }
+};
+
+/**
+ * Returns a copy of the attribute name kept in a process-wide pool, so that
+ * every distinct name is stored only once.
+ *
+ * Pooled names are never freed: attribute names are expected to come from
+ * a small vocabulary repeated across sepulcas. Names from untrusted sources
+ * are to be checked by is_attribute_name_interned() first.
+ */
+inline const std::string &intern_attribute_name(std::string_view name)
+{
+    // The per-thread map of known names avoids locking the pool.
+    thread_local std::unordered_map<std::string_view, const std::string *>
+        known;
+    if (auto i = known.find(name); i != known.end()) {
+        return *i->second;
+    }
+
+    auto &pool = attribute_name_pool::get();
+    auto res = pool.find(name);
+    if (!res) {
+        std::lock_guard guard(pool.mutex);
+        res = &*pool.names.emplace(name).first;
+    }
+
+    known.emplace(*res, res);
+    return *res;
+}
+
+/**
+ * Checks if the attribute name is in the pool already, so that interning
+ * it takes no memory.
+ */
+inline bool is_attribute_name_interned(std::string_view name)
+{
+    return attribute_name_pool::get().find(name) != nullptr;
+}
+
+/**
+ * Name of an attribute in attributes: a reference to the interned name,
+ * used as a const std::string.
+ */
+class attribute_name
+{
+public:
+    attribute_name(std::string_view name) :
+        m_name(&intern_attribute_name(name))
+    {
+    }
+
+    attribute_name(const std::string &name) :
+        attribute_name(std::string_view(name))
+    {
+    }
+
+    attribute_name(const char *name) :
+        attribute_name(std::string_view(name))
+    {
+    }
+
+    operator const std::string &() const noexcept {
+        return *m_name;
+    }
+
+    operator std::string_view() const noexcept {
+        return *m_name;
+    }
+
+    const std::string &str() const noexcept {
+        return *m_name;
+    }
+
+    const char *c_str() const noexcept {
+        return m_name->c_str();
+    }
+
+    const char *data() const noexcept {
+        return m_name->data();
+    }
+
+    std::string::size_type size() const noexcept {
+        return m_name->size();
+    }
+
+    std::string::size_type length() const noexcept {
+        return m_name->length();
+    }
+
+    bool empty() const noexcept {
+        return m_name->empty();
+    }
+
+    // Names compare as strings, including with other names.
+    friend bool operator==(const attribute_name &a,
+                           std::string_view b) noexcept {
+        return *a.m_name == b;
+    }
+
+    friend std::strong_ordering operator<=>(const attribute_name &a,
+                                            std::string_view b) noexcept {
+        return std::string_view(*a.m_name) <=> b;
+    }
+
+    friend std::ostream &operator<<(std::ostream &os,
+                                    const attribute_name &name) {
+        return os << *name.m_name;
+    }
+
+private:
+    const std::string *m_name;
+};
+
+/**
+ * Sepulca attributes: a map of attribute names to values.
+ *
+ * Attributes are kept in a vector sorted by name, with names interned by
+ * intern_attribute_name(), so a sepulca's attributes take a single
+ * allocation plus the values. Lookups accept any string-like name.
+ *
+ * The interface follows std::map<std::string, std::string>: the name part
+ * of elements is an attribute_name, used as a const std::string.
+ */
+class attributes
+{
+public:
+    using key_type = std::string;
+    using mapped_type = std::string;
+    using value_type = std::pair<attribute_name, std::string>;
+    using container_type = std::vector<value_type>;
+    using iterator = container_type::iterator;
+    using const_iterator = container_type::const_iterator;
+    using size_type = container_type::size_type;
+
+    attributes() = default;
+
+    attributes(std::initializer_list<value_type> init)
+    {
+        for (const auto &[k, v] : init) {
+            emplace(k, v);
+        }
+    }
+
+    iterator begin() noexcept { return m_attrs.begin(); }
+    iterator end() noexcept { return m_attrs.end(); }
+    const_iterator begin() const noexcept { return m_attrs.begin(); }
+    const_iterator end() const noexcept { return m_attrs.end(); }
+    const_iterator cbegin() const noexcept { return m_attrs.cbegin(); }
+    const_iterator cend() const noexcept { return m_attrs.cend(); }
+
+    size_type size() const noexcept { return m_attrs.size(); }
+    bool empty() const noexcept { return m_attrs.empty(); }
+    void clear() noexcept { m_attrs.clear(); }
+    void reserve(size_type n) { m_attrs.reserve(n); }
+
+    iterator find(std::string_view name) noexcept
+    {
+        auto i = lower_bound(name);
+        return i != m_attrs.end() && i->first == name ? i : m_attrs.end();
+    }
+
+    const_iterator find(std::string_view name) const noexcept {
+        return const_cast<attributes &>(*this).find(name);
+    }
+
+    bool contains(std::string_view name) const noexcept {
+        return find(name) != end();
+    }
+
+    size_type count(std::string_view name) const noexcept {
+        return contains(name) ? 1 : 0;
+    }
+
+    std::string &at(std::string_view name)
+    {
+        if (auto i = find(name); i != end()) {
+            return i->second;
+        }
+        throw std::out_of_range("Attribute '" + std::string(name) +
+            "' not found");
+    }
+
+    const std::string &at(std::string_view name) const {
+        return const_cast<attributes &>(*this).at(name);
+    }
+
+    /**
+     * Returns a value of the attribute, inserting an empty one if needed.
+     */
+    std::string &operator[](std::string_view name) {
+        return emplace(name, std::string()).first->second;
+    }
+
+    /**
+     * Inserts an attribute unless there already is one with the same name.
+     */
+    template<typename K, typename V>
+    std::pair<iterator, bool> emplace(K &&name, V &&value)
+    {
+        const std::string_view n(name);
+        auto i = lower_bound(n);
+        if (i != m_attrs.end() && i->first == n) {
+            return {i, false};
+        }
+
+        i = m_attrs.emplace(i, attribute_name(n),
+                            std::string(std::forward<V>(value)));
+        return {i, true};
+    }
+
+    template<typename K, typename V>
+    std::pair<iterator, bool> emplace(std::pair<K, V> &&attr) {
+        return emplace(std::move(attr.first), std::move(attr.second));
+    }
+
+    /**
+     * Inserts an attribute using a position hint; appending attributes
+     * in the name order is constant time.
+     */
+    template<typename K, typename V>
+    iterator emplace_hint(const_iterator hint, K &&name, V &&value)
+    {
+        const std::string_view n(name);
+        if (hint == m_attrs.end() &&
+            (m_attrs.empty() || m_attrs.back().first < n)) {
+            m_attrs.emplace_back(attribute_name(n),
+                                 std::string(std::forward<V>(value)));
+            return std::prev(m_attrs.end());
+        }
+        return emplace(n, std::forward<V>(value)).first;
+    }
+
+    /**
+     * Inserts an attribute or replaces the value of an existing one.
+     */
+    template<typename V>
+    std::pair<iterator, bool> insert_or_assign(std::string_view name,
+                                               V &&value)
+    {
+        auto res = emplace(name, std::string());
+        res.first->second = std::forward<V>(value);
+        return res;
+    }
+
+    iterator erase(const_iterator i) {
+        return m_attrs.erase(i);
+    }
+
+    size_type erase(std::string_view name)
+    {
+        if (auto i = find(name); i != end()) {
+            m_attrs.erase(i);
+            return 1;
+        }
+        return 0;
+    }
+
+    bool operator==(const attributes &) const = default;
+
+private:
+    iterator lower_bound(std::string_view name) noexcept
+    {
+        return std::lower_bound(m_attrs.begin(), m_attrs.end(), name,
+                                [](const value_type &a, std::string_view n) {
+                                    return a.first < n;
+                                });
+    }
+
+    container_type m_attrs;
+};
+
+}
@@ -0,0 +1,538 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+/*
+ * Storage benchmark.
+ *
+ * Runs create, get, exists, commit, enumerate and erase phases against
+ * a fresh storage for every combination of object counts, attribute counts
+ * and value sizes, optionally from several threads and processes at once,
+ * and prints throughput and latency percentiles as JSON.
+ */
+
+#include "file_storage.h"
+#include "log_storage.h"
+#include "memory_storage.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+enum phase
+{
+    phase_create,
+    phase_get,
+    phase_exists,
+    phase_commit,
+    phase_enumerate,
+    phase_erase,
+    phase_count
+};
+
+static const char *const phase_names[phase_count] = {
+    "create", "get", "exists", "commit", "enumerate", "erase"
+};
+
+/**
+ * Phase results accumulated by all workers of all processes.
+ */
+struct phase_result
+{
+    uint64_t begin;
+    uint64_t end;
+    cosmica::duration_histogram hist;  // Latencies in nanoseconds.
+};
+
+/**
+ * State shared by the benchmark processes, placed in a shared mapping
+ * created before forking.
+ */
+struct shared_state
+{
+    pthread_barrier_t barrier;
+    phase_result results[phase_count];
+};
+
+struct bench_config
+{
+    std::string backend = "file";
+    cosmica::file_durability durability = cosmica::file_durability::atomic;
+    std::filesystem::path dir;
+    std::vector<size_t> counts = {1000};
+    std::vector<size_t> attrs = {4};
+    std::vector<size_t> value_sizes = {16};
+    size_t threads = 1;
+    size_t processes = 1;
+    bool phases[phase_count] = {true, true, true, true, true, true};
+};
+
+struct run_config
+{
+    size_t count;
+    size_t attrs;
+    size_t value_size;
+};
+
+static uint64_t now_ns() noexcept
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void atomic_min(uint64_t &v, uint64_t x) noexcept
+{
+    std::atomic_ref a(v);
+    for (auto cur = a.load(); x < cur && !a.compare_exchange_weak(cur, x);) {
+    }
+}
+
+static void atomic_max(uint64_t &v, uint64_t x) noexcept
+{
+    std::atomic_ref a(v);
+    for (auto cur = a.load(); x > cur && !a.compare_exchange_weak(cur, x);) {
+    }
+}
+
+/**
+ * Adds the results of one worker to the shared phase results.
+ */
+static void merge(phase_result &res, uint64_t begin, uint64_t end,
+                  const cosmica::duration_histogram &hist)
+{
+    atomic_min(res.begin, begin);
+    atomic_max(res.end, end);
+
+    for (size_t b = 0; b < cosmica::duration_histogram::bucket_count; ++b) {
+        if (hist.buckets[b]) {
+            std::atomic_ref(res.hist.buckets[b]).fetch_add(hist.buckets[b]);
+        }
+    }
+    std::atomic_ref(res.hist.count).fetch_add(hist.count);
+    std::atomic_ref(res.hist.sum).fetch_add(hist.sum);
+    atomic_max(res.hist.max, hist.max);
+}
+
+static std::unique_ptr<cosmica::storage> open_storage(
+    const bench_config &cfg, const std::filesystem::path &dir)
+{
+    if (cfg.backend == "log") {
+        return std::make_unique<cosmica::log_storage>(dir);
+    }
+    if (cfg.backend == "memory") {
+        return std::make_unique<cosmica::memory_storage>();
+    }
+    cosmica::file_storage_options opts;
+    opts.durability = cfg.durability;
+    return std::make_unique<cosmica::file_storage>(dir, opts);
+}
+
+static std::string random_value(std::mt19937_64 &rnd, size_t size)
+{
+    std::string v(size, ' ');
+    for (auto &c : v) {
+        c = static_cast<char>('a' + rnd() % 26);
+    }
+    return v;
+}
+
+/**
+ * Runs all phases for one worker's share of the objects.
+ */
+static void run_worker(const bench_config &cfg, const run_config &run,
+                       cosmica::storage &stor, shared_state &state,
+                       size_t worker, size_t workers)
+{
+    std::mt19937_64 rnd(worker);
+    const size_t first = run.count * worker / workers;
+    const size_t last = run.count * (worker + 1) / workers;
+
+    std::vector<std::string> names;
+    for (size_t i = 0; i < run.attrs; ++i) {
+        names.push_back("attr" + std::to_string(i));
+    }
+
+    std::vector<cosmica::sepulca_id> ids;
+    ids.reserve(last - first);
+
+    auto run_phase = [&](phase p, const auto &op) {
+        pthread_barrier_wait(&state.barrier);
+
+        auto hist = std::make_unique<cosmica::duration_histogram>();
+        const auto begin = now_ns();
+        for (size_t i = 0; i < last - first; ++i) {
+            const auto t = now_ns();
+            op(i);
+            hist->add(now_ns() - t);
+        }
+        merge(state.results[p], begin, now_ns(), *hist);
+    };
+
+    // Objects are always created: the other phases need them.
+    run_phase(phase_create, [&](size_t) {
+        cosmica::attributes attrs;
+        for (const auto &name : names) {
+            attrs.emplace(name, random_value(rnd, run.value_size));
+        }
+        ids.push_back(stor.create(std::move(attrs))->get_id());
+    });
+
+    if (cfg.phases[phase_get]) {
+        run_phase(phase_get, [&](size_t i) {
+            stor.get(ids[i]);
+        });
+    }
+
+    if (cfg.phases[phase_exists]) {
+        run_phase(phase_exists, [&](size_t i) {
+            if (!stor.exists(ids[i])) {
+                throw std::runtime_error("Created sepulca does not exist");
+            }
+        });
+    }
+
+    if (cfg.phases[phase_commit]) {
+        // Loading is not timed, only modification and commit are.
+        pthread_barrier_wait(&state.barrier);
+        auto hist = std::make_unique<cosmica::duration_histogram>();
+        const auto begin = now_ns();
+        for (const auto &sid : ids) {
+            auto s = stor.get(sid);
+            const auto t = now_ns();
+            s->set_attr(names.empty() ? "attr0" : names[0],
+                        random_value(rnd, run.value_size));
+            s->commit();
+            hist->add(now_ns() - t);
+        }
+        merge(state.results[phase_commit], begin, now_ns(), *hist);
+    }
+
+    if (cfg.phases[phase_enumerate]) {
+        // Every worker enumerates the whole storage at once; an operation
+        // is a delivered sepulca.
+        pthread_barrier_wait(&state.barrier);
+        auto hist = std::make_unique<cosmica::duration_histogram>();
+        const auto begin = now_ns();
+        auto t = begin;
+        stor.enumerate([&](cosmica::sepulca_ptr) {
+            const auto now = now_ns();
+            hist->add(now - t);
+            t = now;
+            return true;
+        });
+        merge(state.results[phase_enumerate], begin, now_ns(), *hist);
+    }
+
+    if (cfg.phases[phase_erase]) {
+        pthread_barrier_wait(&state.barrier);
+        auto hist = std::make_unique<cosmica::duration_histogram>();
+        const auto begin = now_ns();
+        for (const auto &sid : ids) {
+            auto s = stor.get(sid);
+            const auto t = now_ns();
+            s->erase();
+            hist->add(now_ns() - t);
+        }
+        merge(state.results[phase_erase], begin, now_ns(), *hist);
+    }
+}
+
+/**
+ * Runs the worker threads of one process. Any failure terminates
+ * the process, as the other workers would wait for it forever.
+ */
+static void run_process(const bench_config &cfg, const run_config &run,
+                        const std::filesystem::path &dir, shared_state &state,
+                        size_t process)
+{
+    try {
+        auto stor = open_storage(cfg, dir);
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < cfg.threads; ++t) {
+            threads.emplace_back([&, t] {
+                try {
+                    run_worker(cfg, run, *stor, state,
+                               process * cfg.threads + t,
+                               cfg.processes * cfg.threads);
+                } catch (const std::exception &err) {
+                    std::cerr << "Benchmark worker failed: " << err.what()
+                        << std::endl;
+                    std::_Exit(1);
+                }
+            });
+        }
+
+        for (auto &t : threads) {
+            t.join();
+        }
+    } catch (const std::exception &err) {
+        std::cerr << "Benchmark process failed: " << err.what() << std::endl;
+        std::_Exit(1);
+    }
+}
+
+static void print_result(std::ostream &out, const run_config &run, phase p,
+                         const phase_result &res)
+{
+    const double seconds = static_cast<double>(res.end - res.begin) / 1e9;
+    const double throughput = seconds > 0 ?
+        static_cast<double>(res.hist.count) / seconds : 0;
+
+    out << "{\"op\": \"" << phase_names[p] << "\""
+        << ", \"count\": " << run.count
+        << ", \"attrs\": " << run.attrs
+        << ", \"value_size\": " << run.value_size
+        << ", \"ops\": " << res.hist.count
+        << ", \"seconds\": " << seconds
+        << ", \"ops_per_sec\": " << throughput
+        << ", \"latency_ns\": {"
+        << "\"mean\": " << res.hist.mean()
+        << ", \"p50\": " << res.hist.percentile(0.5)
+        << ", \"p90\": " << res.hist.percentile(0.9)
+        << ", \"p99\": " << res.hist.percentile(0.99)
+        << ", \"max\": " << res.hist.max
+        << "}}";
+}
+
+/**
+ * Runs all phases for one combination of parameters in a fresh storage.
+ */
+static bool run_bench(const bench_config &cfg, const run_config &run,
+                      shared_state &state, size_t n)
+{
+    std::memset(static_cast<void *>(state.results), 0, sizeof(state.results));
+    for (auto &res : state.results) {
+        res.begin = UINT64_MAX;
+    }
+
+    const auto dir = cfg.dir / ("run-" + std::to_string(n));
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+
+    std::cerr << "running " << run.count << " object(s), " << run.attrs
+        << " attribute(s), " << run.value_size << " byte value(s)"
+        << std::endl;
+
+    bool ok = true;
+    if (cfg.processes == 1) {
+        run_process(cfg, run, dir, state, 0);
+    } else {
+        std::vector<pid_t> children;
+        for (size_t p = 0; p < cfg.processes; ++p) {
+            auto pid = fork();
+            if (pid == -1) {
+                throw std::runtime_error(std::string("Failed to fork: ") +
+                    strerror(errno));
+            }
+            if (pid == 0) {
+                run_process(cfg, run, dir, state, p);
+                // Destructors do not run, so the final dump neither.
+                cosmica::metrics::instance().dump();
+                std::_Exit(0);
+            }
+            children.push_back(pid);
+        }
+
+        for (size_t left = children.size(); left > 0; --left) {
+            int status;
+            if (wait(&status) == -1) {
+                break;
+            }
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                ok = false;
+                for (auto pid : children) {
+                    kill(pid, SIGKILL);
+                }
+            }
+        }
+    }
+
+    std::filesystem::remove_all(dir);
+    return ok;
+}
+
+static std::vector<size_t> parse_list(const std::string &s)
+{
+    std::vector<size_t> res;
+    std::istringstream in(s);
+    for (std::string item; std::getline(in, item, ',');) {
+        size_t pos;
+        res.push_back(std::stoul(item, &pos));
+        if (pos != item.size()) {
+            throw std::invalid_argument("invalid number '" + item + "'");
+        }
+    }
+    if (res.empty()) {
+        throw std::invalid_argument("empty list");
+    }
+    return res;
+}
+
+static void parse_phases(bench_config &cfg, const std::string &s)
+{
+    std::fill(std::begin(cfg.phases), std::end(cfg.phases), false);
+
+    std::istringstream in(s);
+    for (std::string item; std::getline(in, item, ',');) {
+        auto i = std::find(std::begin(phase_names), std::end(phase_names),
+                           item);
+        if (i == std::end(phase_names)) {
+            throw std::invalid_argument("unknown operation '" + item + "'");
+        }
+        cfg.phases[i - std::begin(phase_names)] = true;
+    }
+}
+
+static int usage()
+{
+    std::cout << "usage: sepulcas_bench [<option> <value>]...\n"
+        << "  --backend file|log|memory\n"
+        << "                       storage backend (file)\n"
+        << "  --durability none|atomic|sync\n"
+        << "                       file storage durability (atomic)\n"
+        << "  --dir <dir>          scratch directory (system temporary)\n"
+        << "  --count <n>[,<n>]... numbers of sepulcas (1000)\n"
+        << "  --attrs <n>[,<n>]... numbers of attributes per sepulca (4)\n"
+        << "  --value-size <n>[,<n>]...\n"
+        << "                       attribute value sizes in bytes (16)\n"
+        << "  --threads <n>        worker threads per process (1)\n"
+        << "  --processes <n>      worker processes (1)\n"
+        << "  --ops <op>[,<op>]... operations to measure: create, get,\n"
+        << "                       exists, commit, enumerate, erase (all)\n"
+        << "\n"
+        << "Every combination of counts, attributes and value sizes runs\n"
+        << "in a fresh storage. Objects are split between all workers.\n"
+        << "Results are printed to the standard output as JSON.\n";
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config cfg;
+    cfg.dir = std::filesystem::temp_directory_path() /
+        ("sepulcas-bench-" + std::to_string(getpid()));
+
+    try {
+        for (int i = 1; i < argc; i += 2) {
+            if (i + 1 >= argc) {
+                return usage();
+            }
+
+            const std::string opt = argv[i];
+            const std::string val = argv[i + 1];
+            if (opt == "--backend" &&
+                (val == "file" || val == "log" || val == "memory")) {
+                cfg.backend = val;
+            } else if (opt == "--durability" && val == "none") {
+                cfg.durability = cosmica::file_durability::none;
+            } else if (opt == "--durability" && val == "atomic") {
+                cfg.durability = cosmica::file_durability::atomic;
+            } else if (opt == "--durability" && val == "sync") {
+                cfg.durability = cosmica::file_durability::sync;
+            } else if (opt == "--dir") {
+                cfg.dir = val;
+            } else if (opt == "--count") {
+                cfg.counts = parse_list(val);
+            } else if (opt == "--attrs") {
+                cfg.attrs = parse_list(val);
+            } else if (opt == "--value-size") {
+                cfg.value_sizes = parse_list(val);
+            } else if (opt == "--threads") {
+                cfg.threads = std::max<size_t>(1, std::stoul(val));
+            } else if (opt == "--processes") {
+                cfg.processes = std::max<size_t>(1, std::stoul(val));
+            } else if (opt == "--ops") {
+                parse_phases(cfg, val);
+            } else {
+                return usage();
+            }
+        }
+    } catch (const std::invalid_argument &err) {
+        std::cerr << "Invalid argument: " << err.what() << std::endl;
+        return usage();
+    } catch (const std::out_of_range &err) {
+        std::cerr << "Invalid argument: " << err.what() << std::endl;
+        return usage();
+    }
+
+    void *p = mmap(nullptr, sizeof(shared_state), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        std::cerr << "Failed to map shared state: " << strerror(errno)
+            << std::endl;
+        return 1;
+    }
+    auto &state = *static_cast<shared_state *>(p);
+
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&state.barrier, &attr,
+                         static_cast<unsigned>(cfg.threads * cfg.processes));
+    pthread_barrierattr_destroy(&attr);
+
+    std::cout << "{\"backend\": \"" << cfg.backend << "\""
+        << ", \"threads\": " << cfg.threads
+        << ", \"processes\": " << cfg.processes
+        << ", \"results\": [";
+
+    int res = 0;
+    try {
+        size_t n = 0;
+        const char *sep = "\n";
+        for (auto count : cfg.counts) {
+            for (auto attrs : cfg.attrs) {
+                for (auto value_size : cfg.value_sizes) {
+                    const run_config run{count, attrs, value_size};
+                    if (!run_bench(cfg, run, state, n++)) {
+                        throw std::runtime_error("benchmark process failed");
+                    }
+
+                    for (size_t ph = 0; ph < phase_count; ++ph) {
+                        if (cfg.phases[ph]) {
+                            std::cout << sep << "  ";
+                            print_result(std::cout, run, phase(ph),
+                                         state.results[ph]);
+                            sep = ",\n";
+                        }
+                    }
+                    std::cout.flush();
+                }
+            }
+        }
+    } catch (const std::exception &err) {
+        std::cerr << "Benchmark failed: " << err.what() << std::endl;
+        res = 1;
+    }
+
+    std::cout << "\n]}" << std::endl;
+
+    std::error_code ec;
+    std::filesystem::remove(cfg.dir, ec);
+    pthread_barrier_destroy(&state.barrier);
+    munmap(p, sizeof(shared_state));
+    return res;
+}
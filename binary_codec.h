@@ -0,0 +1,117 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace cosmica
+{
+
+/**
+ * Encoding of binary storage records.
+ *
+ * Integers are stored in the host byte order, as storages are not shared
+ * between hosts; strings are a 32-bit size followed by the bytes.
+ * Decoding functions consume the input and return false, leaving the output
+ * unspecified, if it is too short.
+ */
+
+inline void put_u8(std::string &out, uint8_t v)
+{
+    out += static_cast<char>(v);
+}
+
+inline void put_u32(std::string &out, uint32_t v)
+{
+    out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+inline void put_u64(std::string &out, uint64_t v)
+{
+    out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+inline void put_string(std::string &out, std::string_view s)
+{
+    put_u32(out, static_cast<uint32_t>(s.size()));
+    out.append(s);
+}
+
+inline bool get_u8(std::string_view &in, uint8_t &v)
+{
+    if (in.empty()) {
+        return false;
+    }
+    v = static_cast<uint8_t>(in.front());
+    in.remove_prefix(1);
+    return true;
+}
+
+inline bool get_u32(std::string_view &in, uint32_t &v)
+{
+    if (in.size() < sizeof(v)) {
+        return false;
+    }
+    memcpy(&v, in.data(), sizeof(v));
+    in.remove_prefix(sizeof(v));
+    return true;
+}
+
+inline bool get_u64(std::string_view &in, uint64_t &v)
+{
+    if (in.size() < sizeof(v)) {
+        return false;
+    }
+    memcpy(&v, in.data(), sizeof(v));
+    in.remove_prefix(sizeof(v));
+    return true;
+}
+
+/**
+ * Decodes a string referring to the input.
+ */
+inline bool get_string(std::string_view &in, std::string_view &s)
+{
+    uint32_t len;
+    if (!get_u32(in, len) || in.size() < len) {
+        return false;
+    }
+    s = in.substr(0, len);
+    in.remove_prefix(len);
+    return true;
+}
+
+/**
+ * Checksum detecting torn and corrupted records (FNV-1a).
+ */
+inline uint32_t checksum(std::string_view data)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned char c : data) {
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+}
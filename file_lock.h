@@ -20,7 +20,10 @@
 
 #pragma once
 
+#include "metrics.h"
+#include <cstring>
 #include <mutex>
+#include <shared_mutex>
 #include <filesystem>
 #include <sys/file.h>
 #include <sys/stat.h>
@@ -31,8 +34,13 @@ namespace cosmica
 {
 
 /**
- * A system-wide mutex implemented via file locking mechanism.
- * This class is compatible with std::lock_guard.
+ * A system-wide readers-writer mutex implemented via file locking mechanism.
+ * This class is compatible with std::lock_guard, std::unique_lock
+ * and std::shared_lock.
+ *
+ * File locks belong to the open file description and thus do not exclude
+ * threads sharing the same file_lock object. Threads are excluded by
+ * an in-process mutex held for the whole time the lock is owned.
  */
 class file_lock
 {
@@ -43,7 +51,7 @@ public:
     explicit file_lock(std::filesystem::path path) :
         m_path(std::move(path))
     {
-        m_fd = open(m_path.c_str(), O_CREAT | O_RDONLY, 0777);
+        m_fd = open(m_path.c_str(), O_CREAT | O_RDONLY | O_CLOEXEC, 0777);
         if (m_fd == -1) {
             throw std::runtime_error("Failed to open lock file '" +
                 m_path.string() + "': " + strerror(errno));
@@ -51,50 +59,85 @@ public:
     }
 
     /**
-     * Releaes the lock and destroys the lock object.
+     * Destroys the lock object, releasing the file lock if it is owned.
      */
     ~file_lock()
     {
-        std::lock_guard lock(m_mutex);
-
-        if (m_fd != -1) {
-            close(m_fd);
-            m_fd = -1;
-        }
+        close(m_fd);
     }
 
     /**
-     * Acquires the file lock.
-     * This function does nothing if the lock already acquired.
+     * Acquires the file lock exclusively.
+     * The lock is not recursive.
      */
     void lock()
     {
-        std::lock_guard lock(m_mutex);
-
-        if (m_fd == -1) {
-            return;
-        }
+        scoped_timer timer(timer_metric::lock_wait);
+        m_mutex.lock();
 
         if (flock(m_fd, LOCK_EX) != 0) {
+            auto err = errno;
+            m_mutex.unlock();
             throw std::runtime_error("Failed to lock file '" +
-                m_path.string() + "': " + strerror(errno));
+                m_path.string() + "': " + strerror(err));
         }
     }
 
     /**
-     * Releases the file lock.
+     * Releases the exclusively owned file lock.
      */
     void unlock()
     {
-        std::lock_guard lock(m_mutex);
+        auto r = flock(m_fd, LOCK_UN);
+        auto err = errno;
+        m_mutex.unlock();
 
-        if (m_fd == -1) {
-            return;
+        if (r != 0) {
+            throw std::runtime_error("Failed to unlock file '" +
+                m_path.string() + "': " + strerror(err));
+        }
+    }
+
+    /**
+     * Acquires the file lock in the shared mode.
+     * Any number of threads and processes can share the lock, while
+     * an exclusive owner excludes all others.
+     */
+    void lock_shared()
+    {
+        scoped_timer timer(timer_metric::lock_wait);
+        m_mutex.lock_shared();
+
+        // The first shared owner in this process takes the file lock
+        // on behalf of all others.
+        std::lock_guard guard(m_shared_mutex);
+        if (m_shared_count == 0 && flock(m_fd, LOCK_SH) != 0) {
+            auto err = errno;
+            m_mutex.unlock_shared();
+            throw std::runtime_error("Failed to lock file '" +
+                m_path.string() + "': " + strerror(err));
+        }
+        ++m_shared_count;
+    }
+
+    /**
+     * Releases the file lock owned in the shared mode.
+     */
+    void unlock_shared()
+    {
+        int r = 0, err = 0;
+        {
+            std::lock_guard guard(m_shared_mutex);
+            if (--m_shared_count == 0) {
+                r = flock(m_fd, LOCK_UN);
+                err = errno;
+            }
         }
+        m_mutex.unlock_shared();
 
-        if (flock(m_fd, LOCK_UN) != 0) {
+        if (r != 0) {
             throw std::runtime_error("Failed to unlock file '" +
-                m_path.string() + "': " + strerror(errno));
+                m_path.string() + "': " + strerror(err));
         }
     }
 
@@ -107,7 +150,9 @@ public:
 
 private:
     std::filesystem::path m_path;
-    std::mutex m_mutex;
+    std::shared_mutex m_mutex;
+    std::mutex m_shared_mutex;
+    size_t m_shared_count = 0;
     int m_fd = -1;
 };
 
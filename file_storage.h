@@ -21,28 +21,122 @@
 #pragma once
 
 #include "sepulca.h"
+#include "binary_codec.h"
 #include "file_lock.h"
+#include "file_sync.h"
+#include "striped_file_lock.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+#include "shared_counters.h"
+#include "sepulca_cache.h"
+#include "group_commit.h"
+#include "io_uring_reader.h"
+#include "id_filter.h"
+#include <charconv>
 #include <fstream>
 #include <iostream>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <shared_mutex>
 
 #define SEPULCA_SIG "Sepulca v1"
+#define SEPULCA_MAGIC "Sepulca"
 
 namespace cosmica
 {
 
+/**
+ * Durability of file storage writes.
+ */
+enum class file_durability
+{
+    /**
+     * Cells are rewritten in place. A crash may leave a torn cell.
+     */
+    none,
+
+    /**
+     * Cells are written to a temporary file renamed over the cell, so
+     * a cell is never partially written. After a crash, a cell has either
+     * the old or the new contents on file systems flushing data before
+     * renames (as ext4 does by default). Changes appended to a cell by
+     * commits are ignored unless completely written.
+     */
+    atomic,
+
+    /**
+     * As atomic, and every write is on disk when it returns. Writers sync
+     * the cells they write, and concurrent writers share the syncs of
+     * the directories holding them (group commit).
+     */
+    sync
+};
+
+/**
+ * Format of file storage cells.
+ */
+enum class cell_format
+{
+    /**
+     * Text lines, see file_storage::do_parse_v1(). Attribute names and
+     * values cannot contain line breaks, and names cannot be empty.
+     */
+    v1 = 1,
+
+    /**
+     * Binary records with length-prefixed names and values and
+     * checksums, see file_storage::do_parse_v2().
+     */
+    v2 = 2
+};
+
+/**
+ * File storage tuning options.
+ */
+struct file_storage_options
+{
+    /**
+     * Maximum number of sepulcas kept in the in-process cache.
+     * Zero disables the cache.
+     */
+    size_t cache_entries = 0;
+
+    /**
+     * Approximate maximum memory used by the cache; zero means no limit.
+     */
+    size_t cache_bytes = 0;
+
+    /**
+     * Durability of commits, creations and erasures. Batches are always
+     * synced, see storage::apply().
+     */
+    file_durability durability = file_durability::atomic;
+
+    /**
+     * Format of cells written. Cells of both formats are read; cells of
+     * the other format are rewritten when committed or by migrate().
+     */
+    cell_format format = cell_format::v2;
+};
+
 class file_storage : public storage
 {
 public:
     /**
      * Opens sepulca file storage for the given path.
      */
-    explicit file_storage(const std::filesystem::path &dir) :
-        m_dir(dir)
+    explicit file_storage(const std::filesystem::path &dir,
+                          file_storage_options opts = {}) :
+        m_dir(dir),
+        m_durability(opts.durability),
+        m_format(opts.format)
     {
         auto s = std::filesystem::status(m_dir);
         if (s.type() == std::filesystem::file_type::not_found) {
-            std::cout << "File storage '" << dir.string()
+            std::cerr << "File storage '" << dir.string()
                 << "' not found, creating new."
                 << std::endl;
 
@@ -53,146 +147,2380 @@ public:
         }
 
         m_lock = std::make_unique<file_lock>(dir / "lock.txt");
+        m_stripes = std::make_unique<striped_file_lock>(dir / "lock.txt",
+                                                        lock_stripes);
+        m_counters = std::make_unique<shared_counters>(dir / "lock.txt",
+                                                       counters_count);
+
+        // Finish an interrupted migration to the sharded layout, and use
+        // the sharded layout for new storages.
+        if (!std::filesystem::exists(m_dir / sharded_marker) ||
+            std::filesystem::exists(m_dir / sharding_marker)) {
+            std::lock_guard guard(*m_lock);
+            if (std::filesystem::exists(m_dir / sharding_marker)) {
+                do_shard();
+            } else if (!std::filesystem::exists(m_dir / sharded_marker) &&
+                       do_list_dir_cells(m_dir, [](const sepulca_id &) {
+                           return false;
+                       })) {
+                std::ofstream(m_dir / sharded_marker).close();
+                m_counters->increment(layout_generation);
+            }
+        }
+
+        if (opts.cache_entries > 0) {
+            m_cache = std::make_unique<sepulca_cache>(opts.cache_entries,
+                                                      opts.cache_bytes);
+        }
+
+        if (m_durability == file_durability::sync) {
+            m_group_commit = std::make_unique<group_commit>([this] {
+                do_flush_dirs();
+            });
+        }
+
+        // Finish or roll back a batch interrupted by a crash.
+        if (std::filesystem::exists(get_batch_dir())) {
+            std::lock_guard guard(*m_lock);
+            do_recover_batch();
+        }
+
+        // Remove temporary cells of writers which have crashed.
+        if (m_counters->load(temp_cells) != 0) {
+            do_lock_exclusive();
+        }
+
+        // Build the identifier filter if it is missing or stale.
+        do_check_filter();
+
+        // Rebuild indexes whose building has been interrupted.
+        for (const auto &name : do_list_indexes(false)) {
+            std::lock_guard guard(*m_lock);
+            if (!std::filesystem::exists(get_index_dir(name) / "ready")) {
+                do_build_index(name);
+            }
+        }
     }
 
     virtual ~file_storage() override = default;
 
     virtual sepulca_ptr create(attributes attrs = {}) override
     {
-        std::lock_guard guard(*m_lock);
+        scoped_timer timer(timer_metric::create);
+        do_check_filter();
+        auto guard = do_lock_shared();
 
+        // Holding the stripe of a candidate identifier is enough to make
+        // the uniqueness check and the first write atomic: any other writer
+        // of the same identifier needs the same stripe.
+        const auto filter = do_get_filter();
         sepulca_id_generator gen;
-        sepulca_id sid;
-        do {
-            sid = gen.new_id();
-        } while (do_check_exists(sid));
-
-        auto s = new_sepulca(std::move(sid), std::move(attrs));
-        do_serialize(*s);
-        return s;
+        for (;;) {
+            auto sid = gen.new_id();
+            std::lock_guard stripe_guard(get_stripe(sid));
+            if (!do_check_exists(sid, filter.get())) {
+                auto s = new_sepulca(std::move(sid), std::move(attrs), 1);
+                do_index_markers(do_get_indexes(), s->get_id(),
+                                 &s->get_attrs(), nullptr, true);
+                do_serialize(s->get_id(), s->get_attrs(), 1);
+                do_cell_changed(s->get_id(), &s->get_attrs(), 1);
+                return s;
+            }
+        }
     }
 
     virtual sepulca_ptr get(const sepulca_id &sid) const override
     {
-        std::lock_guard guard(*m_lock);
+        scoped_timer timer(timer_metric::get);
+        auto guard = do_lock_shared();
+        std::shared_lock stripe_guard(get_stripe(sid));
 
-        auto s = do_deserialize(get_cell_path(sid));
+        auto s = do_load(sid);
         if (!s) {
-            throw std::runtime_error("Sepulca '" + sid + "' not found");
+            throw std::runtime_error("Sepulca '" + sid.to_string() +
+                "' not found");
         }
         return s;
     }
 
     virtual bool exists(const sepulca_id &sid) const override
     {
-        std::lock_guard guard(*m_lock);
+        scoped_timer timer(timer_metric::exists);
+        auto guard = do_lock_shared();
+
+        return do_check_exists(sid, do_get_filter().get());
+    }
+
+    /**
+     * Loads all sepulcas under a single acquisition of the storage lock
+     * and of the involved stripes, reading the cells through an io_uring,
+     * or one by one if it is not available.
+     */
+    virtual std::vector<sepulca_ptr> get_many(
+        std::span<const sepulca_id> ids) const override
+    {
+        scoped_timer timer(timer_metric::get_many);
+        std::vector<sepulca_ptr> res;
+        do_load_many(ids, do_acquire_reader(), res);
+        return res;
+    }
+
+    /**
+     * Checks all cells under a single acquisition of the storage lock
+     * and of the involved stripes.
+     */
+    virtual std::vector<bool> exists_many(
+        std::span<const sepulca_id> ids) const override
+    {
+        auto guard = do_lock_shared();
+        const auto stripe_guards = do_lock_stripes(ids);
+        const auto filter = do_get_filter();
 
-        return do_check_exists(sid);
+        std::vector<bool> res(ids.size());
+        for (const auto i : get_layout_order(ids)) {
+            res[i] = do_check_exists(ids[i], filter.get());
+        }
+        return res;
     }
 
+    /**
+     * Cells are loaded in batches, and callbacks for a batch are made
+     * after releasing the storage lock, so that they may use the storage.
+     */
     virtual void enumerate(std::function<bool(sepulca_ptr)> cb) const override
     {
-        std::lock_guard guard(*m_lock);
+        std::vector<sepulca_ptr> loaded;
+        do_for_each_cell([&](const sepulca_id &sid) {
+            if (auto s = do_deserialize(get_cell_path(sid))) {
+                loaded.push_back(std::move(s));
+            }
+        }, [&] {
+            for (auto &s : loaded) {
+                if (!cb(std::move(s))) {
+                    return false;
+                }
+            }
+            loaded.clear();
+            return true;
+        });
+    }
+
+    /**
+     * Lists cell file names without opening the files. Sharded storages
+     * are listed one shard at a time, and callbacks for the shard are made
+     * after releasing the storage lock.
+     */
+    virtual void enumerate_ids(
+        std::function<bool(const sepulca_id &)> cb) const override
+    {
+        std::vector<sepulca_id> ids;
+        auto collect = [&](const sepulca_id &sid) {
+            ids.push_back(sid);
+            return true;
+        };
+        auto deliver = [&] {
+            for (const auto &sid : ids) {
+                if (!cb(sid)) {
+                    return false;
+                }
+            }
+            ids.clear();
+            return true;
+        };
+
+        auto guard = do_lock_shared();
+
+        if (!do_is_sharded()) {
+            do_list_dir_cells(m_dir, collect);
+            guard.unlock();
+            deliver();
+            return;
+        }
 
-        for(const auto &dir_ent : std::filesystem::directory_iterator(m_dir)) {
-            if (dir_ent.path() == m_lock->get_lock_file_path()) {
+        // Directories are iterated with the lock held; a storage never
+        // goes back from the sharded layout, and shards are never removed.
+        for (const auto &l1 : std::filesystem::directory_iterator(m_dir)) {
+            if (!is_shard_name(l1.path().filename().native()) ||
+                !l1.is_directory()) {
                 continue;
             }
 
-            auto s = do_deserialize(dir_ent.path());
-            if (s) {
-                if (!cb(std::move(s))) {
-                    break;
+            for (const auto &l2 :
+                 std::filesystem::directory_iterator(l1.path())) {
+                if (!is_shard_name(l2.path().filename().native())) {
+                    continue;
+                }
+
+                do_list_dir_cells(l2.path(), collect);
+                guard.unlock();
+                if (!deliver()) {
+                    return;
                 }
+                guard.lock();
             }
         }
     }
 
-protected:
-    virtual void erase(sepulca &s) override
+    /**
+     * Lists the cells and loads them on a pool of worker threads.
+     * Every cell is loaded under the storage lock and its stripe, and
+     * callbacks are made with no lock held.
+     */
+    virtual void parallel_enumerate(std::function<bool(sepulca_ptr)> cb,
+                                    enumerate_options opts = {})
+        const override
     {
-        std::lock_guard guard(*m_lock);
+        std::vector<sepulca_id> cells;
+        {
+            auto guard = do_lock_shared();
+            do_list_cells([&](const sepulca_id &sid) {
+                cells.push_back(sid);
+                return true;
+            });
+        }
+        if (opts.ordered) {
+            std::sort(cells.begin(), cells.end());
+        }
 
-        if (!do_check_exists(s.get_id())) {
-            throw std::runtime_error("Sepulca '" + s.get_id() +
-                "' has been already destroyed");
+        thread_pool pool(opts.threads);
+        parallel_produce<sepulca_ptr>(pool, cells.size(),
+            [&](size_t i) {
+                auto guard = do_lock_shared();
+                std::shared_lock stripe_guard(get_stripe(cells[i]));
+                return do_deserialize(get_cell_path(cells[i]));
+            },
+            [&](sepulca_ptr s) {
+                return !s || cb(std::move(s));
+            },
+            opts.ordered);
+    }
+
+    /**
+     * Shard directories are named by identifier prefixes, so they are
+     * listed in the order of identifiers from the shard of `start_after`
+     * up to the one completing the batch. Cells are not opened.
+     */
+    virtual std::vector<sepulca_id> scan_ids(
+        std::optional<sepulca_id> start_after, size_t limit) const override
+    {
+        auto guard = do_lock_shared();
+
+        if (!do_is_sharded()) {
+            scan_window window(start_after, limit);
+            do_list_dir_cells(m_dir, [&](const sepulca_id &sid) {
+                window.add(sid);
+                return true;
+            });
+            return window.take();
         }
 
-        std::filesystem::remove(get_cell_path(s));
+        const auto start = start_after ? get_cell_dir(*start_after, true) :
+            m_dir / "00" / "00";
+        const auto start_l1 = start.parent_path().filename().string();
+        const auto start_l2 = start.filename().string();
+
+        std::vector<sepulca_id> ids;
+        for (const auto &l1 : list_shard_dirs(m_dir, start_l1)) {
+            for (const auto &l2 : list_shard_dirs(
+                     m_dir / l1, l1 == start_l1 ? start_l2 : "00")) {
+                scan_window window(start_after, limit - ids.size());
+                do_list_dir_cells(m_dir / l1 / l2, [&](const sepulca_id &sid) {
+                    window.add(sid);
+                    return true;
+                });
+
+                const auto part = window.take();
+                ids.insert(ids.end(), part.begin(), part.end());
+                if (ids.size() == limit) {
+                    return ids;
+                }
+            }
+        }
+        return ids;
     }
 
-    virtual void commit(sepulca &s) override
+    /**
+     * The cell is parsed under the storage lock and its stripe, and
+     * the callback is made after releasing them, so that it may use
+     * the storage; see do_hold_cell().
+     */
+    virtual void visit(const sepulca_id &sid,
+                       std::function<void(const sepulca_view &)> cb)
+        const override
     {
-        std::lock_guard guard(*m_lock);
+        held_cell cell;
+        sepulca_view view;
+        {
+            auto guard = do_lock_shared();
+            std::shared_lock stripe_guard(get_stripe(sid));
+            if (!do_hold_cell(sid, cell) ||
+                !do_parse(cell.data, get_cell_path(sid), view)) {
+                throw std::runtime_error("Sepulca '" + sid.to_string() +
+                    "' not found");
+            }
+        }
+        cb(view);
+    }
 
-        do_serialize(s);
+    /**
+     * Cells are parsed in batches, and callbacks are made for a batch
+     * after releasing the storage lock, as by visit().
+     */
+    virtual void enumerate_views(
+        std::function<bool(const sepulca_view &)> cb) const override
+    {
+        // Entries are reused to keep the memory of views between batches.
+        std::vector<std::pair<held_cell, sepulca_view>> cells;
+        size_t count = 0;
+        do_for_each_cell([&](const sepulca_id &sid) {
+            if (count == cells.size()) {
+                cells.emplace_back();
+            }
+            auto &[cell, view] = cells[count];
+            if (do_hold_cell(sid, cell) &&
+                do_parse(cell.data, get_cell_path(sid), view)) {
+                ++count;
+            }
+        }, [&] {
+            for (size_t i = 0; i < count; ++i) {
+                if (!cb(cells[i].second)) {
+                    return false;
+                }
+            }
+            for (size_t i = 0; i < count; ++i) {
+                cells[i].first = {};
+            }
+            count = 0;
+            return true;
+        });
     }
 
-private:
-    bool do_check_exists(const sepulca_id &sid) const {
-        return std::filesystem::is_regular_file(get_cell_path(sid));
+    /**
+     * Applies the batch under the exclusive storage lock.
+     *
+     * New cell contents and a journal of the batch are first written to
+     * the "batch" directory and synced to disk. Renaming the journal into
+     * place is the commit point: after it, the cells are moved into the
+     * storage and erased cells are removed. A batch interrupted by a crash
+     * is finished before the next operation of any process if its journal
+     * has been committed, and discarded otherwise.
+     */
+    virtual std::vector<sepulca_ptr> apply(const write_batch &batch) override
+    {
+        scoped_timer timer(timer_metric::apply);
+        auto guard = do_lock_exclusive();
+        const auto filter = do_refresh_filter();
+
+        // Resolve the final state of every sepulca touched by the batch,
+        // validating the operations before anything is written.
+        // Erased sepulcas are mapped to null.
+        std::map<sepulca_id, const attributes *> cells;
+        std::vector<std::pair<sepulca_id, const attributes *>> created;
+        sepulca_id_generator gen;
+
+        // Versions of written cells, at first the versions they must
+        // exceed.
+        std::map<sepulca_id, uint64_t> versions;
+
+        for (const auto &op : batch.get_ops()) {
+            switch (op.type) {
+            case write_batch::op_type::create: {
+                sepulca_id sid;
+                do {
+                    sid = gen.new_id();
+                } while (cells.contains(sid) ||
+                         do_check_exists(sid, filter.get()));
+
+                cells[sid] = &op.attrs;
+                created.emplace_back(sid, &op.attrs);
+                break;
+            }
+            case write_batch::op_type::put: {
+                cells[op.sid] = &op.attrs;
+                auto &version = versions[op.sid];
+                version = std::max(version, op.version);
+                break;
+            }
+            case write_batch::op_type::erase: {
+                auto i = cells.find(op.sid);
+                if (i != cells.end() ? !i->second
+                                     : !do_check_exists(op.sid, filter.get())) {
+                    throw std::runtime_error("Sepulca '" +
+                        op.sid.to_string() + "' has been already destroyed");
+                }
+                cells[op.sid] = nullptr;
+                break;
+            }
+            }
+        }
+
+        // Index entries of new values are added before the batch and
+        // entries of old values are removed after it, so that a crash
+        // leaves at most stale entries, which lookups skip. Written cells
+        // get the next versions of the old ones.
+        const auto indexes = do_get_indexes();
+        std::map<sepulca_id, sepulca_ptr> old;
+        for (const auto &[sid, attrs] : cells) {
+            if (attrs || !indexes.empty()) {
+                old[sid] = do_load(sid);
+            }
+            if (attrs) {
+                auto &version = versions[sid];
+                version = std::max(version, old[sid] ?
+                                   old[sid]->get_version() : 0) + 1;
+            }
+        }
+
+        auto old_attrs = [&](const sepulca_id &sid) -> const attributes * {
+            auto i = old.find(sid);
+            return i != old.end() && i->second ? &i->second->get_attrs()
+                                               : nullptr;
+        };
+
+        for (const auto &[sid, attrs] : cells) {
+            do_index_markers(indexes, sid, attrs, old_attrs(sid), true);
+        }
+
+        if (!cells.empty()) {
+            do_write_batch(cells, [&](const sepulca_id &sid) {
+                return versions.at(sid);
+            });
+        }
+
+        for (const auto &[sid, attrs] : cells) {
+            do_index_markers(indexes, sid, old_attrs(sid), attrs, false);
+        }
+        finish_commits(batch, [&](const sepulca_id &sid) {
+            return cells.at(sid) ? std::optional(versions.at(sid))
+                                 : std::nullopt;
+        });
+
+        std::vector<sepulca_ptr> res;
+        res.reserve(created.size());
+        for (auto &[sid, attrs] : created) {
+            res.push_back(new_sepulca(std::move(sid), attributes(*attrs), 1));
+        }
+        return res;
     }
 
-    void do_serialize(sepulca &s)
+    virtual void create_index(const std::string &name) override
     {
-        std::ofstream ofs(get_cell_path(s), std::ofstream::trunc);
+        if (name.empty()) {
+            throw std::runtime_error("Cannot index an empty attribute name");
+        }
+
+        auto guard = do_lock_exclusive();
 
-        ofs << SEPULCA_SIG << "\n" << s.get_id() << "\n";
-        for (const auto &[k, v] : s.get_attrs()) {
-            ofs << k << "\n" << v << "\n";
+        if (!std::filesystem::exists(get_index_dir(name) / "ready")) {
+            do_build_index(name);
         }
     }
 
-    sepulca_ptr do_deserialize(const std::filesystem::path &p) const
+    virtual void drop_index(const std::string &name) override
     {
-        std::ifstream ifs(p);
+        auto guard = do_lock_exclusive();
 
-        std::string sig, sid;
-        std::getline(ifs, sig);
-        if (sig != SEPULCA_SIG) {
-            std::cerr << "Invalid Sepulca file signature: " << p << std::endl;
-            return {};
+        if (!std::filesystem::remove_all(get_index_dir(name))) {
+            throw std::runtime_error("Attribute '" + name +
+                "' is not indexed");
         }
+        m_counters->increment(indexes_generation);
+    }
 
-        std::getline(ifs, sid);
-        if (sid.empty()) {
-            std::cerr << "Invalid Sepulca identifier in file: " << p
-                << std::endl;
-            return {};
+    virtual std::vector<std::string> get_indexes() const override
+    {
+        auto guard = do_lock_shared();
+
+        return do_get_indexes();
+    }
+
+    /**
+     * Checks if cells are fanned out into nested directories by their
+     * identifiers' prefixes, e.g. "ab/cd/{abcd-...}.txt", instead of being
+     * kept in the storage directory itself.
+     */
+    bool is_sharded() const
+    {
+        auto guard = do_lock_shared();
+
+        return do_is_sharded();
+    }
+
+    /**
+     * Moves cells of a storage with the flat layout into the sharded one
+     * in place. Does nothing if the storage is sharded already.
+     *
+     * The migration holds the storage lock exclusively and is resumed
+     * at the next open if interrupted.
+     */
+    void shard()
+    {
+        auto guard = do_lock_exclusive();
+
+        if (!do_is_sharded()) {
+            do_shard();
         }
+    }
 
-        attributes attrs;
-        while (ifs) {
-            std::string k, v;
-            std::getline(ifs, k);
-            if (!k.empty()) {
-                std::getline(ifs, v);
-                attrs.emplace(std::pair(std::move(k), std::move(v)));
-            } else {
-                break;
+    /**
+     * Rewrites cells of the other format in the configured one, see
+     * file_storage_options::format, folding change records appended by
+     * commits. Returns the number of cells rewritten.
+     *
+     * The migration holds the storage lock exclusively; if interrupted,
+     * it is completed by running it again.
+     */
+    size_t migrate()
+    {
+        auto guard = do_lock_exclusive();
+
+        std::vector<sepulca_id> ids;
+        do_list_cells([&](const sepulca_id &sid) {
+            ids.push_back(sid);
+            return true;
+        });
+
+        size_t count = 0;
+        for (const auto &sid : ids) {
+            const auto p = get_cell_path(sid);
+            attributes attrs;
+            uint64_t version;
+            {
+                sepulca_view view;
+                cell_layout layout;
+                mapped_file file(p);
+                if (!file || !do_parse(file.data(), p, view, &layout) ||
+                    (layout.format == m_format && !layout.has_changes)) {
+                    continue;
+                }
+                attrs = get_attributes(view);
+                version = view.get_version();
+            }
+
+            // The contents stay the same, so cached copies stay valid.
+            do_serialize(sid, attrs, version);
+            ++count;
+        }
+        return count;
+    }
+
+    /**
+     * Looks up the index of the attribute, if any, and loads the sepulcas
+     * it refers to. Index entries are verified against the loaded
+     * sepulcas, so stale entries and hash collisions are skipped.
+     */
+    virtual std::vector<sepulca_ptr> find(const std::string &name,
+                                          const std::string &value)
+        const override
+    {
+        auto guard = do_lock_shared();
+
+        const auto dir = get_index_dir(name);
+        if (!std::filesystem::exists(dir / "ready")) {
+            guard.unlock();
+            return storage::find(name, value);
+        }
+
+        std::vector<sepulca_id> ids;
+        const auto bucket = dir / get_index_bucket(value);
+        std::error_code ec;
+        for (const auto &ent :
+             std::filesystem::directory_iterator(bucket, ec)) {
+            if (auto sid = sepulca_id::parse(ent.path().filename().native())) {
+                ids.push_back(*sid);
             }
         }
+        std::sort(ids.begin(), ids.end());
 
-        return new_sepulca(std::move(sid), std::move(attrs));
+        std::vector<sepulca_ptr> res;
+        for (const auto &sid : ids) {
+            std::shared_lock stripe_guard(get_stripe(sid));
+            if (auto s = do_deserialize(get_cell_path(sid))) {
+                auto i = s->get_attrs().find(name);
+                if (i != s->get_attrs().end() && i->second == value) {
+                    res.push_back(std::move(s));
+                }
+            }
+        }
+        return res;
     }
 
-    std::filesystem::path get_cell_path(const sepulca_id &sid) const {
-        return (m_dir / sid).replace_extension("txt");
+protected:
+    virtual void erase(sepulca &s) override
+    {
+        scoped_timer timer(timer_metric::erase);
+        auto guard = do_lock_shared();
+        std::lock_guard stripe_guard(get_stripe(s.get_id()));
+
+        if (!do_check_exists(s.get_id(), do_get_filter().get())) {
+            throw std::runtime_error("Sepulca '" + s.get_id().to_string() +
+                "' has been already destroyed");
+        }
+
+        const auto indexes = do_get_indexes();
+        sepulca_ptr old;
+        if (!indexes.empty()) {
+            old = do_load(s.get_id());
+        }
+
+        const auto p = get_cell_path(s);
+        std::filesystem::remove(p);
+        do_cell_changed(s.get_id(), nullptr, 0);
+        if (m_group_commit) {
+            do_sync_dir(p.parent_path());
+        }
+
+        if (old) {
+            do_index_markers(indexes, s.get_id(), &old->get_attrs(), nullptr,
+                             false);
+        }
     }
 
-    std::filesystem::path get_cell_path(const sepulca &s) const {
-        return get_cell_path(s.get_id());
+    /**
+     * Reads the cell for its version and attributes first, so that
+     * the version check and the write are atomic under the stripe.
+     */
+    virtual std::optional<uint64_t> commit(
+        sepulca &s, std::optional<uint64_t> expected) override
+    {
+        scoped_timer timer(timer_metric::commit);
+        auto guard = do_lock_shared();
+        std::lock_guard stripe_guard(get_stripe(s.get_id()));
+
+        const auto p = get_cell_path(s);
+        stored_cell old;
+        {
+            sepulca_view view;
+            mapped_file file(p);
+            if (file && do_parse(file.data(), p, view, &old.layout)) {
+                old.attrs = get_attributes(view);
+                old.version = view.get_version();
+                old.size = file.data().size();
+                old.found = true;
+            }
+        }
+
+        if (expected && *expected != old.version) {
+            return {};
+        }
+        const auto version = std::max(old.version, s.get_version()) + 1;
+
+        const auto indexes = do_get_indexes();
+        if (const auto *changed = s.get_changed_attrs();
+            changed && old.found && !old.layout.torn &&
+            old.layout.format == m_format) {
+            do_commit_changes(s, *changed, indexes, old, version);
+            return version;
+        }
+
+        const attributes *old_attrs = old.found ? &old.attrs : nullptr;
+        do_index_markers(indexes, s.get_id(), &s.get_attrs(), old_attrs, true);
+        do_serialize(s.get_id(), s.get_attrs(), version);
+        do_cell_changed(s.get_id(), &s.get_attrs(), version);
+        do_index_markers(indexes, s.get_id(), old_attrs, &s.get_attrs(), false);
+        return version;
     }
 
-    sepulca_ptr new_sepulca(sepulca_id &&sid, attributes &&attrs) const
+    /**
+     * Reads all cells through an io_uring, see do_load_many().
+     * Cannot overlap loads if io_uring is not available.
+     */
+    virtual bool load_many(std::span<const sepulca_id> ids,
+                           std::vector<sepulca_ptr> &res) const override
     {
-        return sepulca_ptr(new sepulca(const_cast<file_storage&>(*this),
-                                       std::move(sid),
-                                       std::move(attrs)));
+        auto reader = do_acquire_reader();
+        if (!reader) {
+            return false;
+        }
+
+        do_load_many(ids, std::move(reader), res);
+        return true;
     }
 
-    const std::filesystem::path m_dir;
-    mutable std::unique_ptr<file_lock> m_lock;
+private:
+    /**
+     * Layout of cell file contents, see do_parse().
+     */
+    struct cell_layout
+    {
+        cell_format format = cell_format::v2;
+
+        // Change records follow the attributes.
+        bool has_changes = false;
+
+        // The last change record is incomplete and has been ignored.
+        bool torn = false;
+    };
+
+    /**
+     * Header of a v2 cell. Fields are stored in the host byte order.
+     */
+    struct cell_header
+    {
+        char magic[8];      // SEPULCA_MAGIC
+        uint32_t format;    // cell_format::v2
+        uint32_t size;      // Size of the body following the header.
+        uint32_t checksum;  // Checksum of the body.
+        uint32_t reserved;  // Zero.
+    };
+    static_assert(sizeof(cell_header) == 24);
+
+    /**
+     * Operations of v2 change records.
+     */
+    enum change_op : uint8_t
+    {
+        assign_attr = 0,    // Name and value follow.
+        erase_attr = 1,     // Name follows.
+    };
+
+    /**
+     * State of a cell read before committing over it.
+     */
+    struct stored_cell
+    {
+        bool found = false;
+        attributes attrs;
+        uint64_t version = 0;
+        size_t size = 0;
+        cell_layout layout;
+    };
+
+    /**
+     * Loads sepulcas into `res` under a single acquisition of the storage
+     * lock and of the involved stripes, in the layout order of their cells.
+     * Cells are read through the reader, if any, which is released
+     * afterwards; otherwise they are read one by one.
+     */
+    void do_load_many(std::span<const sepulca_id> ids,
+                      std::unique_ptr<io_uring_reader> reader,
+                      std::vector<sepulca_ptr> &res) const
+    {
+        auto guard = do_lock_shared();
+        const auto stripe_guards = do_lock_stripes(ids);
+
+        res.clear();
+        res.resize(ids.size());
+
+        std::vector<size_t> pending;
+        std::vector<std::filesystem::path> paths;
+        std::vector<uint64_t> gens;
+        for (const auto i : get_layout_order(ids)) {
+            if (m_cache) {
+                const auto gen = m_counters->load(
+                    get_generation_counter(ids[i]));
+                uint64_t version;
+                if (auto attrs = m_cache->get(ids[i], gen, version)) {
+                    auto id = ids[i];
+                    res[i] = new_sepulca(std::move(id), attributes(*attrs),
+                                         version);
+                    continue;
+                }
+                gens.push_back(gen);
+            }
+            pending.push_back(i);
+            paths.push_back(get_cell_path(ids[i]));
+        }
+
+        const bool overlapped = reader != nullptr;
+        std::vector<std::optional<std::string>> contents;
+        if (overlapped) {
+            reader->read_files(paths, contents);
+            do_release_reader(std::move(reader));
+        }
+
+        sepulca_view view;
+        for (size_t j = 0; j < pending.size(); ++j) {
+            sepulca_ptr s;
+            if (!overlapped) {
+                s = do_deserialize(paths[j]);
+            } else if (contents[j] && do_parse(*contents[j], paths[j], view)) {
+                s = do_materialize(view);
+            }
+            if (!s) {
+                continue;
+            }
+
+            if (m_cache) {
+                m_cache->put(s->get_id(), gens[j], s->get_attrs(),
+                             s->get_version());
+            }
+            res[pending[j]] = std::move(s);
+        }
+    }
+
+    /**
+     * Takes the stripes of the sepulcas shared, in the index order;
+     * writers hold a single stripe, so this cannot deadlock.
+     */
+    std::vector<std::shared_lock<striped_file_lock::stripe>> do_lock_stripes(
+        std::span<const sepulca_id> ids) const
+    {
+        std::vector<size_t> stripes;
+        stripes.reserve(ids.size());
+        for (const auto &sid : ids) {
+            stripes.push_back(get_stripe_index(sid));
+        }
+        std::sort(stripes.begin(), stripes.end());
+        stripes.erase(std::unique(stripes.begin(), stripes.end()),
+                      stripes.end());
+
+        std::vector<std::shared_lock<striped_file_lock::stripe>> guards;
+        guards.reserve(stripes.size());
+        for (const auto i : stripes) {
+            guards.emplace_back(m_stripes->get_stripe(i));
+        }
+        return guards;
+    }
+
+    /**
+     * Returns positions of the identifiers in the order of their values.
+     * Sharded cells are nested by the leading bytes of identifiers, so
+     * visiting cells in this order goes through shard directories one
+     * at a time.
+     */
+    static std::vector<size_t> get_layout_order(
+        std::span<const sepulca_id> ids)
+    {
+        std::vector<size_t> order(ids.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return ids[a] < ids[b];
+        });
+        return order;
+    }
+
+    /**
+     * Checks if the cell exists, skipping the file system for identifiers
+     * the filter, if any, has never seen.
+     */
+    bool do_check_exists(const sepulca_id &sid,
+                         const id_filter *filter) const
+    {
+        if (filter && !filter->may_contain(sid)) {
+            return false;
+        }
+        return std::filesystem::is_regular_file(get_cell_path(sid));
+    }
+
+    /**
+     * Appends a record of the changed attributes of the sepulca and its
+     * new version to its cell, so that only the changes are written.
+     * Once appended records outgrow the attributes, the cell is rewritten
+     * instead, folding them. Either way, the changes are merged with
+     * the cell contents rather than overwriting attributes committed
+     * meanwhile by others, and the sepulca gets the merged attributes.
+     *
+     * The cell must exist in the configured format and have no torn
+     * record. The stripe of the sepulca must be owned exclusively.
+     */
+    void do_commit_changes(sepulca &s,
+                           const std::vector<std::string_view> &changed,
+                           const std::vector<std::string> &indexes,
+                           const stored_cell &old, uint64_t version)
+    {
+        auto attrs = old.attrs;
+        for (const auto name : changed) {
+            if (auto i = s.get_attrs().find(name); i != s.get_attrs().end()) {
+                attrs.insert_or_assign(name, i->second);
+            } else {
+                attrs.erase(name);
+            }
+        }
+
+        std::string record;
+        if (m_format == cell_format::v1) {
+            encode_changes_v1(record, s, changed, version,
+                              !old.layout.has_changes);
+        } else {
+            encode_changes_v2(record, s, changed, version);
+        }
+
+        do_index_markers(indexes, s.get_id(), &attrs, &old.attrs, true);
+        if (old.size + record.size() > 2 * get_cell_size(attrs)) {
+            do_serialize(s.get_id(), attrs, version);
+        } else {
+            do_append_cell(get_cell_path(s), record);
+        }
+        do_cell_changed(s.get_id(), &attrs, version);
+        do_index_markers(indexes, s.get_id(), &old.attrs, &attrs, false);
+        refresh_attrs(s, std::move(attrs));
+    }
+
+    /**
+     * Appends a change record to a cell with the configured durability.
+     * A torn record is ignored by do_parse(), so appending keeps commits
+     * atomic.
+     */
+    void do_append_cell(const std::filesystem::path &p,
+                        const std::string &record)
+    {
+        metrics::add(counter_metric::bytes_written, record.size());
+
+        // Appending changes no directory, so only the cell is synced.
+        int fd = open(p.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to write Sepulca file '" +
+                p.string() + "': " + strerror(errno));
+        }
+        write_file(fd, p, record, m_group_commit != nullptr);
+    }
+
+    /**
+     * Returns the approximate size of a cell holding just the given
+     * attributes and a version in the configured format.
+     */
+    size_t get_cell_size(const attributes &attrs) const
+    {
+        const bool v1 = m_format == cell_format::v1;
+        size_t size = v1 ?
+            sizeof(SEPULCA_SIG) + sepulca_id::text_size + 1 +
+                version_record_size :
+            sizeof(cell_header) + 2 * sizeof(uint64_t) + sizeof(uint32_t);
+        for (const auto &[k, v] : attrs) {
+            size += k.size() + v.size() + (v1 ? 2 : 2 * sizeof(uint32_t));
+        }
+        return size;
+    }
+
+    /**
+     * Writes the cell of the sepulca with the configured durability.
+     * The stripe of the sepulca must be owned exclusively.
+     */
+    void do_serialize(const sepulca_id &sid, const attributes &attrs,
+                      uint64_t version)
+    {
+        do_filter_add(sid);
+
+        const auto p = get_cell_path(sid);
+        if (m_durability == file_durability::none) {
+            do_write_cell(p, sid, attrs, version, false);
+            return;
+        }
+
+        // Owning the stripe makes the temporary file private to this
+        // writer; the listing skips it, as it has no cell extension.
+        // The file is counted until renamed or removed, so that it is
+        // removed if the writer crashes, see do_lock_exclusive().
+        //
+        // With syncs, the new contents must be on disk before they
+        // replace the old ones, and the replacement before returning.
+        auto tmp = p;
+        tmp.replace_extension(".tmp");
+        m_counters->increment(temp_cells);
+        try {
+            do_write_cell(tmp, sid, attrs, version, m_group_commit != nullptr);
+            std::filesystem::rename(tmp, p);
+        } catch (...) {
+            std::error_code ec;
+            std::filesystem::remove(tmp, ec);
+            m_counters->decrement(temp_cells);
+            throw;
+        }
+        m_counters->decrement(temp_cells);
+
+        if (m_group_commit) {
+            do_sync_dir(p.parent_path());
+        }
+    }
+
+    /**
+     * Writes a cell in the configured format, syncing its contents
+     * if requested.
+     */
+    void do_write_cell(const std::filesystem::path &p, const sepulca_id &sid,
+                       const attributes &attrs, uint64_t version, bool sync)
+    {
+        std::string data;
+        {
+            scoped_timer timer(timer_metric::serialize);
+            if (m_format == cell_format::v1) {
+                encode_cell_v1(data, sid, attrs, version);
+            } else {
+                encode_cell_v2(data, sid, attrs, version);
+            }
+        }
+        metrics::add(counter_metric::bytes_written, data.size());
+
+        constexpr int flags = O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC;
+        int fd = open(p.c_str(), flags, 0666);
+        if (fd == -1 && errno == ENOENT) {
+            // The first cell of a shard.
+            if (std::filesystem::create_directories(p.parent_path()) &&
+                sync) {
+                do_sync_new_dir(p.parent_path());
+            }
+            fd = open(p.c_str(), flags, 0666);
+        }
+        if (fd == -1) {
+            throw std::runtime_error("Failed to write Sepulca file '" +
+                p.string() + "': " + strerror(errno));
+        }
+        write_file(fd, p, data, sync);
+    }
+
+    /**
+     * Writes data to a file and closes it, syncing the data first
+     * if requested.
+     */
+    static void write_file(int fd, const std::filesystem::path &p,
+                           std::string_view data, bool sync)
+    {
+        while (!data.empty()) {
+            const auto n = write(fd, data.data(), data.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                auto err = errno;
+                close(fd);
+                throw std::runtime_error("Failed to write Sepulca file '" +
+                    p.string() + "': " + strerror(err));
+            }
+            data.remove_prefix(n);
+        }
+
+        if (sync && fdatasync(fd) != 0) {
+            auto err = errno;
+            close(fd);
+            throw std::runtime_error("Failed to sync Sepulca file '" +
+                p.string() + "': " + strerror(err));
+        }
+        close(fd);
+    }
+
+    /**
+     * Waits until the entries of a directory in which a cell has been
+     * written, replaced or removed are on disk. Concurrent writers share
+     * the syncs of their directories (group commit).
+     */
+    void do_sync_dir(const std::filesystem::path &dir)
+    {
+        {
+            std::lock_guard guard(m_sync_mutex);
+            m_sync_dirs.insert(dir);
+        }
+        m_group_commit->commit();
+    }
+
+    /**
+     * Syncs the directories requested by do_sync_dir() so far, leaving
+     * the ones not synced on errors for the next flush.
+     */
+    void do_flush_dirs()
+    {
+        std::set<std::filesystem::path> dirs;
+        {
+            std::lock_guard guard(m_sync_mutex);
+            dirs.swap(m_sync_dirs);
+        }
+
+        for (auto i = dirs.begin(); i != dirs.end(); i = dirs.erase(i)) {
+            try {
+                sync_file(*i);
+            } catch (...) {
+                std::lock_guard guard(m_sync_mutex);
+                m_sync_dirs.merge(dirs);
+                throw;
+            }
+        }
+    }
+
+    /**
+     * Syncs the parents of a directory just created within the storage
+     * directory, so that the directory survives a crash.
+     */
+    void do_sync_new_dir(const std::filesystem::path &dir) const
+    {
+        for (auto d = dir; d != m_dir && d.has_relative_path();
+             d = d.parent_path()) {
+            sync_file(d.parent_path());
+        }
+    }
+
+    /**
+     * Encodes a v1 cell: the signature, the identifier and lines of
+     * attribute names and values, followed by a record holding just
+     * the version.
+     */
+    static void encode_cell_v1(std::string &out, const sepulca_id &sid,
+                               const attributes &attrs, uint64_t version)
+    {
+        out.append(SEPULCA_SIG "\n").append(sid.to_string()).append("\n");
+        for (const auto &[k, v] : attrs) {
+            check_v1_text(k, true);
+            check_v1_text(v, false);
+            out.append(k).append("\n").append(v).append("\n");
+        }
+        out.append("\n@").append(std::to_string(version)).append("\n.\n");
+    }
+
+    /**
+     * Encodes a v1 change record, see apply_changes_v1(). The first record
+     * of a cell is preceded by an empty line ending the attributes.
+     */
+    static void encode_changes_v1(std::string &out, const sepulca &s,
+                                  const std::vector<std::string_view> &changed,
+                                  uint64_t version, bool first)
+    {
+        if (first) {
+            out.append("\n");
+        }
+        for (const auto name : changed) {
+            check_v1_text(name, true);
+            if (auto i = s.get_attrs().find(name); i != s.get_attrs().end()) {
+                check_v1_text(i->second, false);
+                out.append("=").append(name).append("\n");
+                out.append(i->second).append("\n");
+            } else {
+                out.append("-").append(name).append("\n");
+            }
+        }
+        out.append("@").append(std::to_string(version)).append("\n.\n");
+    }
+
+    /**
+     * Throws an exception if an attribute name or value cannot be stored
+     * in a v1 cell.
+     */
+    static void check_v1_text(std::string_view text, bool name)
+    {
+        if (text.find('\n') != std::string_view::npos ||
+            (name && text.empty())) {
+            throw std::runtime_error(std::string("Attribute ") +
+                (name ? "name" : "value") + " '" + std::string(text) +
+                "' cannot be stored in a v1 cell");
+        }
+    }
+
+    /**
+     * Encodes a v2 cell: the header and a body holding the identifier,
+     * the version and the attributes.
+     */
+    static void encode_cell_v2(std::string &out, const sepulca_id &sid,
+                               const attributes &attrs, uint64_t version)
+    {
+        const auto start = out.size();
+        out.resize(start + sizeof(cell_header));
+        put_u64(out, sid.value);
+        put_u64(out, version);
+        put_u32(out, static_cast<uint32_t>(attrs.size()));
+        for (const auto &[k, v] : attrs) {
+            put_string(out, k);
+            put_string(out, v);
+        }
+
+        const auto body = std::string_view(out).substr(
+            start + sizeof(cell_header));
+        if (body.size() > UINT32_MAX) {
+            throw std::runtime_error("Sepulca '" + sid.to_string() +
+                "' is too large");
+        }
+
+        cell_header h = {};
+        memcpy(h.magic, SEPULCA_MAGIC, sizeof(h.magic));
+        h.format = static_cast<uint32_t>(cell_format::v2);
+        h.size = static_cast<uint32_t>(body.size());
+        h.checksum = checksum(body);
+        memcpy(out.data() + start, &h, sizeof(h));
+    }
+
+    /**
+     * Encodes a v2 change record: the size and the checksum of a body
+     * holding the version and the changes, each an operation followed by
+     * the attribute name and, for assignments, the value.
+     */
+    static void encode_changes_v2(std::string &out, const sepulca &s,
+                                  const std::vector<std::string_view> &changed,
+                                  uint64_t version)
+    {
+        const auto start = out.size();
+        put_u32(out, 0);
+        put_u32(out, 0);
+        put_u64(out, version);
+        put_u32(out, static_cast<uint32_t>(changed.size()));
+        for (const auto name : changed) {
+            if (auto i = s.get_attrs().find(name); i != s.get_attrs().end()) {
+                put_u8(out, assign_attr);
+                put_string(out, name);
+                put_string(out, i->second);
+            } else {
+                put_u8(out, erase_attr);
+                put_string(out, name);
+            }
+        }
+
+        const auto body = std::string_view(out).substr(
+            start + 2 * sizeof(uint32_t));
+        const uint32_t fields[] = {
+            static_cast<uint32_t>(body.size()), checksum(body)
+        };
+        memcpy(out.data() + start, fields, sizeof(fields));
+    }
+
+    void do_write_batch(
+        const std::map<sepulca_id, const attributes *> &cells,
+        const std::function<uint64_t(const sepulca_id &)> &get_version)
+    {
+        const auto bdir = get_batch_dir();
+        std::filesystem::remove_all(bdir);
+        std::filesystem::create_directory(bdir);
+
+        std::ofstream journal(bdir / "journal.tmp");
+        for (const auto &[sid, attrs] : cells) {
+            if (attrs) {
+                do_write_cell(bdir / get_cell_name(sid), sid, *attrs,
+                              get_version(sid), true);
+                journal << "put " << sid << "\n";
+            } else {
+                journal << "erase " << sid << "\n";
+            }
+        }
+
+        journal.close();
+        if (!journal) {
+            throw std::runtime_error("Failed to write batch journal in '" +
+                bdir.string() + "'");
+        }
+
+        // The cells have been synced; their entries and the journal must be
+        // on disk before the commit point.
+        sync_file(bdir / "journal.tmp");
+        sync_file(bdir);
+        m_counters->increment(batch_pending);
+        std::filesystem::rename(bdir / "journal.tmp", bdir / "journal");
+        sync_file(bdir);
+
+        do_recover_batch();
+    }
+
+    /**
+     * Applies a committed batch journal and removes the batch directory.
+     * Replaying a journal more than once is harmless.
+     * The storage lock must be owned exclusively.
+     */
+    void do_recover_batch() const
+    {
+        const auto bdir = get_batch_dir();
+
+        std::ifstream journal(bdir / "journal");
+        std::set<std::filesystem::path> dirs;
+        std::string op, id;
+        while (journal >> op >> id) {
+            auto sid = sepulca_id::parse(id);
+            if (!sid) {
+                throw std::runtime_error("Corrupted batch journal in '" +
+                    bdir.string() + "'");
+            }
+
+            if (op == "put") {
+                auto p = bdir / get_cell_name(*sid);
+                if (std::filesystem::exists(p)) {
+                    do_filter_add(*sid);
+                    const auto cell = get_cell_path(*sid);
+                    if (std::filesystem::create_directories(
+                            cell.parent_path())) {
+                        do_sync_new_dir(cell.parent_path());
+                    }
+                    std::filesystem::rename(p, cell);
+                    dirs.insert(cell.parent_path());
+                }
+            } else {
+                const auto cell = get_cell_path(*sid);
+                std::filesystem::remove(cell);
+                dirs.insert(cell.parent_path());
+            }
+            do_cell_changed(*sid, nullptr, 0);
+        }
+
+        // The cells are in place once the directories holding them are
+        // on disk; only then may the journal go.
+        for (const auto &dir : dirs) {
+            sync_file(dir);
+        }
+        std::filesystem::remove_all(bdir);
+        m_counters->store(batch_pending, 0);
+    }
+
+    /**
+     * Takes the storage lock in the shared mode, first finishing a batch
+     * whose writer has crashed after committing it, so that neither reads
+     * nor writes see the storage half-way through the batch.
+     */
+    std::shared_lock<file_lock> do_lock_shared() const
+    {
+        if (m_counters->load(batch_pending) != 0) {
+            do_lock_exclusive();
+        }
+        return std::shared_lock(*m_lock);
+    }
+
+    /**
+     * Takes the storage lock exclusively, first finishing a batch whose
+     * writer has crashed after committing it. A journal found without
+     * the pending counter, e.g. left by a crash of the whole system before
+     * the counter was written back, is finished as well.
+     *
+     * Cells are written under the shared lock, so temporary cells still
+     * counted at this point have been left by crashed writers.
+     */
+    std::unique_lock<file_lock> do_lock_exclusive() const
+    {
+        std::unique_lock guard(*m_lock);
+        if (m_counters->load(batch_pending) != 0 ||
+            std::filesystem::exists(get_batch_dir() / "journal")) {
+            do_recover_batch();
+        }
+        if (m_counters->load(temp_cells) != 0) {
+            do_remove_temp_cells();
+        }
+        return guard;
+    }
+
+    /**
+     * Removes temporary cells of all layouts. The storage lock must be
+     * owned exclusively.
+     */
+    void do_remove_temp_cells() const
+    {
+        std::vector<std::filesystem::path> paths;
+        auto collect = [&](const std::filesystem::path &dir) {
+            for (const auto &ent : std::filesystem::directory_iterator(dir)) {
+                const auto &p = ent.path();
+                if (p.extension() == ".tmp" &&
+                    sepulca_id::parse(p.stem().native())) {
+                    paths.push_back(p);
+                }
+            }
+        };
+
+        collect(m_dir);
+        for (const auto &l1 : std::filesystem::directory_iterator(m_dir)) {
+            if (!is_shard_name(l1.path().filename().native()) ||
+                !l1.is_directory()) {
+                continue;
+            }
+            for (const auto &l2 :
+                 std::filesystem::directory_iterator(l1.path())) {
+                if (is_shard_name(l2.path().filename().native())) {
+                    collect(l2.path());
+                }
+            }
+        }
+
+        for (const auto &p : paths) {
+            std::filesystem::remove(p);
+        }
+        m_counters->store(temp_cells, 0);
+    }
+
+    /**
+     * Checks which layout the storage uses, re-reading it if another
+     * process has migrated the storage meanwhile.
+     */
+    bool do_is_sharded() const
+    {
+        const auto gen = m_counters->load(layout_generation);
+        if (gen != m_layout_gen.load(std::memory_order_acquire)) {
+            std::lock_guard guard(m_layout_mutex);
+            if (gen != m_layout_gen.load(std::memory_order_relaxed)) {
+                m_sharded = std::filesystem::exists(m_dir / sharded_marker) &&
+                    !std::filesystem::exists(m_dir / sharding_marker);
+                m_layout_gen.store(gen, std::memory_order_release);
+            }
+        }
+        return m_sharded;
+    }
+
+    /**
+     * Moves all cells of the storage directory into their shards.
+     * The storage lock must be owned exclusively.
+     *
+     * The sharding marker makes an interrupted migration be resumed at
+     * the next open; the sharded marker is written once all cells are
+     * in place.
+     */
+    void do_shard()
+    {
+        // A batch interrupted in the flat layout is finished first.
+        if (std::filesystem::exists(get_batch_dir())) {
+            do_recover_batch();
+        }
+
+        std::ofstream(m_dir / sharding_marker).close();
+        sync_file(m_dir);
+        m_counters->increment(layout_generation);
+
+        std::vector<sepulca_id> cells;
+        do_list_dir_cells(m_dir, [&](const sepulca_id &sid) {
+            cells.push_back(sid);
+            return true;
+        });
+
+        // The new shards and their parents, the storage directory last,
+        // must be on disk before the migration is marked as done.
+        std::set<std::filesystem::path> dirs;
+        for (const auto &sid : cells) {
+            const auto dir = get_cell_dir(sid, true);
+            std::filesystem::create_directories(dir);
+            std::filesystem::rename(m_dir / get_cell_name(sid),
+                                    dir / get_cell_name(sid));
+            dirs.insert(dir);
+            dirs.insert(dir.parent_path());
+        }
+
+        for (const auto &dir : dirs) {
+            sync_file(dir);
+        }
+        sync_file(m_dir);
+        std::ofstream(m_dir / sharded_marker).close();
+        std::filesystem::remove(m_dir / sharding_marker);
+        sync_file(m_dir);
+        m_counters->increment(layout_generation);
+
+        std::cerr << "File storage '" << m_dir.string() << "': moved "
+            << cells.size() << " cell(s) to the sharded layout." << std::endl;
+    }
+
+    /**
+     * Loads a sepulca from the cache or from its cell.
+     * The stripe of the sepulca must be owned.
+     */
+    sepulca_ptr do_load(const sepulca_id &sid) const
+    {
+        if (!m_cache) {
+            return do_deserialize(get_cell_path(sid));
+        }
+
+        const auto gen = m_counters->load(get_generation_counter(sid));
+        uint64_t version;
+        if (auto attrs = m_cache->get(sid, gen, version)) {
+            auto id = sid;
+            return new_sepulca(std::move(id), attributes(*attrs), version);
+        }
+
+        auto s = do_deserialize(get_cell_path(sid));
+        if (s) {
+            m_cache->put(sid, gen, s->get_attrs(), s->get_version());
+        }
+        return s;
+    }
+
+    /**
+     * Announces a change of a cell to other processes and updates
+     * the cache with the new attributes and version, if any.
+     * The stripe of the sepulca must be owned exclusively, or the storage
+     * lock.
+     */
+    void do_cell_changed(const sepulca_id &sid, const attributes *attrs,
+                         uint64_t version) const
+    {
+        const auto gen = m_counters->increment(get_generation_counter(sid));
+
+        if (m_cache) {
+            if (attrs) {
+                m_cache->put(sid, gen, *attrs, version);
+            } else {
+                m_cache->remove(sid);
+            }
+        }
+    }
+
+    /**
+     * Every cell maps to one of many generation counters, incremented on
+     * each change of any of its cells. The counter is chosen by the same
+     * hash as the stripe, so owning the stripe keeps the counter stable.
+     */
+    static size_t get_generation_counter(const sepulca_id &sid) {
+        return cell_generations +
+            std::hash<sepulca_id>{}(sid) % cell_generations_count;
+    }
+
+    sepulca_ptr do_deserialize(const std::filesystem::path &p) const
+    {
+        sepulca_view view;
+        mapped_file file(p);
+        if (!file || !do_parse(file.data(), p, view)) {
+            return {};
+        }
+        return do_materialize(view);
+    }
+
+    /**
+     * Creates a sepulca owning copies of the view's attributes.
+     */
+    sepulca_ptr do_materialize(const sepulca_view &view) const
+    {
+        auto sid = view.get_id();
+        return new_sepulca(std::move(sid), get_attributes(view),
+                           view.get_version());
+    }
+
+    static attributes get_attributes(const sepulca_view &view)
+    {
+        attributes attrs;
+        attrs.reserve(view.get_attrs().size());
+        for (const auto &[k, v] : view.get_attrs()) {
+            attrs.emplace_hint(attrs.end(), k, v);
+        }
+        return attrs;
+    }
+
+    /**
+     * Takes an idle io_uring reader or sets up a new one. Returns null
+     * if io_uring is not available.
+     */
+    std::unique_ptr<io_uring_reader> do_acquire_reader() const
+    {
+        std::lock_guard guard(m_readers_mutex);
+
+        if (!m_readers.empty()) {
+            auto reader = std::move(m_readers.back());
+            m_readers.pop_back();
+            return reader;
+        }
+
+        if (!m_uring_failed) {
+            try {
+                return std::make_unique<io_uring_reader>();
+            } catch (const std::exception &err) {
+                std::cerr << "File storage '" << m_dir.string()
+                    << "': io_uring is not available, loading cells one by "
+                    << "one: " << err.what() << std::endl;
+                m_uring_failed = true;
+            }
+        }
+        return {};
+    }
+
+    void do_release_reader(std::unique_ptr<io_uring_reader> reader) const
+    {
+        std::lock_guard guard(m_readers_mutex);
+        m_readers.push_back(std::move(reader));
+    }
+
+    /**
+     * Parses cell file contents of either format into a view referring
+     * to them, applying change records appended by commits.
+     * The cell must be protected from concurrent writers by its stripe
+     * while it is mapped, unless it is held by do_hold_cell().
+     */
+    bool do_parse(std::string_view data, const std::filesystem::path &p,
+                  sepulca_view &view, cell_layout *layout = nullptr) const
+    {
+        scoped_timer timer(timer_metric::deserialize);
+        metrics::add(counter_metric::bytes_read, data.size());
+
+        // The v2 magic ends with a zero byte, which v1 cells do not have.
+        cell_layout l;
+        const bool parsed = data.size() >= sizeof(cell_header) &&
+            memcmp(data.data(), SEPULCA_MAGIC, sizeof(SEPULCA_MAGIC)) == 0 ?
+            do_parse_v2(data, p, view, l) :
+            do_parse_v1(data, p, view, l);
+        if (parsed && layout) {
+            *layout = l;
+        }
+        return parsed;
+    }
+
+    /**
+     * Parses a v1 cell: lines of the signature, the identifier and
+     * attribute names and values. An empty line ends the attributes and
+     * starts change records, see apply_changes_v1().
+     */
+    static bool do_parse_v1(std::string_view data,
+                            const std::filesystem::path &p,
+                            sepulca_view &view, cell_layout &layout)
+    {
+        std::string_view sig, id;
+        if (!next_line(data, sig) || sig != SEPULCA_SIG) {
+            std::cerr << "Invalid Sepulca file signature: " << p << std::endl;
+            return false;
+        }
+
+        next_line(data, id);
+        auto sid = sepulca_id::parse(id);
+        if (!sid) {
+            std::cerr << "Invalid Sepulca identifier in file: " << p
+                << std::endl;
+            return false;
+        }
+
+        view.reset(*sid);
+
+        std::string_view k, v;
+        bool has_changes = false;
+        while (next_line(data, k)) {
+            if (k.empty()) {
+                has_changes = true;
+                break;
+            }
+            v = {};
+            next_line(data, v);
+            view.add_attr(k, v);
+        }
+
+        view.finish();
+
+        const bool torn = has_changes && !apply_changes_v1(data, view);
+        layout = {cell_format::v1, has_changes, torn};
+        return true;
+    }
+
+    /**
+     * Applies v1 change records to the view. Every record is a sequence of
+     * "=name" lines followed by the new value, "-name" lines for
+     * deleted attributes and an "@version" line, ending with a "." line.
+     * Returns false if the last record is incomplete.
+     */
+    static bool apply_changes_v1(std::string_view data, sepulca_view &view)
+    {
+        std::string_view line, value;
+        while (!data.empty()) {
+            // Check the record is complete before applying it.
+            auto record = data;
+            bool complete = false;
+            while (next_line(data, line)) {
+                if (line == ".") {
+                    complete = true;
+                    break;
+                }
+                if (line.starts_with('=')) {
+                    if (!next_line(data, value)) {
+                        break;
+                    }
+                } else if (line.starts_with('@')) {
+                    if (!parse_version(line.substr(1))) {
+                        break;
+                    }
+                } else if (!line.starts_with('-')) {
+                    break;
+                }
+            }
+            if (!complete) {
+                return false;
+            }
+
+            while (next_line(record, line) && line != ".") {
+                if (line.starts_with('=')) {
+                    next_line(record, value);
+                    view.set_attr(line.substr(1), value);
+                } else if (line.starts_with('@')) {
+                    view.set_version(*parse_version(line.substr(1)));
+                } else {
+                    view.erase_attr(line.substr(1));
+                }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Parses a v2 cell, see encode_cell_v2(), followed by change records,
+     * see encode_changes_v2(). A cell failing its checksum is rejected.
+     */
+    static bool do_parse_v2(std::string_view data,
+                            const std::filesystem::path &p,
+                            sepulca_view &view, cell_layout &layout)
+    {
+        cell_header h;
+        memcpy(&h, data.data(), sizeof(h));
+        data.remove_prefix(sizeof(h));
+        if (h.format != static_cast<uint32_t>(cell_format::v2)) {
+            std::cerr << "Unsupported Sepulca file format " << h.format
+                << ": " << p << std::endl;
+            return false;
+        }
+
+        uint64_t id, version;
+        uint32_t count;
+        std::string_view body = data.substr(0, h.size), k, v;
+        bool valid = data.size() >= h.size && checksum(body) == h.checksum &&
+            get_u64(body, id) && get_u64(body, version) &&
+            get_u32(body, count);
+        if (valid) {
+            view.reset(sepulca_id(id));
+            view.set_version(version);
+            for (; valid && count > 0; --count) {
+                valid = get_string(body, k) && get_string(body, v);
+                if (valid) {
+                    view.add_attr(k, v);
+                }
+            }
+        }
+        if (!valid || !body.empty()) {
+            std::cerr << "Corrupted Sepulca file: " << p << std::endl;
+            return false;
+        }
+
+        view.finish();
+
+        data.remove_prefix(h.size);
+        const bool torn = !apply_changes_v2(data, view);
+        layout = {cell_format::v2, !data.empty(), torn};
+        return true;
+    }
+
+    /**
+     * Applies v2 change records to the view. Returns false if a record
+     * is incomplete or corrupted, in which case it and the records
+     * following it are ignored.
+     */
+    static bool apply_changes_v2(std::string_view data, sepulca_view &view)
+    {
+        while (!data.empty()) {
+            uint32_t size, sum;
+            if (!get_u32(data, size) || !get_u32(data, sum) ||
+                data.size() < size) {
+                return false;
+            }
+
+            // Check the record is intact before applying it.
+            const auto record = data.substr(0, size);
+            data.remove_prefix(size);
+            if (checksum(record) != sum ||
+                !decode_changes_v2(record, nullptr)) {
+                return false;
+            }
+            decode_changes_v2(record, &view);
+        }
+        return true;
+    }
+
+    /**
+     * Decodes a v2 change record body, applying the changes to the view
+     * unless it is null. Returns false if the body is malformed.
+     */
+    static bool decode_changes_v2(std::string_view body, sepulca_view *view)
+    {
+        uint64_t version;
+        uint32_t count;
+        if (!get_u64(body, version) || !get_u32(body, count)) {
+            return false;
+        }
+
+        std::string_view name, value;
+        for (; count > 0; --count) {
+            uint8_t op;
+            if (!get_u8(body, op) || !get_string(body, name)) {
+                return false;
+            }
+
+            if (op == assign_attr) {
+                if (!get_string(body, value)) {
+                    return false;
+                }
+                if (view) {
+                    view->set_attr(name, value);
+                }
+            } else if (op == erase_attr) {
+                if (view) {
+                    view->erase_attr(name);
+                }
+            } else {
+                return false;
+            }
+        }
+
+        if (view) {
+            view->set_version(version);
+        }
+        return body.empty();
+    }
+
+    static std::optional<uint64_t> parse_version(std::string_view text)
+    {
+        uint64_t version;
+        const auto end = text.data() + text.size();
+        const auto [p, ec] = std::from_chars(text.data(), end, version);
+        if (ec != std::errc() || p != end || text.empty()) {
+            return {};
+        }
+        return version;
+    }
+
+    static bool next_line(std::string_view &data, std::string_view &line)
+    {
+        if (data.empty()) {
+            return false;
+        }
+
+        auto n = data.find('\n');
+        line = data.substr(0, n);
+        data.remove_prefix(n == std::string_view::npos ? data.size() : n + 1);
+        return true;
+    }
+
+    /**
+     * Lists the cells of the storage one shard at a time and calls `load`
+     * for them under the storage lock and the stripe of every cell, and
+     * `deliver` with no lock held after every enumerate_batch_size cells
+     * and at the end of every shard, so that callbacks made by `deliver`
+     * may use the storage. Stops when `deliver` returns false.
+     */
+    void do_for_each_cell(
+        const std::function<void(const sepulca_id &)> &load,
+        const std::function<bool()> &deliver) const
+    {
+        std::vector<sepulca_id> ids;
+        auto collect = [&](const sepulca_id &sid) {
+            ids.push_back(sid);
+            return true;
+        };
+
+        auto guard = do_lock_shared();
+        auto load_listed = [&] {
+            for (size_t i = 0; i < ids.size(); i += enumerate_batch_size) {
+                if (!guard.owns_lock()) {
+                    guard = do_lock_shared();
+                }
+                const auto end = std::min(ids.size(),
+                                          i + enumerate_batch_size);
+                for (size_t j = i; j < end; ++j) {
+                    std::shared_lock stripe_guard(get_stripe(ids[j]));
+                    load(ids[j]);
+                }
+                guard.unlock();
+                if (!deliver()) {
+                    return false;
+                }
+            }
+            ids.clear();
+            return true;
+        };
+
+        if (!do_is_sharded()) {
+            do_list_dir_cells(m_dir, collect);
+            load_listed();
+            return;
+        }
+
+        // Directories are iterated with the lock released between shards,
+        // as by enumerate_ids().
+        for (const auto &l1 : std::filesystem::directory_iterator(m_dir)) {
+            if (!is_shard_name(l1.path().filename().native()) ||
+                !l1.is_directory()) {
+                continue;
+            }
+
+            for (const auto &l2 :
+                 std::filesystem::directory_iterator(l1.path())) {
+                if (!is_shard_name(l2.path().filename().native())) {
+                    continue;
+                }
+
+                if (!guard.owns_lock()) {
+                    guard = do_lock_shared();
+                }
+                do_list_dir_cells(l2.path(), collect);
+                if (!load_listed()) {
+                    return;
+                }
+            }
+        }
+    }
+
+    /**
+     * Cell contents staying valid with no lock held, see do_hold_cell().
+     */
+    struct held_cell
+    {
+        mapped_file file;
+        std::string copy;
+        std::string_view data;
+    };
+
+    /**
+     * Takes the contents of a cell, returning false if there is no cell.
+     * The stripe of the sepulca must be owned.
+     *
+     * Cells are replaced by renames and only ever appended to, so their
+     * mappings stay valid after releasing the stripe. Cells rewritten in
+     * place without durability would be truncated under the mapping, so
+     * these are read into a buffer instead.
+     */
+    bool do_hold_cell(const sepulca_id &sid, held_cell &cell) const
+    {
+        const auto p = get_cell_path(sid);
+        if (m_durability != file_durability::none) {
+            cell.file = mapped_file(p);
+            cell.data = cell.file.data();
+            return static_cast<bool>(cell.file);
+        }
+
+        int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            if (errno == ENOENT) {
+                return false;
+            }
+            throw std::runtime_error("Failed to open file '" + p.string() +
+                "': " + strerror(errno));
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            auto err = errno;
+            close(fd);
+            throw std::runtime_error("Failed to stat file '" + p.string() +
+                "': " + strerror(err));
+        }
+
+        cell.copy.resize(st.st_size);
+        for (size_t pos = 0; pos < cell.copy.size();) {
+            const auto n = pread(fd, cell.copy.data() + pos,
+                                 cell.copy.size() - pos,
+                                 static_cast<off_t>(pos));
+            if (n <= 0) {
+                auto err = errno;
+                close(fd);
+                throw std::runtime_error("Failed to read file '" +
+                    p.string() + "': " +
+                    (n == 0 ? "unexpected end of file" : strerror(err)));
+            }
+            pos += n;
+        }
+        close(fd);
+
+        cell.data = cell.copy;
+        return true;
+    }
+
+    /**
+     * Calls the callback for identifiers of all cells of the storage.
+     * Cell files are not opened.
+     */
+    void do_list_cells(
+        const std::function<bool(const sepulca_id &)> &cb) const
+    {
+        if (!do_is_sharded()) {
+            do_list_dir_cells(m_dir, cb);
+            return;
+        }
+
+        for (const auto &l1 : std::filesystem::directory_iterator(m_dir)) {
+            // Skip the lock file, the batch and index directories.
+            if (!is_shard_name(l1.path().filename().native()) ||
+                !l1.is_directory()) {
+                continue;
+            }
+
+            for (const auto &l2 :
+                 std::filesystem::directory_iterator(l1.path())) {
+                if (is_shard_name(l2.path().filename().native()) &&
+                    !do_list_dir_cells(l2.path(), cb)) {
+                    return;
+                }
+            }
+        }
+    }
+
+    /**
+     * Calls the callback for identifiers of cells in one directory.
+     * Returns false if the callback has stopped the listing.
+     */
+    static bool do_list_dir_cells(
+        const std::filesystem::path &dir,
+        const std::function<bool(const sepulca_id &)> &cb)
+    {
+        for (const auto &dir_ent : std::filesystem::directory_iterator(dir)) {
+            const auto &p = dir_ent.path();
+            auto sid = sepulca_id::parse(p.stem().native());
+            if (!sid || p.extension() != ".txt") {
+                continue;
+            }
+
+            if (!cb(*sid)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Returns the names of shard directories in a directory, starting from
+     * the given name, in order.
+     */
+    static std::vector<std::string> list_shard_dirs(
+        const std::filesystem::path &dir, const std::string &from)
+    {
+        std::vector<std::string> names;
+        std::error_code ec;
+        for (const auto &ent : std::filesystem::directory_iterator(dir, ec)) {
+            auto name = ent.path().filename().string();
+            if (is_shard_name(name) && name >= from && ent.is_directory()) {
+                names.push_back(std::move(name));
+            }
+        }
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+    static bool is_shard_name(const std::string &name)
+    {
+        auto is_digit = [](char c) {
+            return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+        };
+        return name.size() == 2 && is_digit(name[0]) && is_digit(name[1]);
+    }
+
+    /**
+     * Returns the identifier filter, remapping it if another thread or
+     * process has rebuilt it meanwhile. Returns null if there is no
+     * trusted filter, in which case lookups go to the file system.
+     */
+    std::shared_ptr<id_filter> do_get_filter() const
+    {
+        std::lock_guard guard(m_filter_mutex);
+
+        const auto gen = m_counters->load(filter_generation);
+        if (gen != m_filter_gen) {
+            auto filter = std::make_shared<id_filter>(m_dir / filter_file);
+            m_filter = *filter ? std::move(filter) : nullptr;
+            m_filter_gen = gen;
+        }
+        return m_filter;
+    }
+
+    /**
+     * Adds the identifier to the filter before its cell is written, so
+     * that lookups never miss a stored cell.
+     */
+    void do_filter_add(const sepulca_id &sid) const
+    {
+        if (const auto filter = do_get_filter()) {
+            filter->add(sid);
+        }
+    }
+
+    /**
+     * Rebuilds the filter if it is missing or stale, taking the storage
+     * lock exclusively only then. Storages have no filter if filters are
+     * not supported.
+     */
+    void do_check_filter()
+    {
+        if (!id_filter::is_supported()) {
+            return;
+        }
+        if (const auto filter = do_get_filter();
+            filter && !filter->is_stale()) {
+            return;
+        }
+
+        auto guard = do_lock_exclusive();
+        do_refresh_filter();
+    }
+
+    /**
+     * Rebuilds the filter if it is missing or stale, and returns it.
+     * The storage lock must be owned exclusively.
+     */
+    std::shared_ptr<id_filter> do_refresh_filter()
+    {
+        if (!id_filter::is_supported()) {
+            return nullptr;
+        }
+        if (auto filter = do_get_filter(); filter && !filter->is_stale()) {
+            return filter;
+        }
+
+        // Erased identifiers are dropped, and the filter is sized for
+        // the storage to double before it becomes stale again.
+        std::vector<sepulca_id> ids;
+        do_list_cells([&](const sepulca_id &sid) {
+            ids.push_back(sid);
+            return true;
+        });
+
+        const auto p = m_dir / filter_file;
+        auto tmp = p;
+        tmp += ".tmp";
+        {
+            id_filter filter(tmp, std::max<uint64_t>(2 * ids.size(),
+                                                     min_filter_capacity));
+            for (const auto &sid : ids) {
+                filter.add(sid);
+            }
+        }
+
+        // Processes still mapping the old filter remap the new one
+        // before their next lookup under the storage lock.
+        std::filesystem::rename(tmp, p);
+        m_counters->increment(filter_generation);
+        return do_get_filter();
+    }
+
+    /**
+     * Returns the names of indexed attributes, re-reading them if another
+     * thread or process has created or dropped an index meanwhile.
+     */
+    std::vector<std::string> do_get_indexes() const
+    {
+        std::lock_guard guard(m_indexes_mutex);
+
+        const auto gen = m_counters->load(indexes_generation);
+        if (gen != m_indexes_gen) {
+            m_indexes = do_list_indexes(true);
+            m_indexes_gen = gen;
+        }
+        return m_indexes;
+    }
+
+    /**
+     * Lists indexes which are either ready or not.
+     */
+    std::vector<std::string> do_list_indexes(bool ready) const
+    {
+        std::vector<std::string> res;
+        std::error_code ec;
+        for (const auto &ent :
+             std::filesystem::directory_iterator(get_index_root(), ec)) {
+            auto name = decode_index_name(ent.path().filename().native());
+            if (name &&
+                std::filesystem::exists(ent.path() / "ready") == ready) {
+                res.push_back(std::move(*name));
+            }
+        }
+        std::sort(res.begin(), res.end());
+        return res;
+    }
+
+    /**
+     * Builds an index from scratch. The storage lock must be owned
+     * exclusively.
+     */
+    void do_build_index(const std::string &name)
+    {
+        const auto dir = get_index_dir(name);
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directories(dir);
+
+        const std::vector<std::string> indexes{name};
+        do_list_cells([&](const sepulca_id &sid) {
+            if (auto s = do_deserialize(get_cell_path(sid))) {
+                do_index_markers(indexes, s->get_id(), &s->get_attrs(),
+                                 nullptr, true);
+            }
+            return true;
+        });
+
+        std::ofstream(dir / "ready").close();
+        m_counters->increment(indexes_generation);
+    }
+
+    /**
+     * Creates (or removes) index entries of the sepulca for values
+     * of indexed attributes in `attrs` which differ from `other`.
+     */
+    void do_index_markers(const std::vector<std::string> &indexes,
+                          const sepulca_id &sid, const attributes *attrs,
+                          const attributes *other, bool create) const
+    {
+        if (!attrs) {
+            return;
+        }
+
+        for (const auto &name : indexes) {
+            auto i = attrs->find(name);
+            if (i == attrs->end()) {
+                continue;
+            }
+
+            if (other) {
+                auto j = other->find(name);
+                if (j != other->end() && j->second == i->second) {
+                    continue;
+                }
+            }
+
+            const auto bucket = get_index_dir(name) /
+                get_index_bucket(i->second);
+            if (create) {
+                std::filesystem::create_directories(bucket);
+                std::ofstream(bucket / sid.to_string()).close();
+            } else {
+                std::filesystem::remove(bucket / sid.to_string());
+            }
+        }
+    }
+
+    std::filesystem::path get_index_root() const {
+        return m_dir / "index";
+    }
+
+    /**
+     * Index directories are named by hex-encoded attribute names,
+     * as names may contain any characters.
+     */
+    std::filesystem::path get_index_dir(const std::string &name) const
+    {
+        static constexpr char digits[] = "0123456789abcdef";
+
+        std::string enc;
+        enc.reserve(name.size() * 2);
+        for (unsigned char c : name) {
+            enc += digits[c >> 4];
+            enc += digits[c & 0xf];
+        }
+        return get_index_root() / enc;
+    }
+
+    static std::optional<std::string> decode_index_name(const std::string &enc)
+    {
+        if (enc.empty() || enc.size() % 2 != 0) {
+            return {};
+        }
+
+        std::string name;
+        for (size_t i = 0; i < enc.size(); i += 2) {
+            unsigned c;
+            if (sscanf(enc.c_str() + i, "%2x", &c) != 1) {
+                return {};
+            }
+            name += static_cast<char>(c);
+        }
+        return name;
+    }
+
+    /**
+     * Index entries are grouped into buckets by a hash of the value.
+     */
+    static std::string get_index_bucket(const std::string &value)
+    {
+        // FNV-1a.
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : value) {
+            h = (h ^ c) * 1099511628211ull;
+        }
+
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx",
+                 static_cast<unsigned long long>(h));
+        return name;
+    }
+
+    static std::string get_cell_name(const sepulca_id &sid) {
+        return sid.to_string() + ".txt";
+    }
+
+    std::filesystem::path get_cell_path(const sepulca_id &sid) const {
+        return get_cell_dir(sid, do_is_sharded()) / get_cell_name(sid);
+    }
+
+    /**
+     * Shards are named by the two most significant bytes of identifiers.
+     */
+    std::filesystem::path get_cell_dir(const sepulca_id &sid,
+                                       bool sharded) const
+    {
+        if (!sharded) {
+            return m_dir;
+        }
+
+        char shard[6];
+        snprintf(shard, sizeof(shard), "%02x/%02x",
+                 static_cast<unsigned>(sid.value >> 56),
+                 static_cast<unsigned>((sid.value >> 48) & 0xff));
+        return m_dir / shard;
+    }
+
+    std::filesystem::path get_batch_dir() const {
+        return m_dir / "batch";
+    }
+
+    std::filesystem::path get_cell_path(const sepulca &s) const {
+        return get_cell_path(s.get_id());
+    }
+
+    striped_file_lock::stripe &get_stripe(const sepulca_id &sid) const {
+        return m_stripes->get_stripe(get_stripe_index(sid));
+    }
+
+    static size_t get_stripe_index(const sepulca_id &sid) {
+        return std::hash<sepulca_id>{}(sid) % lock_stripes;
+    }
+
+    sepulca_ptr new_sepulca(sepulca_id &&sid, attributes &&attrs,
+                            uint64_t version) const
+    {
+        return make_sepulca(*this, std::move(sid), std::move(attrs), version);
+    }
+
+    // Number of per-object lock stripes; must be the same for all
+    // processes sharing a storage.
+    static constexpr size_t lock_stripes = 64;
+
+    // Counters shared through the lock file.
+    static constexpr size_t cell_generations_count = lock_stripes * 64;
+    static_assert(cell_generations_count % lock_stripes == 0);
+
+    // Cells loaded by enumerate() before callbacks are made for them.
+    static constexpr size_t enumerate_batch_size = 1024;
+
+    // Layout marker files.
+    static constexpr const char *sharded_marker = "sharded";
+    static constexpr const char *sharding_marker = "sharding";
+
+    // Size of a v1 record holding just a version, e.g. "\n@123\n.\n".
+    static constexpr size_t version_record_size = 8;
+
+    // Identifier filter file, sized for at least this many identifiers.
+    static constexpr const char *filter_file = "ids.bloom";
+    static constexpr uint64_t min_filter_capacity = 1 << 16;
+
+    enum counter : size_t
+    {
+        indexes_generation, // Incremented when indexes change.
+        layout_generation,  // Incremented when the cell layout changes.
+        filter_generation,  // Incremented when the filter is rebuilt.
+        batch_pending,      // Non-zero while a committed batch is applied.
+        temp_cells,         // Temporary cells being written, see
+                            // do_serialize().
+        cell_generations,   // Cell generations, see get_generation_counter().
+        counters_count = cell_generations + cell_generations_count
+    };
+
+    const std::filesystem::path m_dir;
+    const file_durability m_durability;
+    const cell_format m_format;
+
+    // Storage-wide lock. Operations on individual sepulcas share it and
+    // exclude each other by the stripes of the sepulcas' identifiers;
+    // operations on the storage as a whole take it exclusively.
+    mutable std::unique_ptr<file_lock> m_lock;
+    mutable std::unique_ptr<striped_file_lock> m_stripes;
+    std::unique_ptr<shared_counters> m_counters;
+    std::unique_ptr<sepulca_cache> m_cache;
+    std::unique_ptr<group_commit> m_group_commit;
+
+    // Directories to sync by the next group commit.
+    std::mutex m_sync_mutex;
+    std::set<std::filesystem::path> m_sync_dirs;
+
+    // Names of indexed attributes, cached until the indexes generation
+    // counter changes.
+    mutable std::mutex m_indexes_mutex;
+    mutable std::vector<std::string> m_indexes;
+    mutable uint64_t m_indexes_gen = ~0ull;
+
+    // Whether the cell layout is sharded, cached until the layout
+    // generation counter changes.
+    mutable std::mutex m_layout_mutex;
+    mutable std::atomic<bool> m_sharded = false;
+    mutable std::atomic<uint64_t> m_layout_gen = ~0ull;
+
+    // Identifier filter, remapped when the filter generation counter
+    // changes. Null if the filter is missing or not trusted.
+    mutable std::mutex m_filter_mutex;
+    mutable std::shared_ptr<id_filter> m_filter;
+    mutable uint64_t m_filter_gen = ~0ull;
+
+    // Idle io_uring readers of load_many(), one per concurrent call.
+    mutable std::mutex m_readers_mutex;
+    mutable std::vector<std::unique_ptr<io_uring_reader>> m_readers;
+    mutable bool m_uring_failed = false;
 };
 
 }
@@ -0,0 +1,51 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+
+#pragma once
+
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace cosmica
+{
+
+/**
+ * Flushes a file or a directory.
+ */
+inline void sync_file(const std::filesystem::path &p)
+{
+    int fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fsync(fd) != 0) {
+        auto err = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        throw std::runtime_error("Failed to sync '" + p.string() + "': " +
+            strerror(err));
+    }
+    close(fd);
+}
+
+}
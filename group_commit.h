@@ -0,0 +1,110 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+namespace cosmica
+{
+
+/**
+ * Shares an expensive flush (e.g. a file system sync) between concurrent
+ * writers.
+ *
+ * A writer calls commit() after its write and returns once a flush started
+ * after that has completed. The first waiting writer runs the flush for
+ * all writers arrived meanwhile; writers arriving during a flush are served
+ * by the next one.
+ */
+class group_commit
+{
+public:
+    explicit group_commit(std::function<void()> flush) :
+        m_flush(std::move(flush))
+    {
+    }
+
+    // Disable copy and move of group commits.
+    group_commit(const group_commit &) = delete;
+    group_commit(group_commit &&) = delete;
+
+    /**
+     * Waits until writes made before the call are flushed.
+     * If the flush fails, its runner gets the exception and the other
+     * writers retry with the next flush.
+     */
+    void commit()
+    {
+        std::unique_lock guard(m_mutex);
+
+        const uint64_t ticket = ++m_requested;
+        while (m_completed < ticket) {
+            if (m_flushing) {
+                m_cv.wait(guard);
+                continue;
+            }
+
+            // Lead the flush for all tickets issued so far.
+            const uint64_t target = m_requested;
+            m_flushing = true;
+            guard.unlock();
+
+            try {
+                m_flush();
+            } catch (...) {
+                guard.lock();
+                m_flushing = false;
+                m_cv.notify_all();
+                throw;
+            }
+
+            guard.lock();
+            m_completed = target;
+            m_flushing = false;
+            ++m_flushes;
+            m_cv.notify_all();
+        }
+    }
+
+    /**
+     * Returns the number of flushes run so far.
+     */
+    uint64_t get_flushes() const
+    {
+        std::lock_guard guard(m_mutex);
+        return m_flushes;
+    }
+
+private:
+    const std::function<void()> m_flush;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    uint64_t m_requested = 0;
+    uint64_t m_completed = 0;
+    uint64_t m_flushes = 0;
+    bool m_flushing = false;
+};
+
+}
@@ -0,0 +1,288 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "sepulca_id.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cosmica
+{
+
+/**
+ * Blocked Bloom filter over sepulca identifiers, stored in a file and shared
+ * by all processes mapping it.
+ *
+ * Each identifier sets bits in a single 64-byte block, so that a lookup
+ * touches one cache line. Bits are set with atomic operations on the shared
+ * mapping and never cleared: an identifier once added is reported as
+ * possibly present until the filter is rebuilt.
+ *
+ * Bits live in the page cache, which does not survive a crash of the system,
+ * so a filter written before the last boot is not trusted.
+ */
+class id_filter
+{
+    static_assert(std::atomic_ref<uint64_t>::is_always_lock_free);
+
+public:
+    /**
+     * Maps an existing filter. A missing filter, a malformed one or one
+     * written before the last boot results in a closed object, as does
+     * any filter if filters are not supported.
+     */
+    explicit id_filter(const std::filesystem::path &path)
+    {
+        if (!is_supported()) {
+            return;
+        }
+
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd == -1) {
+            if (errno == ENOENT) {
+                return;
+            }
+            throw std::runtime_error("Failed to open filter file '" +
+                path.string() + "': " + strerror(errno));
+        }
+
+        header h;
+        struct stat st;
+        if (fstat(fd, &st) != 0 ||
+            pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+            std::memcmp(h.magic, filter_magic, sizeof(h.magic)) != 0 ||
+            std::memcmp(h.boot_id, get_boot_id().data(),
+                        sizeof(h.boot_id)) != 0 ||
+            h.blocks == 0 ||
+            static_cast<uint64_t>(st.st_size) != get_file_size(h.blocks)) {
+            close(fd);
+            return;
+        }
+
+        map(fd, path, h.blocks);
+    }
+
+    /**
+     * Creates an empty filter sized for the given number of identifiers,
+     * replacing the file if it exists.
+     */
+    id_filter(const std::filesystem::path &path, uint64_t capacity)
+    {
+        if (!is_supported()) {
+            throw std::runtime_error("Cannot create filter file '" +
+                path.string() + "': the boot identifier is not available");
+        }
+
+        int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC,
+                      0777);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to create filter file '" +
+                path.string() + "': " + strerror(errno));
+        }
+
+        header h = {};
+        std::memcpy(h.magic, filter_magic, sizeof(h.magic));
+        std::memcpy(h.boot_id, get_boot_id().data(), sizeof(h.boot_id));
+        h.blocks = std::max<uint64_t>(capacity * bits_per_id / block_bits, 1);
+        h.capacity = capacity;
+
+        if (ftruncate(fd, static_cast<off_t>(get_file_size(h.blocks))) != 0 ||
+            pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+            auto err = errno;
+            close(fd);
+            throw std::runtime_error("Failed to write filter file '" +
+                path.string() + "': " + strerror(err));
+        }
+
+        map(fd, path, h.blocks);
+    }
+
+    // Disable copy and move of filters.
+    id_filter(const id_filter &) = delete;
+    id_filter(id_filter &&) = delete;
+
+    ~id_filter()
+    {
+        if (m_header) {
+            munmap(m_header, get_file_size(m_blocks));
+        }
+    }
+
+    /**
+     * Checks if filters can be persisted: without the boot identifier,
+     * a filter which has lost bits in a crash of the system cannot be
+     * told from a valid one.
+     */
+    static bool is_supported()
+    {
+        return !get_boot_id().empty();
+    }
+
+    /**
+     * Checks if the filter has been found and mapped.
+     */
+    explicit operator bool() const noexcept {
+        return m_header != nullptr;
+    }
+
+    /**
+     * Checks if the identifier may have been added. False positives are
+     * possible, false negatives are not.
+     */
+    bool may_contain(const sepulca_id &sid) const noexcept
+    {
+        uint64_t masks[block_words];
+        const auto *block = get_block(sid, masks);
+        for (size_t i = 0; i < block_words; ++i) {
+            const auto w = std::atomic_ref(block[i]).load(
+                std::memory_order_acquire);
+            if ((w & masks[i]) != masks[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Adds the identifier. The bits are visible to other processes before
+     * this returns, so it is called before the identifier gets stored.
+     */
+    void add(const sepulca_id &sid) noexcept
+    {
+        if (may_contain(sid)) {
+            return;
+        }
+
+        uint64_t masks[block_words];
+        auto *block = get_block(sid, masks);
+        for (size_t i = 0; i < block_words; ++i) {
+            if (masks[i]) {
+                std::atomic_ref(block[i]).fetch_or(masks[i],
+                                                   std::memory_order_acq_rel);
+            }
+        }
+        std::atomic_ref(m_header->inserted).fetch_add(
+            1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Checks if more identifiers have been added than the filter has been
+     * sized for, so that false positives become frequent.
+     */
+    bool is_stale() const noexcept {
+        return std::atomic_ref(m_header->inserted).load(
+            std::memory_order_relaxed) > m_header->capacity;
+    }
+
+private:
+    struct header
+    {
+        char magic[8];
+        uint64_t blocks;
+        uint64_t capacity;
+        uint64_t inserted;  // Updated atomically.
+        char boot_id[32];
+    };
+    static_assert(sizeof(header) == 64);
+
+    static constexpr char filter_magic[8] = "SEPBLM1";
+    static constexpr size_t block_words = 8;
+    static constexpr size_t block_bits = block_words * 64;
+    static constexpr size_t bits_per_id = 12;
+    static constexpr size_t hashes = 7;
+
+    static uint64_t get_file_size(uint64_t blocks) {
+        return sizeof(header) + blocks * block_bits / 8;
+    }
+
+    void map(int fd, const std::filesystem::path &path, uint64_t blocks)
+    {
+        auto p = mmap(nullptr, get_file_size(blocks), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+        auto err = errno;
+        close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Failed to map filter file '" +
+                path.string() + "': " + strerror(err));
+        }
+
+        m_header = static_cast<header *>(p);
+        m_bits = reinterpret_cast<uint64_t *>(m_header + 1);
+        m_blocks = blocks;
+    }
+
+    /**
+     * Returns the block of the identifier and fills the masks of its bits
+     * in the words of the block.
+     */
+    uint64_t *get_block(const sepulca_id &sid,
+                        uint64_t (&masks)[block_words]) const noexcept
+    {
+        // The block and the bits are chosen by independent hashes.
+        const uint64_t h1 = std::hash<sepulca_id>{}(sid);
+        const uint64_t h2 = std::hash<sepulca_id>{}(
+            sepulca_id(sid.value ^ 0x9e3779b97f4a7c15ull));
+
+        std::fill(std::begin(masks), std::end(masks), 0);
+        for (size_t i = 0; i < hashes; ++i) {
+            const auto bit = (h2 >> (9 * i)) & (block_bits - 1);
+            masks[bit / 64] |= 1ull << (bit % 64);
+        }
+        return m_bits + (h1 % m_blocks) * block_words;
+    }
+
+    /**
+     * Returns the boot identifier of the system without dashes, or an empty
+     * string if it is not available.
+     */
+    static const std::string &get_boot_id()
+    {
+        static const std::string boot_id = [] {
+            std::string text;
+            std::ifstream("/proc/sys/kernel/random/boot_id") >> text;
+            std::erase(text, '-');
+            if (text.size() != sizeof(header::boot_id) ||
+                !std::all_of(text.begin(), text.end(), [](char c) {
+                    return std::isxdigit(static_cast<unsigned char>(c));
+                })) {
+                text.clear();
+            }
+            return text;
+        }();
+        return boot_id;
+    }
+
+    header *m_header = nullptr;
+    uint64_t *m_bits = nullptr;
+    uint64_t m_blocks = 0;
+};
+
+}
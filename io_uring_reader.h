@@ -0,0 +1,423 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <list>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace cosmica
+{
+
+/**
+ * Reads whole files through an io_uring, keeping many opens, reads
+ * and closes in flight at once.
+ *
+ * The ring is driven by raw system calls. A reader is not thread-safe:
+ * every thread needs its own.
+ */
+class io_uring_reader
+{
+public:
+    /**
+     * Sets up a ring for the given number of operations in flight.
+     * Throws an exception if io_uring or any of the operations used
+     * is not available.
+     */
+    explicit io_uring_reader(unsigned entries = 128)
+    {
+        io_uring_params params = {};
+        m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries,
+                                        &params));
+        if (m_fd < 0) {
+            throw std::runtime_error(std::string("Failed to set up "
+                "io_uring: ") + strerror(errno));
+        }
+
+        // Kernels before 5.6 set up rings without the operations used here,
+        // and without the probe as well.
+        if (!probe_ops()) {
+            close(m_fd);
+            throw std::runtime_error("io_uring does not support opening, "
+                "reading and closing files");
+        }
+
+        m_entries = params.sq_entries;
+        m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_size = params.cq_off.cqes +
+            params.cq_entries * sizeof(io_uring_cqe);
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+        m_sq = map(m_sq_size, IORING_OFF_SQ_RING);
+        m_cq = map(m_cq_size, IORING_OFF_CQ_RING);
+        m_sqes = static_cast<io_uring_sqe *>(map(m_sqes_size,
+                                                 IORING_OFF_SQES));
+        if (!m_sq || !m_cq || !m_sqes) {
+            auto err = errno;
+            release();
+            throw std::runtime_error(std::string("Failed to map io_uring: ") +
+                strerror(err));
+        }
+
+        auto *sq = static_cast<char *>(m_sq);
+        m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+        auto *cq = static_cast<char *>(m_cq);
+        m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    }
+
+    // Disable copy and move of readers.
+    io_uring_reader(const io_uring_reader &) = delete;
+    io_uring_reader(io_uring_reader &&) = delete;
+
+    ~io_uring_reader()
+    {
+        release();
+        m_parked.clear();
+    }
+
+    /**
+     * Reads the files into `res`, leaving missing files empty.
+     * Other errors throw an exception once all operations in flight
+     * have completed.
+     */
+    void read_files(const std::vector<std::filesystem::path> &paths,
+                    std::vector<std::optional<std::string>> &res)
+    {
+        struct file_state
+        {
+            int fd = -1;
+            size_t done = 0;
+        };
+
+        if (m_broken) {
+            throw std::runtime_error("io_uring reader is not usable after "
+                "a failure");
+        }
+
+        res.assign(paths.size(), std::nullopt);
+        std::vector<file_state> files(paths.size());
+        size_t next = 0;
+        unsigned in_flight = 0;
+        std::string error;
+
+        auto read_next = [&](size_t i) {
+            auto &buf = *res[i];
+            buf.resize(std::max<size_t>(buf.size() * 2, initial_read));
+            auto &sqe = next_sqe();
+            sqe.opcode = IORING_OP_READ;
+            sqe.fd = files[i].fd;
+            sqe.addr = reinterpret_cast<uint64_t>(buf.data() + files[i].done);
+            sqe.len = static_cast<unsigned>(buf.size() - files[i].done);
+            sqe.off = files[i].done;
+            sqe.user_data = i << 2 | op_read;
+        };
+
+        // The descriptor is forgotten once the close has completed.
+        auto close_file = [&](size_t i) {
+            auto &sqe = next_sqe();
+            sqe.opcode = IORING_OP_CLOSE;
+            sqe.fd = files[i].fd;
+            sqe.user_data = i << 2 | op_close;
+        };
+
+        auto fail = [&](size_t i, int err) {
+            if (error.empty()) {
+                error = "Failed to read file '" + paths[i].string() + "': " +
+                    strerror(err);
+            }
+            res[i].reset();
+        };
+
+        while (next < paths.size() || in_flight > 0) {
+            // Every file has a single operation in flight, so the number
+            // of files being read is bounded by the ring size.
+            while (next < paths.size() && in_flight < m_entries &&
+                   error.empty()) {
+                auto &sqe = next_sqe();
+                sqe.opcode = IORING_OP_OPENAT;
+                sqe.fd = AT_FDCWD;
+                sqe.addr = reinterpret_cast<uint64_t>(paths[next].c_str());
+                sqe.open_flags = O_RDONLY | O_CLOEXEC;
+                sqe.user_data = next << 2 | op_open;
+                ++next;
+                ++in_flight;
+            }
+            if (!error.empty()) {
+                next = paths.size();
+            }
+            if (in_flight == 0) {
+                break;
+            }
+
+            try {
+                submit_and_wait(1);
+            } catch (...) {
+                // Operations in flight refer to the buffers in `res`, which
+                // must outlive them; the buffers are parked until the ring
+                // is closed if the operations cannot be waited for.
+                const bool drained = abandon(in_flight, [&](
+                        const io_uring_cqe &cqe) {
+                    auto &f = files[cqe.user_data >> 2];
+                    if ((cqe.user_data & 3) == op_open && cqe.res >= 0) {
+                        f.fd = cqe.res;
+                    } else if ((cqe.user_data & 3) == op_close) {
+                        f.fd = -1;
+                    }
+                });
+                if (!drained) {
+                    // Buffers are never smaller than initial_read, so moving
+                    // them keeps their data where it is.
+                    for (auto &buf : res) {
+                        if (buf) {
+                            m_parked.push_back(std::move(*buf));
+                        }
+                    }
+                    m_broken = true;
+                    throw;
+                }
+
+                for (const auto &f : files) {
+                    if (f.fd != -1) {
+                        close(f.fd);
+                    }
+                }
+                throw;
+            }
+
+            unsigned head = *m_cq_head;
+            const unsigned tail = std::atomic_ref(*m_cq_tail).load(
+                std::memory_order_acquire);
+            for (; head != tail; ++head) {
+                const auto &cqe = m_cqes[head & m_cq_mask];
+                const size_t i = cqe.user_data >> 2;
+                const int r = cqe.res;
+
+                switch (cqe.user_data & 3) {
+                case op_open:
+                    if (r >= 0) {
+                        files[i].fd = r;
+                        res[i].emplace();
+                        read_next(i);
+                        continue;
+                    }
+                    if (r != -ENOENT && r != -ENOTDIR) {
+                        fail(i, -r);
+                    }
+                    break;
+                case op_read:
+                    if (r < 0) {
+                        fail(i, -r);
+                        close_file(i);
+                        continue;
+                    }
+                    files[i].done += static_cast<size_t>(r);
+                    if (r > 0 && files[i].done == res[i]->size()) {
+                        read_next(i);
+                        continue;
+                    }
+                    // A short read is the end of the file.
+                    res[i]->resize(files[i].done);
+                    close_file(i);
+                    continue;
+                case op_close:
+                    files[i].fd = -1;
+                    break;
+                }
+                --in_flight;
+            }
+            std::atomic_ref(*m_cq_head).store(head, std::memory_order_release);
+        }
+
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+
+private:
+    enum op : uint64_t
+    {
+        op_open,
+        op_read,
+        op_close
+    };
+
+    // Size of the first read of a file; cells are mostly small.
+    static constexpr size_t initial_read = 4096;
+
+    /**
+     * Checks that the kernel supports the operations used by read_files().
+     */
+    bool probe_ops() const
+    {
+        // The probe is followed by an entry for every operation.
+        std::vector<char> buf(sizeof(io_uring_probe) +
+                              IORING_OP_LAST * sizeof(io_uring_probe_op));
+        auto *probe = reinterpret_cast<io_uring_probe *>(buf.data());
+        if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE,
+                    probe, IORING_OP_LAST) < 0) {
+            return false;
+        }
+
+        for (const unsigned op : {IORING_OP_OPENAT, IORING_OP_READ,
+                                  IORING_OP_CLOSE}) {
+            if (op > probe->last_op ||
+                !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Drops the operations not submitted because of a failure, and waits
+     * for the completion of the submitted ones, passing their completions
+     * to the callback. Returns false if waiting has failed as well,
+     * in which case operations may still be in flight.
+     */
+    template<typename Callback>
+    bool abandon(unsigned in_flight, Callback &&cb) noexcept
+    {
+        // The kernel reads the queue only when entered to submit.
+        m_sq_local_tail -= m_unsubmitted;
+        std::atomic_ref(*m_sq_tail).store(m_sq_local_tail,
+                                          std::memory_order_release);
+        in_flight -= m_unsubmitted;
+        m_unsubmitted = 0;
+
+        while (in_flight > 0) {
+            long r = syscall(__NR_io_uring_enter, m_fd, 0, 1,
+                             IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (r < 0 && errno != EINTR && errno != EAGAIN &&
+                errno != EBUSY) {
+                return false;
+            }
+
+            unsigned head = *m_cq_head;
+            const unsigned tail = std::atomic_ref(*m_cq_tail).load(
+                std::memory_order_acquire);
+            for (; head != tail; ++head) {
+                cb(m_cqes[head & m_cq_mask]);
+                --in_flight;
+            }
+            std::atomic_ref(*m_cq_head).store(head, std::memory_order_release);
+        }
+        return true;
+    }
+
+    void *map(size_t size, off_t offset)
+    {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, m_fd, offset);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    void release() noexcept
+    {
+        if (m_sqes) {
+            munmap(m_sqes, m_sqes_size);
+        }
+        if (m_cq) {
+            munmap(m_cq, m_cq_size);
+        }
+        if (m_sq) {
+            munmap(m_sq, m_sq_size);
+        }
+        close(m_fd);
+    }
+
+    /**
+     * Returns a cleared submission queue entry to fill in; it is submitted
+     * by the next submit_and_wait().
+     */
+    io_uring_sqe &next_sqe() noexcept
+    {
+        const unsigned idx = m_sq_local_tail++ & m_sq_mask;
+        m_sq_array[idx] = idx;
+        auto &sqe = m_sqes[idx];
+        memset(&sqe, 0, sizeof(sqe));
+        ++m_unsubmitted;
+        return sqe;
+    }
+
+    void submit_and_wait(unsigned wait)
+    {
+        std::atomic_ref(*m_sq_tail).store(m_sq_local_tail,
+                                          std::memory_order_release);
+
+        for (;;) {
+            long r = syscall(__NR_io_uring_enter, m_fd, m_unsubmitted, wait,
+                             IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (r >= 0) {
+                m_unsubmitted -= static_cast<unsigned>(r);
+                if (m_unsubmitted == 0) {
+                    return;
+                }
+            } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw std::runtime_error(std::string("Failed to submit to "
+                    "io_uring: ") + strerror(errno));
+            }
+        }
+    }
+
+    int m_fd = -1;
+    unsigned m_entries = 0;
+
+    // Operations of a failed read_files() may still be in flight,
+    // reading into the parked buffers.
+    bool m_broken = false;
+    std::list<std::string> m_parked;
+
+    void *m_sq = nullptr;
+    void *m_cq = nullptr;
+    io_uring_sqe *m_sqes = nullptr;
+    size_t m_sq_size = 0;
+    size_t m_cq_size = 0;
+    size_t m_sqes_size = 0;
+
+    unsigned *m_sq_tail = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned *m_sq_array = nullptr;
+    unsigned m_sq_local_tail = 0;
+    unsigned m_unsubmitted = 0;
+
+    unsigned *m_cq_head = nullptr;
+    unsigned *m_cq_tail = nullptr;
+    unsigned m_cq_mask = 0;
+    io_uring_cqe *m_cqes = nullptr;
+};
+
+}
@@ -0,0 +1,1152 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "sepulca.h"
+#include "binary_codec.h"
+#include "file_lock.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define SEPULCA_LOG_MAGIC 0x31524c53u // "SLR1"
+
+namespace cosmica
+{
+
+/**
+ * Log storage tuning options.
+ */
+struct log_storage_options
+{
+    /**
+     * The active segment is closed and a new one is started once
+     * the active segment grows beyond this size.
+     */
+    uint64_t max_segment_size = 64 * 1024 * 1024;
+
+    /**
+     * Compaction starts when the garbage (overwritten and erased records)
+     * exceeds both this share of the total log size...
+     */
+    double compaction_ratio = 0.5;
+
+    /**
+     * ... and this absolute amount of bytes.
+     */
+    uint64_t compaction_min_garbage = 4 * 1024 * 1024;
+
+    /**
+     * How often the background compactor checks the garbage amount.
+     * Zero disables background compaction; compact() can still be
+     * called explicitly.
+     */
+    std::chrono::milliseconds compaction_interval = std::chrono::seconds(1);
+};
+
+/**
+ * Log-structured sepulca storage.
+ *
+ * All sepulcas of the storage live in a sequence of append-only segment files
+ * ("segment-000001.log", ...). Every commit and erase appends a record to the
+ * last (active) segment, and an in-memory index maps sepulca identifiers to
+ * their latest records. The index is rebuilt from the segments at open.
+ *
+ * Overwritten and erased records are reclaimed by compaction, which copies
+ * the live records into a new segment and removes the old ones.
+ *
+ * The same log storage can be opened by several processes: every operation
+ * takes the storage file lock (shared for reads, exclusive for writes) and
+ * first catches up with the records appended by the others.
+ */
+class log_storage : public storage
+{
+public:
+    /**
+     * Opens sepulca log storage for the given path.
+     */
+    explicit log_storage(const std::filesystem::path &dir,
+                         log_storage_options opts = {}) :
+        m_dir(dir),
+        m_opts(opts)
+    {
+        auto s = std::filesystem::status(m_dir);
+        if (s.type() == std::filesystem::file_type::not_found) {
+            std::cerr << "Log storage '" << dir.string()
+                << "' not found, creating new."
+                << std::endl;
+
+            std::filesystem::create_directories(m_dir);
+        } else if (s.type() != std::filesystem::file_type::directory) {
+            throw std::runtime_error("Log storage '" + dir.string() +
+                "' not a directory");
+        }
+
+        m_lock = std::make_unique<file_lock>(dir / "lock.txt");
+
+        {
+            std::shared_lock guard(*m_lock);
+            std::lock_guard state(m_mutex);
+            do_rebuild();
+        }
+
+        if (m_opts.compaction_interval.count() > 0) {
+            m_compactor = std::thread([this] { compactor_loop(); });
+        }
+    }
+
+    virtual ~log_storage() override
+    {
+        {
+            std::lock_guard state(m_mutex);
+            m_stop = true;
+        }
+        m_stop_cv.notify_all();
+
+        if (m_compactor.joinable()) {
+            m_compactor.join();
+        }
+
+        do_close_segments();
+    }
+
+    virtual sepulca_ptr create(attributes attrs = {}) override
+    {
+        scoped_timer timer(timer_metric::create);
+        std::lock_guard guard(*m_lock);
+        std::lock_guard state(m_mutex);
+        do_refresh();
+
+        sepulca_id_generator gen;
+        sepulca_id sid;
+        do {
+            sid = gen.new_id();
+        } while (m_index.contains(sid));
+
+        auto s = new_sepulca(std::move(sid), std::move(attrs), 1);
+        do_append(record_type::put, *s, 1);
+        return s;
+    }
+
+    virtual sepulca_ptr get(const sepulca_id &sid) const override
+    {
+        scoped_timer timer(timer_metric::get);
+        std::shared_lock guard(*m_lock);
+        auto state = do_lock_state_shared();
+
+        auto i = m_index.find(sid);
+        if (i == m_index.end()) {
+            throw std::runtime_error("Sepulca '" + sid.to_string() +
+                "' not found");
+        }
+
+        auto s = do_load(i->second);
+        if (!s) {
+            throw std::runtime_error("Sepulca '" + sid.to_string() +
+                "' is corrupted");
+        }
+        return s;
+    }
+
+    virtual bool exists(const sepulca_id &sid) const override
+    {
+        scoped_timer timer(timer_metric::exists);
+        std::shared_lock guard(*m_lock);
+        auto state = do_lock_state_shared();
+
+        return m_index.contains(sid);
+    }
+
+    /**
+     * Looks all identifiers up under a single acquisition of the locks.
+     */
+    virtual std::vector<bool> exists_many(
+        std::span<const sepulca_id> ids) const override
+    {
+        std::shared_lock guard(*m_lock);
+        auto state = do_lock_state_shared();
+
+        std::vector<bool> res;
+        res.reserve(ids.size());
+        for (const auto &sid : ids) {
+            res.push_back(m_index.contains(sid));
+        }
+        return res;
+    }
+
+    /**
+     * Records are read in batches, and callbacks for a batch are made
+     * after releasing the locks, so that they may use the storage.
+     */
+    virtual void enumerate(std::function<bool(sepulca_ptr)> cb) const override
+    {
+        sepulca_view view;
+        do_for_each_record([&](const std::vector<std::string> &bodies) {
+            for (const auto &body : bodies) {
+                if (parse_view(body, view) && !cb(do_materialize(view))) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
+    /**
+     * Takes identifiers from the in-memory index; records are not read.
+     */
+    virtual void enumerate_ids(
+        std::function<bool(const sepulca_id &)> cb) const override
+    {
+        std::vector<sepulca_id> ids;
+        {
+            std::shared_lock guard(*m_lock);
+            auto state = do_lock_state_shared();
+
+            ids.reserve(m_index.size());
+            for (const auto &[sid, loc] : m_index) {
+                ids.push_back(sid);
+            }
+        }
+
+        for (const auto &sid : ids) {
+            if (!cb(sid)) {
+                break;
+            }
+        }
+    }
+
+    /**
+     * The index is unordered, so every batch is selected from all
+     * identifiers in the index; records are not read.
+     */
+    virtual std::vector<sepulca_id> scan_ids(
+        std::optional<sepulca_id> start_after, size_t limit) const override
+    {
+        scan_window window(start_after, limit);
+        std::shared_lock guard(*m_lock);
+        auto state = do_lock_state_shared();
+
+        for (const auto &[sid, loc] : m_index) {
+            window.add(sid);
+        }
+        return window.take();
+    }
+
+    /**
+     * The record is read under the locks and parsed after releasing them,
+     * so that the callback may use the storage.
+     */
+    virtual void visit(const sepulca_id &sid,
+                       std::function<void(const sepulca_view &)> cb)
+        const override
+    {
+        std::string body;
+        {
+            std::shared_lock guard(*m_lock);
+            auto state = do_lock_state_shared();
+
+            auto i = m_index.find(sid);
+            if (i == m_index.end()) {
+                throw std::runtime_error("Sepulca '" + sid.to_string() +
+                    "' not found");
+            }
+            do_read_record(i->second, body);
+        }
+
+        sepulca_view view;
+        if (!parse_view(body, view)) {
+            throw std::runtime_error("Sepulca '" + sid.to_string() +
+                "' is corrupted");
+        }
+        cb(view);
+    }
+
+    /**
+     * Records are read in batches, as by enumerate().
+     */
+    virtual void enumerate_views(
+        std::function<bool(const sepulca_view &)> cb) const override
+    {
+        sepulca_view view;
+        do_for_each_record([&](const std::vector<std::string> &bodies) {
+            for (const auto &body : bodies) {
+                if (parse_view(body, view) && !cb(view)) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
+    /**
+     * Appends the whole batch as a single log record, so that a torn batch
+     * fails the checksum and is dropped as a whole, and syncs it to disk.
+     */
+    virtual std::vector<sepulca_ptr> apply(const write_batch &batch) override
+    {
+        scoped_timer timer(timer_metric::apply);
+        std::lock_guard guard(*m_lock);
+        std::lock_guard state(m_mutex);
+        do_refresh();
+
+        // Versions of sepulcas touched by the batch so far, none for
+        // erased ones.
+        std::unordered_map<sepulca_id, std::optional<uint64_t>> touched;
+        auto get_version = [&](const sepulca_id &sid) {
+            if (auto i = touched.find(sid); i != touched.end()) {
+                return i->second;
+            }
+            auto i = m_index.find(sid);
+            return i != m_index.end() ? std::optional(i->second.version)
+                                      : std::nullopt;
+        };
+
+        std::vector<std::pair<sepulca_id, const attributes *>> created;
+        sepulca_id_generator gen;
+
+        std::string body, sub;
+        put_u32(body, static_cast<uint32_t>(batch.size()));
+        for (const auto &op : batch.get_ops()) {
+            sub.clear();
+
+            record_type type = record_type::put;
+            switch (op.type) {
+            case write_batch::op_type::create: {
+                sepulca_id sid;
+                do {
+                    sid = gen.new_id();
+                } while (get_version(sid));
+
+                encode_put(sub, sid, op.attrs, 1);
+                touched[sid] = 1;
+                created.emplace_back(sid, &op.attrs);
+                break;
+            }
+            case write_batch::op_type::put: {
+                const auto version = std::max(get_version(op.sid).value_or(0),
+                                              op.version) + 1;
+                encode_put(sub, op.sid, op.attrs, version);
+                touched[op.sid] = version;
+                break;
+            }
+            case write_batch::op_type::erase:
+                if (!get_version(op.sid)) {
+                    throw std::runtime_error("Sepulca '" +
+                        op.sid.to_string() + "' has been already destroyed");
+                }
+                type = record_type::erase;
+                put_u64(sub, op.sid.value);
+                touched[op.sid] = std::nullopt;
+                break;
+            }
+
+            put_u32(body, static_cast<uint32_t>(type));
+            put_u32(body, static_cast<uint32_t>(sub.size()));
+            body += sub;
+        }
+
+        if (!batch.empty()) {
+            auto loc = do_append_record(record_type::batch, body);
+            do_apply_record(record_type::batch, body, loc);
+
+            if (fdatasync(m_segments.at(loc.segment).fd) != 0) {
+                throw std::runtime_error("Failed to sync log segment '" +
+                    get_segment_path(loc.segment).string() + "': " +
+                    strerror(errno));
+            }
+        }
+        finish_commits(batch, get_version);
+
+        std::vector<sepulca_ptr> res;
+        res.reserve(created.size());
+        for (auto &[sid, attrs] : created) {
+            res.push_back(new_sepulca(std::move(sid), attributes(*attrs), 1));
+        }
+        return res;
+    }
+
+    /**
+     * Rewrites live records into a new segment and removes the old
+     * segments, reclaiming space occupied by overwritten and erased records.
+     */
+    void compact()
+    {
+        std::lock_guard guard(*m_lock);
+        std::lock_guard state(m_mutex);
+        do_refresh();
+        do_compact();
+    }
+
+protected:
+    virtual void erase(sepulca &s) override
+    {
+        scoped_timer timer(timer_metric::erase);
+        std::lock_guard guard(*m_lock);
+        std::lock_guard state(m_mutex);
+        do_refresh();
+
+        if (!m_index.contains(s.get_id())) {
+            throw std::runtime_error("Sepulca '" + s.get_id().to_string() +
+                "' has been already destroyed");
+        }
+
+        do_append(record_type::erase, s, 0);
+    }
+
+    virtual std::optional<uint64_t> commit(
+        sepulca &s, std::optional<uint64_t> expected) override
+    {
+        scoped_timer timer(timer_metric::commit);
+        std::lock_guard guard(*m_lock);
+        std::lock_guard state(m_mutex);
+        do_refresh();
+
+        auto i = m_index.find(s.get_id());
+        const uint64_t stored = i != m_index.end() ? i->second.version : 0;
+        if (expected && *expected != stored) {
+            return {};
+        }
+
+        const auto version = std::max(stored, s.get_version()) + 1;
+        do_append(record_type::put, s, version);
+        return version;
+    }
+
+    /**
+     * Loads all records under a single acquisition of the locks, reading
+     * them in the log order.
+     */
+    virtual bool load_many(std::span<const sepulca_id> ids,
+                           std::vector<sepulca_ptr> &res) const override
+    {
+        std::shared_lock guard(*m_lock);
+        auto state = do_lock_state_shared();
+
+        std::vector<std::pair<location, size_t>> locs;
+        locs.reserve(ids.size());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (auto j = m_index.find(ids[i]); j != m_index.end()) {
+                locs.emplace_back(j->second, i);
+            }
+        }
+        std::sort(locs.begin(), locs.end());
+
+        res.clear();
+        res.resize(ids.size());
+        for (const auto &[loc, i] : locs) {
+            res[i] = do_load(loc);
+            if (!res[i]) {
+                throw std::runtime_error("Sepulca '" + ids[i].to_string() +
+                    "' is corrupted");
+            }
+        }
+        return true;
+    }
+
+private:
+    enum class record_type : uint32_t
+    {
+        put = 1,
+        erase = 2,
+        batch = 3,
+    };
+
+    /**
+     * On-disk record header. Fields are stored in the host byte order.
+     */
+    struct record_header
+    {
+        uint32_t magic;
+        record_type type;
+        uint32_t size;
+        uint32_t checksum;
+    };
+
+    /**
+     * Location of a record body in the log, and the version of the sepulca
+     * put by the record.
+     */
+    struct location
+    {
+        uint32_t segment;
+        uint64_t offset;
+        uint32_t size;
+        uint64_t version = 0;
+
+        auto operator<=>(const location &) const = default;
+    };
+
+    struct segment
+    {
+        int fd = -1;
+        ino_t ino = 0;
+        uint64_t end = 0;     // End of the last valid record.
+        uint64_t garbage = 0; // Bytes of overwritten and erased records.
+        bool torn = false;    // Has a torn record after the end.
+    };
+
+    void do_append(record_type type, const sepulca &s, uint64_t version)
+    {
+        std::string body;
+        if (type == record_type::put) {
+            encode_put(body, s.get_id(), s.get_attrs(), version);
+        } else {
+            put_u64(body, s.get_id().value);
+        }
+
+        auto loc = do_append_record(type, body);
+        do_apply_record(type, body, loc);
+    }
+
+    /**
+     * Appends a record to the log, returning the location of its body.
+     */
+    location do_append_record(record_type type, std::string_view body)
+    {
+        const bool fits =
+            m_segments.rbegin()->second.end < m_opts.max_segment_size;
+        auto [n, seg] = fits ? do_active_segment() : do_new_segment();
+
+        // A torn record left by a crashed writer must not stay between
+        // the valid records.
+        if (seg.torn) {
+            if (ftruncate(seg.fd, static_cast<off_t>(seg.end)) != 0) {
+                throw std::runtime_error("Failed to truncate log segment '" +
+                    get_segment_path(n).string() + "': " + strerror(errno));
+            }
+            seg.torn = false;
+        }
+
+        record_header hdr{
+            SEPULCA_LOG_MAGIC,
+            type,
+            static_cast<uint32_t>(body.size()),
+            checksum(body)
+        };
+        std::string rec(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+        rec += body;
+        write_all(seg.fd, rec, seg.end, n);
+
+        location loc{
+            n, seg.end + sizeof(hdr), static_cast<uint32_t>(body.size())
+        };
+        seg.end += rec.size();
+        return loc;
+    }
+
+    /**
+     * Encodes a put record body: the identifier, the attributes and
+     * the version. Records written before versions have no version.
+     */
+    static void encode_put(std::string &body, const sepulca_id &sid,
+                           const attributes &attrs, uint64_t version)
+    {
+        scoped_timer timer(timer_metric::serialize);
+        put_u64(body, sid.value);
+        put_u32(body, static_cast<uint32_t>(attrs.size()));
+        for (const auto &[k, v] : attrs) {
+            put_string(body, k);
+            put_string(body, v);
+        }
+        put_u64(body, version);
+    }
+
+    /**
+     * Returns the version of a put record body, or zero if it has none.
+     */
+    static uint64_t decode_version(std::string_view body)
+    {
+        uint64_t id, version = 0;
+        uint32_t count;
+        if (!get_u64(body, id) || !get_u32(body, count)) {
+            return 0;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            std::string_view k, v;
+            if (!get_string(body, k) || !get_string(body, v)) {
+                return 0;
+            }
+        }
+        get_u64(body, version);
+        return version;
+    }
+
+    /**
+     * Updates the index with a record whose body is at the given location.
+     * Returns false if the record is malformed.
+     */
+    bool do_apply_record(record_type type, std::string_view body,
+                         location loc)
+    {
+        if (type != record_type::batch) {
+            sepulca_id sid;
+            if (std::string_view in = body; !get_u64(in, sid.value)) {
+                return false;
+            }
+            if (type == record_type::put) {
+                loc.version = decode_version(body);
+            }
+            do_apply(type, sid, loc);
+            return true;
+        }
+
+        // A batch body is a sequence of put and erase records, each
+        // preceded by its type and size. The whole batch is validated
+        // before any of it is applied.
+        struct entry
+        {
+            record_type type;
+            sepulca_id sid;
+            location loc;
+        };
+
+        std::vector<entry> entries;
+        std::string_view in = body;
+        uint32_t count;
+        if (!get_u32(in, count)) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t t, size;
+            if (!get_u32(in, t) || !get_u32(in, size) || in.size() < size) {
+                return false;
+            }
+
+            auto sub = in.substr(0, size);
+            const uint64_t offset = loc.offset + (body.size() - in.size());
+            in.remove_prefix(size);
+
+            entry e{static_cast<record_type>(t), {},
+                    {loc.segment, offset, size}};
+            if (e.type == record_type::put) {
+                e.loc.version = decode_version(sub);
+            }
+            if ((e.type != record_type::put && e.type != record_type::erase) ||
+                !get_u64(sub, e.sid.value)) {
+                return false;
+            }
+            entries.push_back(e);
+        }
+
+        for (const auto &e : entries) {
+            do_apply(e.type, e.sid, e.loc);
+        }
+        return true;
+    }
+
+    /**
+     * Updates the index with a record found at the given location.
+     */
+    void do_apply(record_type type, const sepulca_id &sid, location loc)
+    {
+        auto &seg = m_segments.at(loc.segment);
+
+        auto i = m_index.find(sid);
+        if (i != m_index.end()) {
+            m_segments.at(i->second.segment).garbage +=
+                i->second.size + sizeof(record_header);
+        }
+
+        if (type == record_type::put) {
+            if (i != m_index.end()) {
+                i->second = loc;
+            } else {
+                m_index.emplace(sid, loc);
+            }
+        } else {
+            if (i != m_index.end()) {
+                m_index.erase(i);
+            }
+            seg.garbage += loc.size + sizeof(record_header);
+        }
+    }
+
+    /**
+     * Catches up with other processes, and takes the state mutex in
+     * the shared mode, so that readers read records in parallel.
+     */
+    std::shared_lock<std::shared_mutex> do_lock_state_shared() const
+    {
+        {
+            std::lock_guard state(m_mutex);
+            do_refresh();
+        }
+        return std::shared_lock(m_mutex);
+    }
+
+    /**
+     * Catches up with the records appended by other processes and
+     * reloads the whole log if it has been compacted meanwhile.
+     */
+    void do_refresh() const
+    {
+        auto &self = const_cast<log_storage &>(*this);
+
+        if (m_segments.empty()) {
+            self.do_rebuild();
+            return;
+        }
+
+        auto [n, seg] = self.do_active_segment();
+
+        struct stat st;
+        if (stat(get_segment_path(n).c_str(), &st) != 0 ||
+            st.st_ino != seg.ino) {
+            self.do_rebuild();
+            return;
+        }
+
+        if (static_cast<uint64_t>(st.st_size) > seg.end) {
+            self.do_scan(n);
+        }
+
+        // Other processes may have started a new segment once the active
+        // one had grown too large.
+        for (;;) {
+            auto [last, last_seg] = self.do_active_segment();
+            auto next = last + 1;
+            if (last_seg.end < m_opts.max_segment_size ||
+                !std::filesystem::exists(get_segment_path(next))) {
+                break;
+            }
+            self.do_open_segment(next);
+            self.do_scan(next);
+        }
+    }
+
+    /**
+     * Rebuilds the index from scratch by reading all segments.
+     */
+    void do_rebuild()
+    {
+        do_close_segments();
+        m_index.clear();
+
+        std::vector<uint32_t> nums;
+        for (const auto &ent : std::filesystem::directory_iterator(m_dir)) {
+            if (auto n = parse_segment_name(ent.path().filename().string())) {
+                nums.push_back(n);
+            }
+        }
+        std::sort(nums.begin(), nums.end());
+
+        for (auto n : nums) {
+            do_open_segment(n);
+            do_scan(n);
+        }
+
+        if (m_segments.empty()) {
+            do_open_segment(1);
+        }
+    }
+
+    /**
+     * Reads records of a segment starting at its known valid end.
+     * Scanning stops at the first invalid (torn) record.
+     */
+    void do_scan(uint32_t n)
+    {
+        auto &seg = m_segments.at(n);
+
+        struct stat st;
+        if (fstat(seg.fd, &st) != 0) {
+            throw std::runtime_error("Failed to stat log segment '" +
+                get_segment_path(n).string() + "': " + strerror(errno));
+        }
+
+        const uint64_t size = st.st_size;
+        std::string body;
+        while (seg.end + sizeof(record_header) <= size) {
+            record_header hdr;
+            read_all(seg.fd, &hdr, sizeof(hdr), seg.end, n);
+            if (hdr.magic != SEPULCA_LOG_MAGIC ||
+                seg.end + sizeof(hdr) + hdr.size > size) {
+                break;
+            }
+
+            body.resize(hdr.size);
+            read_all(seg.fd, body.data(), body.size(),
+                     seg.end + sizeof(hdr), n);
+            if (hdr.checksum != checksum(body)) {
+                break;
+            }
+
+            if (!do_apply_record(hdr.type, body, location{
+                    n, seg.end + sizeof(hdr), hdr.size
+                })) {
+                break;
+            }
+            seg.end += sizeof(hdr) + hdr.size;
+        }
+
+        // Writers hold the storage lock exclusively, so the rest has been
+        // left by a crashed one.
+        seg.torn = seg.end < size;
+    }
+
+    /**
+     * Reads the records of all live sepulcas in the log order, so that
+     * segments are read sequentially, in batches of enumerate_batch_size
+     * read under the locks. The callback gets every batch with no lock
+     * held, and stops the reading by returning false.
+     */
+    void do_for_each_record(
+        const std::function<bool(const std::vector<std::string> &)> &cb)
+        const
+    {
+        std::vector<sepulca_id> ids;
+        {
+            std::shared_lock guard(*m_lock);
+            auto state = do_lock_state_shared();
+
+            std::vector<std::pair<location, sepulca_id>> live;
+            live.reserve(m_index.size());
+            for (const auto &[sid, loc] : m_index) {
+                live.emplace_back(loc, sid);
+            }
+            std::sort(live.begin(), live.end());
+
+            ids.reserve(live.size());
+            for (const auto &[loc, sid] : live) {
+                ids.push_back(sid);
+            }
+        }
+
+        // Records are looked up again for every batch, as they may have
+        // been moved or erased meanwhile.
+        std::vector<std::string> bodies;
+        for (size_t i = 0; i < ids.size(); i += enumerate_batch_size) {
+            bodies.clear();
+            {
+                std::shared_lock guard(*m_lock);
+                auto state = do_lock_state_shared();
+
+                const auto end = std::min(ids.size(),
+                                          i + enumerate_batch_size);
+                for (size_t j = i; j < end; ++j) {
+                    if (auto k = m_index.find(ids[j]); k != m_index.end()) {
+                        do_read_record(k->second, bodies.emplace_back());
+                    }
+                }
+            }
+
+            if (!cb(bodies)) {
+                return;
+            }
+        }
+    }
+
+    /**
+     * Loads a sepulca from the record at the given location.
+     */
+    sepulca_ptr do_load(const location &loc) const
+    {
+        std::string body;
+        sepulca_view view;
+        if (!do_load_view(loc, body, view)) {
+            return {};
+        }
+        return do_materialize(view);
+    }
+
+    /**
+     * Creates a sepulca owning copies of the view's attributes.
+     */
+    sepulca_ptr do_materialize(const sepulca_view &view) const
+    {
+        attributes attrs;
+        for (const auto &[k, v] : view.get_attrs()) {
+            attrs.emplace_hint(attrs.end(), k, v);
+        }
+
+        auto sid = view.get_id();
+        return new_sepulca(std::move(sid), std::move(attrs),
+                           view.get_version());
+    }
+
+    /**
+     * Reads the record at the given location into the buffer and parses it
+     * into a view referring to the buffer.
+     */
+    bool do_load_view(const location &loc, std::string &body,
+                      sepulca_view &view) const
+    {
+        do_read_record(loc, body);
+        return parse_view(body, view);
+    }
+
+    /**
+     * Reads the record at the given location into the buffer.
+     */
+    void do_read_record(const location &loc, std::string &body) const
+    {
+        const auto &seg = m_segments.at(loc.segment);
+
+        body.resize(loc.size);
+        read_all(seg.fd, body.data(), body.size(), loc.offset, loc.segment);
+    }
+
+    /**
+     * Parses a record read by do_read_record() into a view referring
+     * to it.
+     */
+    static bool parse_view(std::string_view body, sepulca_view &view)
+    {
+        scoped_timer timer(timer_metric::deserialize);
+        std::string_view in(body);
+        sepulca_id sid;
+        uint32_t count;
+        if (!get_u64(in, sid.value) || !get_u32(in, count)) {
+            return false;
+        }
+
+        view.reset(sid);
+        for (uint32_t i = 0; i < count; ++i) {
+            std::string_view k, v;
+            if (!get_string(in, k) || !get_string(in, v)) {
+                return false;
+            }
+            view.add_attr(k, v);
+        }
+
+        uint64_t version;
+        if (get_u64(in, version)) {
+            view.set_version(version);
+        }
+
+        view.finish();
+        return true;
+    }
+
+    void do_compact()
+    {
+        auto [target, seg] = do_new_segment();
+        auto old_end = m_segments.find(target);
+
+        std::vector<std::pair<location, sepulca_id>> live;
+        live.reserve(m_index.size());
+        for (const auto &[sid, loc] : m_index) {
+            live.emplace_back(loc, sid);
+        }
+        std::sort(live.begin(), live.end());
+
+        // Records are rewritten with new headers, as records from batches
+        // have none of their own.
+        std::string rec;
+        for (const auto &[loc, sid] : live) {
+            const auto &src = m_segments.at(loc.segment);
+            rec.resize(sizeof(record_header) + loc.size);
+            read_all(src.fd, rec.data() + sizeof(record_header), loc.size,
+                     loc.offset, loc.segment);
+
+            record_header hdr{
+                SEPULCA_LOG_MAGIC,
+                record_type::put,
+                loc.size,
+                checksum(std::string_view(rec).substr(sizeof(record_header)))
+            };
+            memcpy(rec.data(), &hdr, sizeof(hdr));
+            write_all(seg.fd, rec, seg.end, target);
+
+            m_index[sid] = location{
+                target, seg.end + sizeof(record_header), loc.size, loc.version
+            };
+            seg.end += rec.size();
+        }
+
+        // The new segment must be durable before the old ones disappear.
+        if (fdatasync(seg.fd) != 0) {
+            throw std::runtime_error("Failed to sync log segment '" +
+                get_segment_path(target).string() + "': " + strerror(errno));
+        }
+
+        for (auto i = m_segments.begin(); i != old_end;) {
+            close(i->second.fd);
+            std::filesystem::remove(get_segment_path(i->first));
+            i = m_segments.erase(i);
+        }
+    }
+
+    void compactor_loop()
+    {
+        std::unique_lock state(m_mutex);
+        while (!m_stop) {
+            m_stop_cv.wait_for(state, m_opts.compaction_interval);
+            if (m_stop || !do_needs_compaction()) {
+                continue;
+            }
+
+            // The file lock must be taken before the state mutex.
+            state.unlock();
+            try {
+                compact();
+            } catch (const std::exception &err) {
+                std::cerr << "Log storage compaction failed: " << err.what()
+                    << std::endl;
+            }
+            state.lock();
+        }
+    }
+
+    bool do_needs_compaction() const
+    {
+        uint64_t total = 0, garbage = 0;
+        for (const auto &[n, seg] : m_segments) {
+            total += seg.end;
+            garbage += seg.garbage;
+        }
+
+        return garbage >= m_opts.compaction_min_garbage &&
+            garbage >= total * m_opts.compaction_ratio;
+    }
+
+    std::pair<uint32_t, segment &> do_active_segment()
+    {
+        auto i = m_segments.rbegin();
+        return {i->first, i->second};
+    }
+
+    std::pair<uint32_t, segment &> do_new_segment()
+    {
+        auto n = m_segments.empty() ? 1 : m_segments.rbegin()->first + 1;
+        return {n, do_open_segment(n)};
+    }
+
+    segment &do_open_segment(uint32_t n)
+    {
+        auto path = get_segment_path(n);
+        int fd = open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open log segment '" +
+                path.string() + "': " + strerror(errno));
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to stat log segment '" +
+                path.string() + "': " + strerror(errno));
+        }
+
+        auto &seg = m_segments[n];
+        seg = segment{fd, st.st_ino, 0, 0, false};
+        return seg;
+    }
+
+    void do_close_segments()
+    {
+        for (auto &[n, seg] : m_segments) {
+            close(seg.fd);
+        }
+        m_segments.clear();
+    }
+
+    std::filesystem::path get_segment_path(uint32_t n) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "segment-%06u.log", n);
+        return m_dir / name;
+    }
+
+    static uint32_t parse_segment_name(const std::string &name)
+    {
+        unsigned n = 0;
+        int len = 0;
+        if (sscanf(name.c_str(), "segment-%6u.log%n", &n, &len) == 1 &&
+            static_cast<size_t>(len) == name.size()) {
+            return n;
+        }
+        return 0;
+    }
+
+    void read_all(int fd, void *buf, size_t size, uint64_t offset,
+                  uint32_t n) const
+    {
+        metrics::add(counter_metric::bytes_read, size);
+
+        auto p = static_cast<char *>(buf);
+        while (size > 0) {
+            auto r = pread(fd, p, size, static_cast<off_t>(offset));
+            if (r <= 0) {
+                throw std::runtime_error("Failed to read log segment '" +
+                    get_segment_path(n).string() + "': " +
+                    (r == 0 ? "unexpected end of file" : strerror(errno)));
+            }
+            p += r;
+            size -= r;
+            offset += r;
+        }
+    }
+
+    void write_all(int fd, std::string_view buf, uint64_t offset,
+                   uint32_t n) const
+    {
+        metrics::add(counter_metric::bytes_written, buf.size());
+
+        while (!buf.empty()) {
+            auto r = pwrite(fd, buf.data(), buf.size(),
+                            static_cast<off_t>(offset));
+            if (r < 0) {
+                throw std::runtime_error("Failed to write log segment '" +
+                    get_segment_path(n).string() + "': " + strerror(errno));
+            }
+            buf.remove_prefix(r);
+            offset += r;
+        }
+    }
+
+    sepulca_ptr new_sepulca(sepulca_id &&sid, attributes &&attrs,
+                            uint64_t version) const
+    {
+        return make_sepulca(*this, std::move(sid), std::move(attrs), version);
+    }
+
+    // Records read by enumerate() before callbacks are made for them.
+    static constexpr size_t enumerate_batch_size = 1024;
+
+    const std::filesystem::path m_dir;
+    const log_storage_options m_opts;
+    mutable std::unique_ptr<file_lock> m_lock;
+
+    // In-memory state, guarded by m_mutex; records are read with it
+    // shared, and the state is changed with it exclusive.
+    mutable std::shared_mutex m_mutex;
+    std::map<uint32_t, segment> m_segments;
+    std::unordered_map<sepulca_id, location> m_index;
+
+    std::thread m_compactor;
+    std::condition_variable_any m_stop_cv;
+    bool m_stop = false;
+};
+
+}
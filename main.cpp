@@ -19,9 +19,49 @@
  ******************************************************************************/
 
 #include "file_storage.h"
+#include "log_storage.h"
+#include "memory_storage.h"
+#include "ndjson.h"
+#include "remote_storage.h"
+#include "storage_server.h"
+#include "thread_pool.h"
+#include <cassert>
+#include <charconv>
+#include <csignal>
+#include <cstring>
 #include <iostream>
 
-static void print(const cosmica::sepulca &s, size_t indent = 0)
+/**
+ * Opens a storage at the given path.
+ * Paths prefixed with "log:" are opened as log-structured storages,
+ * paths prefixed with "mem:" as memory storages saved to the file,
+ * and paths prefixed with "unix:" as storages served on the socket.
+ */
+static std::unique_ptr<cosmica::storage> open_storage(
+    const std::filesystem::path &path)
+{
+    constexpr std::string_view log_prefix = "log:";
+    constexpr std::string_view mem_prefix = "mem:";
+    constexpr std::string_view unix_prefix = "unix:";
+
+    const auto &p = path.native();
+    if (p.starts_with(log_prefix)) {
+        return std::make_unique<cosmica::log_storage>(
+            p.substr(log_prefix.size()));
+    }
+    if (p.starts_with(mem_prefix)) {
+        return std::make_unique<cosmica::memory_storage>(
+            cosmica::memory_storage_options{p.substr(mem_prefix.size())});
+    }
+    if (p.starts_with(unix_prefix)) {
+        return std::make_unique<cosmica::remote_storage>(
+            p.substr(unix_prefix.size()));
+    }
+    return std::make_unique<cosmica::file_storage>(path);
+}
+
+template<typename Sepulca>
+static void print(const Sepulca &s, size_t indent = 0)
 {
     std::string si(indent * 4, ' ');
     std::cout << si << "sepulca " << s.get_id() << ": "
@@ -35,8 +75,8 @@ static void print(const cosmica::sepulca &s, size_t indent = 0)
 static void print_all(cosmica::storage &stor)
 {
     std::cout << "storage contents:" << std::endl;
-    stor.enumerate([](auto s) {
-        print(*s, 1);
+    stor.enumerate_views([](const auto &s) {
+        print(s, 1);
         return true;
     });
     std::cout << std::endl;
@@ -45,17 +85,33 @@ static void print_all(cosmica::storage &stor)
 static int list_storage(const std::filesystem::path &path)
 {
     std::cout << "list sepulca storage " << path << std::endl;
-	cosmica::file_storage stor(path);
-	print_all(stor);
+	auto stor = open_storage(path);
+	print_all(*stor);
 	return 0;
 }
 
+static int list_ids(const std::filesystem::path &path)
+{
+    std::cout << "list sepulca identifiers in storage " << path << std::endl;
+    auto stor = open_storage(path);
+
+    size_t count = 0;
+    stor->enumerate_ids([&](const cosmica::sepulca_id &sid) {
+        std::cout << "    " << sid << "\n";
+        ++count;
+        return true;
+    });
+    std::cout << count << " sepulca(s)" << std::endl;
+
+    return 0;
+}
+
 static int create_sepulca(const std::filesystem::path &path, int argc, char *kv[])
 {
     assert(argc % 2 == 0);
 
     std::cout << "create sepulca in storage " << path << std::endl;
-	cosmica::file_storage stor(path);
+	auto stor = open_storage(path);
 
 	cosmica::attributes attrs;
 	for (int i = 0; i < argc; i += 2) {
@@ -64,7 +120,7 @@ static int create_sepulca(const std::filesystem::path &path, int argc, char *kv[
 	    ++kv;
     }
 
-	auto s = stor.create(std::move(attrs));
+	auto s = stor->create(std::move(attrs));
 	print(*s);
 
 	return 0;
@@ -76,8 +132,8 @@ static int erase_sepulca(const std::filesystem::path &path,
     std::cout << "erase sepulca from storage " << path
         << ": '" << sid << "'" << std::endl;
 
-    cosmica::file_storage stor(path);
-    auto s = stor.get(sid);
+    auto stor = open_storage(path);
+    auto s = stor->get(sid);
     std::cout << "this sepulca will be erased:" << std::endl;
     print(*s);
     s->erase();
@@ -85,15 +141,40 @@ static int erase_sepulca(const std::filesystem::path &path,
 	return 0;
 }
 
+static int scan_storage(const std::filesystem::path &path, size_t limit,
+                        std::optional<cosmica::sepulca_id> start_after)
+{
+    std::cout << "scan sepulca storage " << path;
+    if (start_after) {
+        std::cout << " after '" << *start_after << "'";
+    }
+    std::cout << std::endl;
+
+    auto stor = open_storage(path);
+    const auto batch = stor->scan(start_after, limit);
+    for (const auto &s : batch.sepulcas) {
+        print(*s, 1);
+    }
+
+    if (batch.next) {
+        std::cout << "next: " << *batch.next << std::endl;
+    } else {
+        std::cout << "end of storage" << std::endl;
+    }
+
+    return 0;
+}
+
 static int print_sepulca(const std::filesystem::path &path,
                          cosmica::sepulca_id sid)
 {
     std::cout << "print sepulca from storage " << path
         << ": '" << sid << "'" << std::endl;
 
-    cosmica::file_storage stor(path);
-    auto s = stor.get(sid);
-    print(*s);
+    auto stor = open_storage(path);
+    stor->visit(sid, [](const auto &s) {
+        print(s);
+    });
 
 	return 0;
 }
@@ -104,8 +185,8 @@ static int check_sepulca(const std::filesystem::path &path,
     std::cout << "check if sepulca '" << sid << "' exists in storage "
         << path << std::endl;
 
-    cosmica::file_storage stor(path);
-    if (stor.exists(sid)) {
+    auto stor = open_storage(path);
+    if (stor->exists(sid)) {
         std::cout << "it exists" << std::endl;
     } else {
         std::cout << "it does not exist" << std::endl;
@@ -114,19 +195,271 @@ static int check_sepulca(const std::filesystem::path &path,
 	return 0;
 }
 
-static int test_lock()
+static int index_attribute(const std::filesystem::path &path,
+                           const std::string &name)
+{
+    std::cout << "index attribute '" << name << "' in storage " << path
+        << std::endl;
+
+    auto stor = open_storage(path);
+    stor->create_index(name);
+
+    return 0;
+}
+
+static int find_sepulcas(const std::filesystem::path &path,
+                         const std::string &name, const std::string &value)
+{
+    std::cout << "find sepulcas with " << name << " = " << value
+        << " in storage " << path << std::endl;
+
+    auto stor = open_storage(path);
+    for (const auto &s : stor->find(name, value)) {
+        print(*s, 1);
+    }
+
+    return 0;
+}
+
+static int shard_storage(const std::filesystem::path &path)
+{
+    std::cout << "shard file storage " << path << std::endl;
+
+    cosmica::file_storage stor(path);
+    if (stor.is_sharded()) {
+        std::cout << "the storage is sharded already" << std::endl;
+    } else {
+        stor.shard();
+    }
+
+    return 0;
+}
+
+static int migrate_storage(const std::filesystem::path &path,
+                           cosmica::cell_format format)
+{
+    std::cout << "migrate file storage " << path << " to cell format v"
+        << static_cast<int>(format) << std::endl;
+
+    cosmica::file_storage_options opts;
+    opts.format = format;
+    cosmica::file_storage stor(path, opts);
+    std::cout << stor.migrate() << " cell(s) rewritten" << std::endl;
+
+    return 0;
+}
+
+// Import reads at most this many lines (or bytes) at once, applying them
+// as a single batch.
+static constexpr size_t import_batch_lines = 10000;
+static constexpr size_t import_batch_bytes = 16 << 20;
+
+// Export writes its output in blocks of about this size.
+static constexpr size_t export_block_size = 1 << 20;
+
+/**
+ * Reads the next chunk of lines of the import stream.
+ */
+static void read_import_lines(std::istream &is, std::vector<std::string> &lines)
+{
+    lines.clear();
+
+    size_t bytes = 0;
+    std::string line;
+    while (lines.size() < import_batch_lines && bytes < import_batch_bytes &&
+           std::getline(is, line)) {
+        bytes += line.size();
+        lines.push_back(std::move(line));
+    }
+}
+
+/**
+ * Parses the lines on the pool, returning a future of sepulcas for every
+ * slice of the lines.
+ */
+static std::vector<std::future<std::vector<std::pair<cosmica::sepulca_id,
+                                                     cosmica::attributes>>>>
+parse_import_lines(cosmica::thread_pool &pool,
+                   const std::vector<std::string> &lines, size_t first_line)
+{
+    using sepulcas = std::vector<std::pair<cosmica::sepulca_id,
+                                           cosmica::attributes>>;
+
+    std::vector<std::future<sepulcas>> res;
+    const size_t slice = (lines.size() + pool.size() - 1) / pool.size();
+    for (size_t begin = 0; begin < lines.size(); begin += slice) {
+        const size_t end = std::min(begin + slice, lines.size());
+        res.push_back(pool.submit([&lines, begin, end, first_line] {
+            cosmica::ndjson_parser parser;
+            sepulcas parsed;
+            parsed.reserve(end - begin);
+            for (size_t i = begin; i < end; ++i) {
+                if (lines[i].empty()) {
+                    continue;
+                }
+                auto &[sid, attrs] = parsed.emplace_back();
+                try {
+                    parser.parse(lines[i], sid, attrs);
+                } catch (const std::exception &err) {
+                    throw std::runtime_error("Line " +
+                        std::to_string(first_line + i) + ": " + err.what());
+                }
+            }
+            return parsed;
+        }));
+    }
+    return res;
+}
+
+static int import_sepulcas(const std::filesystem::path &path)
+{
+    std::cout << "import sepulcas into storage " << path << std::endl;
+    auto stor = open_storage(path);
+
+    // Chunks of lines are parsed on the pool while the previous chunk
+    // is written, so at most two chunks are in memory. The pool is
+    // declared last to finish parsing before the lines are destroyed.
+    std::vector<std::string> lines;
+    cosmica::write_batch batch;
+    cosmica::thread_pool pool;
+    size_t line_count = 0, count = 0;
+    for (;;) {
+        read_import_lines(std::cin, lines);
+        auto parsed = parse_import_lines(pool, lines, line_count + 1);
+        line_count += lines.size();
+
+        if (!batch.empty()) {
+            stor->apply(batch);
+            count += batch.size();
+            batch.clear();
+        }
+
+        for (auto &f : parsed) {
+            for (auto &[sid, attrs] : f.get()) {
+                if (sid) {
+                    batch.put(sid, std::move(attrs));
+                } else {
+                    batch.create(std::move(attrs));
+                }
+            }
+        }
+
+        if (lines.empty()) {
+            break;
+        }
+    }
+
+    if (std::cin.bad()) {
+        throw std::runtime_error("Failed to read the input");
+    }
+    std::cout << count << " sepulca(s) imported" << std::endl;
+
+    return 0;
+}
+
+static int export_sepulcas(const std::filesystem::path &path)
+{
+    // The standard output carries the sepulcas only.
+    std::cerr << "export sepulcas from storage " << path << std::endl;
+    auto stor = open_storage(path);
+
+    std::string block;
+    size_t count = 0;
+    stor->enumerate_views([&](const cosmica::sepulca_view &s) {
+        cosmica::write_ndjson(s, block);
+        ++count;
+        if (block.size() >= export_block_size) {
+            std::cout.write(block.data(), block.size());
+            block.clear();
+        }
+        return true;
+    });
+    std::cout.write(block.data(), block.size());
+    std::cout.flush();
+
+    if (!std::cout) {
+        throw std::runtime_error("Failed to write the output");
+    }
+    std::cerr << count << " sepulca(s) exported" << std::endl;
+
+    return 0;
+}
+
+static int print_stats(const std::filesystem::path &dir)
+{
+    std::cout << "metrics dumped to " << dir << std::endl;
+
+    cosmica::metrics_snapshot total;
+    size_t processes = 0;
+    for (const auto &e : std::filesystem::directory_iterator(dir)) {
+        if (e.path().extension() != ".txt") {
+            continue;
+        }
+
+        std::ifstream ifs(e.path());
+        total.merge(cosmica::metrics_snapshot::read(ifs));
+        ++processes;
+    }
+
+    std::cout << processes << " process(es)" << std::endl;
+    total.print(std::cout);
+
+    return 0;
+}
+
+static cosmica::storage_server *serving = nullptr;
+
+static void stop_serving(int)
+{
+    serving->stop();
+}
+
+static int serve_storage(const std::filesystem::path &path,
+                         const std::filesystem::path &socket)
+{
+    auto stor = open_storage(path);
+    cosmica::storage_server server(*stor, socket);
+
+    serving = &server;
+    struct sigaction sa = {};
+    sa.sa_handler = stop_serving;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    std::cout << "serving " << path << " on " << socket << std::endl;
+    server.run();
+    std::cout << "stopped" << std::endl;
+
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    serving = nullptr;
+
+    return 0;
+}
+
+static int test_lock(bool shared)
 {
     std::string pid = "[" + std::to_string(getpid()) + "] ";
 
     cosmica::file_lock fl("lock.txt");
 
-    std::cout << "testing file lock: " << fl.get_lock_file_path() << std::endl;
+    std::cout << "testing " << (shared ? "shared" : "exclusive")
+        << " file lock: " << fl.get_lock_file_path() << std::endl;
     std::cout << pid << "locking" << std::endl;
-    fl.lock();
+    if (shared) {
+        fl.lock_shared();
+    } else {
+        fl.lock();
+    }
     std::cout << pid << "sleeping 10 sec" << std::endl;
     sleep(10);
     std::cout << pid << "unlocking" << std::endl;
-    fl.unlock();
+    if (shared) {
+        fl.unlock_shared();
+    } else {
+        fl.unlock();
+    }
     std::cout << pid << "unlocked" << std::endl;
 
     return 0;
@@ -135,12 +468,34 @@ static int test_lock()
 static int usage()
 {
     std::cout << "usage:\n"
-        << "  lock                            test file lock\n"
+        << "  lock [shared]                   test file lock\n"
         << "  list <dir>                      list sepulcas in a storage\n"
+        << "  ids <dir>                       list sepulca identifiers only\n"
+        << "  scan <dir> <limit> [<id>]       list up to <limit> sepulcas\n"
+        << "                                  ordered by identifier, after <id>\n"
         << "  create <dir> [<key> <value>]... create a sepulca in a storage\n"
         << "  erase <dir> <id>                erase a sepulca\n"
         << "  print <dir> <id>                print a sepulca\n"
-        << "  check <dir> <id>                check if a sepulca exists\n";
+        << "  check <dir> <id>                check if a sepulca exists\n"
+        << "  index <dir> <key>               index an attribute\n"
+        << "  find <dir> <key> <value>        find sepulcas by an attribute\n"
+        << "  shard <dir>                     move cells of a file storage\n"
+        << "                                  into nested directories\n"
+        << "  migrate <dir> [v1|v2]           rewrite cells of a file storage\n"
+        << "                                  in the given format (v2)\n"
+        << "  import <dir>                    import sepulcas from NDJSON lines\n"
+        << "                                  on the standard input\n"
+        << "  export <dir>                    export sepulcas as NDJSON lines\n"
+        << "                                  to the standard output\n"
+        << "  stats <metrics dir>             print metrics dumped by processes\n"
+        << "                                  run with SEPULCA_METRICS_DIR set\n"
+        << "  serve <dir> <socket>            serve a storage on a Unix socket\n"
+        << "                                  until interrupted\n"
+        << "\n"
+        << "<dir> is a file storage directory; prefix it with 'log:'\n"
+        << "to use a log-structured storage instead, with 'mem:' to use\n"
+        << "a memory storage saved to the given file, or with 'unix:' to use\n"
+        << "a storage served on the given socket.\n";
     return 1;
 }
 
@@ -157,7 +512,10 @@ int main(int argc, char *argv[])
         ++argv;
 
         if (strcmp(cmd, "lock") == 0) {
-            return test_lock();
+            if (argc > 1 || (argc == 1 && strcmp(argv[0], "shared") != 0)) {
+                return usage();
+            }
+            return test_lock(argc == 1);
         }
 
         if (strcmp(cmd, "list") == 0) {
@@ -167,6 +525,13 @@ int main(int argc, char *argv[])
             return list_storage(argv[0]);
         }
 
+        if (strcmp(cmd, "ids") == 0) {
+            if (argc != 1) {
+                return usage();
+            }
+            return list_ids(argv[0]);
+        }
+
         if (strcmp(cmd, "add") == 0) {
             if (argc < 1) {
                 return usage();
@@ -187,18 +552,42 @@ int main(int argc, char *argv[])
             }
 
             const std::filesystem::path path = *argv++;
-            const cosmica::sepulca_id sid = *argv++;
+            const cosmica::sepulca_id sid(*argv++);
 
             return erase_sepulca(path, sid);
         }
 
+        if (strcmp(cmd, "scan") == 0) {
+            if (argc < 2 || argc > 3) {
+                return usage();
+            }
+
+            const std::filesystem::path path = *argv++;
+            // Unlike std::stoull(), this rejects negative limits instead
+            // of wrapping them around.
+            const std::string_view arg = *argv++;
+            size_t limit;
+            const auto [end, ec] = std::from_chars(
+                arg.data(), arg.data() + arg.size(), limit);
+            if (ec != std::errc() || end != arg.data() + arg.size()) {
+                throw std::runtime_error("Invalid limit '" +
+                    std::string(arg) + "'");
+            }
+            std::optional<cosmica::sepulca_id> start_after;
+            if (argc == 3) {
+                start_after = cosmica::sepulca_id(*argv++);
+            }
+
+            return scan_storage(path, limit, start_after);
+        }
+
         if (strcmp(cmd, "print") == 0) {
             if (argc != 2) {
                 return usage();
             }
 
             const std::filesystem::path path = *argv++;
-            const cosmica::sepulca_id sid = *argv++;
+            const cosmica::sepulca_id sid(*argv++);
 
             return print_sepulca(path, sid);
         }
@@ -209,11 +598,82 @@ int main(int argc, char *argv[])
             }
 
             const std::filesystem::path path = *argv++;
-            const cosmica::sepulca_id sid = *argv++;
+            const cosmica::sepulca_id sid(*argv++);
 
             return check_sepulca(path, sid);
         }
 
+        if (strcmp(cmd, "index") == 0) {
+            if (argc != 2) {
+                return usage();
+            }
+
+            const std::filesystem::path path = *argv++;
+            const std::string name = *argv++;
+
+            return index_attribute(path, name);
+        }
+
+        if (strcmp(cmd, "find") == 0) {
+            if (argc != 3) {
+                return usage();
+            }
+
+            const std::filesystem::path path = *argv++;
+            const std::string name = *argv++;
+            const std::string value = *argv++;
+
+            return find_sepulcas(path, name, value);
+        }
+
+        if (strcmp(cmd, "shard") == 0) {
+            if (argc != 1) {
+                return usage();
+            }
+            return shard_storage(argv[0]);
+        }
+
+        if (strcmp(cmd, "migrate") == 0) {
+            if (argc < 1 || argc > 2) {
+                return usage();
+            }
+            if (argc == 1 || strcmp(argv[1], "v2") == 0) {
+                return migrate_storage(argv[0], cosmica::cell_format::v2);
+            }
+            if (strcmp(argv[1], "v1") == 0) {
+                return migrate_storage(argv[0], cosmica::cell_format::v1);
+            }
+            return usage();
+        }
+
+        if (strcmp(cmd, "stats") == 0) {
+            if (argc != 1) {
+                return usage();
+            }
+            return print_stats(argv[0]);
+        }
+
+        if (strcmp(cmd, "import") == 0) {
+            if (argc != 1) {
+                return usage();
+            }
+            return import_sepulcas(argv[0]);
+        }
+
+        if (strcmp(cmd, "export") == 0) {
+            if (argc != 1) {
+                return usage();
+            }
+            return export_sepulcas(argv[0]);
+        }
+
+        if (strcmp(cmd, "serve") == 0) {
+            if (argc != 2) {
+                return usage();
+            }
+            return serve_storage(argv[0], argv[1]);
+        }
+
         return usage();
     } catch (const std::exception &err) {
         std::cerr << "Error: " << err.what() << std::endl;
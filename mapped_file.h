@@ -0,0 +1,131 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <cstring>
+#include <filesystem>
+#include <string_view>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cosmica
+{
+
+/**
+ * Read-only memory mapping of a whole file.
+ */
+class mapped_file
+{
+public:
+    mapped_file() = default;
+
+    /**
+     * Maps the given file.
+     * A missing file results in a closed object; other errors throw.
+     */
+    explicit mapped_file(const std::filesystem::path &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            if (errno == ENOENT) {
+                return;
+            }
+            throw std::runtime_error("Failed to open file '" +
+                path.string() + "': " + strerror(errno));
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            auto err = errno;
+            close(fd);
+            throw std::runtime_error("Failed to stat file '" +
+                path.string() + "': " + strerror(err));
+        }
+
+        m_open = true;
+        m_size = st.st_size;
+        if (m_size > 0) {
+            m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m_data == MAP_FAILED) {
+                auto err = errno;
+                close(fd);
+                m_data = nullptr;
+                throw std::runtime_error("Failed to map file '" +
+                    path.string() + "': " + strerror(err));
+            }
+        }
+        close(fd);
+    }
+
+    mapped_file(mapped_file &&other) noexcept :
+        m_data(std::exchange(other.m_data, nullptr)),
+        m_size(std::exchange(other.m_size, 0)),
+        m_open(std::exchange(other.m_open, false))
+    {
+    }
+
+    mapped_file &operator=(mapped_file &&other) noexcept
+    {
+        if (this != &other) {
+            unmap();
+            m_data = std::exchange(other.m_data, nullptr);
+            m_size = std::exchange(other.m_size, 0);
+            m_open = std::exchange(other.m_open, false);
+        }
+        return *this;
+    }
+
+    ~mapped_file()
+    {
+        unmap();
+    }
+
+    /**
+     * Checks if the file has been found and mapped.
+     */
+    explicit operator bool() const noexcept {
+        return m_open;
+    }
+
+    /**
+     * Returns file contents.
+     */
+    std::string_view data() const noexcept {
+        return {static_cast<const char *>(m_data), m_size};
+    }
+
+private:
+    void unmap() noexcept
+    {
+        if (m_data) {
+            munmap(m_data, m_size);
+        }
+    }
+
+    void *m_data = nullptr;
+    size_t m_size = 0;
+    bool m_open = false;
+};
+
+}
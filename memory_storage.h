@@ -0,0 +1,544 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "sepulca.h"
+#include "ndjson.h"
+#include "file_sync.h"
+#include <array>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace cosmica
+{
+
+/**
+ * Memory storage options.
+ */
+struct memory_storage_options
+{
+    /**
+     * File the storage is loaded from when opened, if it exists, and saved
+     * to by save() and when closed. Empty means the storage is not saved.
+     */
+    std::filesystem::path snapshot;
+};
+
+/**
+ * Storage keeping sepulcas in the process memory.
+ *
+ * Sepulcas are held in a hash map split into shards with their own locks,
+ * so that operations on sepulcas of different shards do not contend.
+ * The storage is private to the process; it may be saved to a snapshot
+ * file in the NDJSON format of ndjson.h.
+ */
+class memory_storage : public storage
+{
+public:
+    /**
+     * Opens a memory storage, loading the snapshot if it exists.
+     */
+    explicit memory_storage(memory_storage_options opts = {}) :
+        m_opts(std::move(opts))
+    {
+        if (!m_opts.snapshot.empty()) {
+            do_load_snapshot();
+        }
+    }
+
+    /**
+     * Saves the snapshot, if any. Failures are reported to the standard
+     * error, as they cannot be thrown.
+     */
+    virtual ~memory_storage() override
+    {
+        if (m_opts.snapshot.empty()) {
+            return;
+        }
+
+        try {
+            save();
+        } catch (const std::exception &err) {
+            std::cerr << "Memory storage: " << err.what() << std::endl;
+        }
+    }
+
+    virtual sepulca_ptr create(attributes attrs = {}) override
+    {
+        scoped_timer timer(timer_metric::create);
+        sepulca_id_generator gen;
+        for (;;) {
+            auto sid = gen.new_id();
+            auto &sh = get_shard(sid);
+
+            std::lock_guard guard(sh.mutex);
+            if (sh.cells.try_emplace(sid, cell{attrs, 1}).second) {
+                return make_sepulca(*this, sid, std::move(attrs), 1);
+            }
+        }
+    }
+
+    virtual sepulca_ptr get(const sepulca_id &sid) const override
+    {
+        scoped_timer timer(timer_metric::get);
+        const auto &sh = get_shard(sid);
+
+        std::shared_lock guard(sh.mutex);
+        auto i = sh.cells.find(sid);
+        if (i == sh.cells.end()) {
+            throw std::runtime_error("Sepulca '" + sid.to_string() +
+                "' not found");
+        }
+        return make_sepulca(*this, sid, i->second.attrs, i->second.version);
+    }
+
+    virtual bool exists(const sepulca_id &sid) const override
+    {
+        scoped_timer timer(timer_metric::exists);
+        const auto &sh = get_shard(sid);
+
+        std::shared_lock guard(sh.mutex);
+        return sh.cells.contains(sid);
+    }
+
+    /**
+     * Shards are copied one at a time, so the callback is invoked without
+     * holding locks and may use the storage.
+     */
+    virtual void enumerate(std::function<bool(sepulca_ptr)> cb) const override
+    {
+        std::vector<std::pair<sepulca_id, cell>> cells;
+        for (const auto &sh : m_shards) {
+            do_copy_shard(sh, cells);
+            for (auto &[sid, c] : cells) {
+                if (!cb(make_sepulca(*this, sid, std::move(c.attrs),
+                                     c.version))) {
+                    return;
+                }
+            }
+        }
+    }
+
+    virtual void enumerate_ids(
+        std::function<bool(const sepulca_id &)> cb) const override
+    {
+        std::vector<sepulca_id> ids;
+        for (const auto &sh : m_shards) {
+            ids.clear();
+            {
+                std::shared_lock guard(sh.mutex);
+                ids.reserve(sh.cells.size());
+                for (const auto &[sid, c] : sh.cells) {
+                    ids.push_back(sid);
+                }
+            }
+
+            for (const auto &sid : ids) {
+                if (!cb(sid)) {
+                    return;
+                }
+            }
+        }
+    }
+
+    /**
+     * Shards are unordered, so every batch is selected from all
+     * identifiers, holding one shard lock at a time.
+     */
+    virtual std::vector<sepulca_id> scan_ids(
+        std::optional<sepulca_id> start_after, size_t limit) const override
+    {
+        scan_window window(start_after, limit);
+        for (const auto &sh : m_shards) {
+            std::shared_lock guard(sh.mutex);
+            for (const auto &[sid, c] : sh.cells) {
+                window.add(sid);
+            }
+        }
+        return window.take();
+    }
+
+    /**
+     * The cell is copied, so the callback is invoked without holding
+     * locks and may use the storage.
+     */
+    virtual void visit(const sepulca_id &sid,
+                       std::function<void(const sepulca_view &)> cb)
+        const override
+    {
+        const auto &sh = get_shard(sid);
+
+        std::optional<cell> c;
+        {
+            std::shared_lock guard(sh.mutex);
+            if (auto i = sh.cells.find(sid); i != sh.cells.end()) {
+                c = i->second;
+            }
+        }
+        if (!c) {
+            throw std::runtime_error("Sepulca '" + sid.to_string() +
+                "' not found");
+        }
+
+        sepulca_view view;
+        make_cell_view(sid, *c, view);
+        cb(view);
+    }
+
+    virtual void enumerate_views(
+        std::function<bool(const sepulca_view &)> cb) const override
+    {
+        std::vector<std::pair<sepulca_id, cell>> cells;
+        sepulca_view view;
+        for (const auto &sh : m_shards) {
+            do_copy_shard(sh, cells);
+            for (const auto &[sid, c] : cells) {
+                make_cell_view(sid, c, view);
+                if (!cb(view)) {
+                    return;
+                }
+            }
+        }
+    }
+
+    /**
+     * Applies the batch under the locks of all shards, after checking that
+     * all of its operations succeed.
+     */
+    virtual std::vector<sepulca_ptr> apply(const write_batch &batch) override
+    {
+        scoped_timer timer(timer_metric::apply);
+        const auto guards = do_lock_all<std::unique_lock>();
+
+        // Sepulcas touched by the batch so far, null if erased, and
+        // the versions their new versions must exceed.
+        std::unordered_map<sepulca_id, const attributes *> touched;
+        std::unordered_map<sepulca_id, uint64_t> floors;
+        auto exists = [&](const sepulca_id &sid) {
+            auto i = touched.find(sid);
+            return i != touched.end() ? i->second != nullptr :
+                get_shard(sid).cells.contains(sid);
+        };
+        auto get_floor = [&](const sepulca_id &sid) {
+            auto i = floors.find(sid);
+            return i != floors.end() ? i->second : 0;
+        };
+
+        std::vector<std::pair<sepulca_id, const attributes *>> created;
+        sepulca_id_generator gen;
+        for (const auto &op : batch.get_ops()) {
+            switch (op.type) {
+            case write_batch::op_type::create: {
+                sepulca_id sid;
+                do {
+                    sid = gen.new_id();
+                } while (exists(sid));
+
+                touched[sid] = &op.attrs;
+                created.emplace_back(sid, &op.attrs);
+                break;
+            }
+            case write_batch::op_type::put: {
+                touched[op.sid] = &op.attrs;
+                auto &floor = floors[op.sid];
+                floor = std::max(floor, op.version);
+                break;
+            }
+            case write_batch::op_type::erase:
+                if (!exists(op.sid)) {
+                    throw std::runtime_error("Sepulca '" +
+                        op.sid.to_string() + "' has been already destroyed");
+                }
+                touched[op.sid] = nullptr;
+                break;
+            }
+        }
+
+        for (const auto &[sid, attrs] : touched) {
+            auto &cells = get_shard(sid).cells;
+            if (!attrs) {
+                cells.erase(sid);
+            } else if (auto i = cells.find(sid); i != cells.end()) {
+                i->second.attrs = *attrs;
+                i->second.version = std::max(i->second.version,
+                                             get_floor(sid)) + 1;
+            } else {
+                cells.emplace(sid, cell{*attrs, get_floor(sid) + 1});
+            }
+        }
+
+        finish_commits(batch, [&](const sepulca_id &sid) {
+            const auto &cells = get_shard(sid).cells;
+            auto i = cells.find(sid);
+            return i != cells.end() ? std::optional(i->second.version)
+                                    : std::nullopt;
+        });
+
+        std::vector<sepulca_ptr> res;
+        res.reserve(created.size());
+        for (const auto &[sid, attrs] : created) {
+            res.push_back(make_sepulca(*this, sid, *attrs, 1));
+        }
+        return res;
+    }
+
+    /**
+     * Writes all sepulcas to the snapshot file, replacing it atomically
+     * once the new contents are on disk.
+     *
+     * The snapshot is consistent: writers wait for all shards to be saved.
+     */
+    void save() const
+    {
+        if (m_opts.snapshot.empty()) {
+            throw std::runtime_error("Memory storage has no snapshot file");
+        }
+
+        auto tmp = m_opts.snapshot;
+        tmp += ".tmp";
+        {
+            std::ofstream ofs(tmp, std::ofstream::trunc);
+
+            const auto guards = do_lock_all<std::shared_lock>();
+            std::string block;
+            sepulca_view view;
+            for (const auto &sh : m_shards) {
+                for (const auto &[sid, c] : sh.cells) {
+                    make_cell_view(sid, c, view);
+                    write_ndjson(view, block);
+                    if (block.size() >= snapshot_block_size) {
+                        ofs.write(block.data(), block.size());
+                        block.clear();
+                    }
+                }
+            }
+            ofs.write(block.data(), block.size());
+
+            ofs.close();
+            if (!ofs) {
+                throw std::runtime_error("Failed to write snapshot file '" +
+                    tmp.string() + "'");
+            }
+        }
+
+        sync_file(tmp);
+        std::filesystem::rename(tmp, m_opts.snapshot);
+    }
+
+protected:
+    virtual void erase(sepulca &s) override
+    {
+        scoped_timer timer(timer_metric::erase);
+        auto &sh = get_shard(s.get_id());
+
+        std::lock_guard guard(sh.mutex);
+        if (sh.cells.erase(s.get_id()) == 0) {
+            throw std::runtime_error("Sepulca '" + s.get_id().to_string() +
+                "' has been already destroyed");
+        }
+    }
+
+    /**
+     * Merges changed attributes into the stored sepulca, as file storage
+     * does, handing the merged attributes back to the committed sepulca,
+     * or stores the whole sepulca.
+     */
+    virtual std::optional<uint64_t> commit(
+        sepulca &s, std::optional<uint64_t> expected) override
+    {
+        scoped_timer timer(timer_metric::commit);
+        auto &sh = get_shard(s.get_id());
+
+        std::lock_guard guard(sh.mutex);
+        auto i = sh.cells.find(s.get_id());
+        const uint64_t stored = i != sh.cells.end() ? i->second.version : 0;
+        if (expected && *expected != stored) {
+            return {};
+        }
+
+        const auto version = std::max(stored, s.get_version()) + 1;
+        const auto *changed = s.get_changed_attrs();
+        if (!changed || i == sh.cells.end()) {
+            sh.cells.insert_or_assign(s.get_id(),
+                                      cell{s.get_attrs(), version});
+            return version;
+        }
+
+        for (const auto name : *changed) {
+            if (auto j = s.get_attrs().find(name); j != s.get_attrs().end()) {
+                i->second.attrs.insert_or_assign(name, j->second);
+            } else {
+                i->second.attrs.erase(name);
+            }
+        }
+        i->second.version = version;
+        refresh_attrs(s, i->second.attrs);
+        return version;
+    }
+
+    virtual bool load_many(std::span<const sepulca_id> ids,
+                           std::vector<sepulca_ptr> &res) const override
+    {
+        res.clear();
+        res.reserve(ids.size());
+        for (const auto &sid : ids) {
+            const auto &sh = get_shard(sid);
+
+            std::shared_lock guard(sh.mutex);
+            auto i = sh.cells.find(sid);
+            res.push_back(i != sh.cells.end() ?
+                make_sepulca(*this, sid, i->second.attrs, i->second.version) :
+                nullptr);
+        }
+        return true;
+    }
+
+private:
+    struct cell
+    {
+        attributes attrs;
+        uint64_t version;
+    };
+
+    struct shard
+    {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<sepulca_id, cell> cells;
+    };
+
+    // Number of shards of the map.
+    static constexpr size_t shard_count = 64;
+
+    // Snapshots are written in blocks of about this size.
+    static constexpr size_t snapshot_block_size = 1 << 20;
+
+    shard &get_shard(const sepulca_id &sid)
+    {
+        return m_shards[get_shard_index(sid)];
+    }
+
+    const shard &get_shard(const sepulca_id &sid) const
+    {
+        return m_shards[get_shard_index(sid)];
+    }
+
+    /**
+     * Shards are chosen by the high bits of the hash, as the low ones
+     * choose buckets within the shard.
+     */
+    static size_t get_shard_index(const sepulca_id &sid) {
+        return (std::hash<sepulca_id>{}(sid) >> 32) % shard_count;
+    }
+
+    /**
+     * Locks all shards in the order of their indexes.
+     */
+    template<template<typename> typename Lock>
+    std::vector<Lock<std::shared_mutex>> do_lock_all() const
+    {
+        std::vector<Lock<std::shared_mutex>> guards;
+        guards.reserve(shard_count);
+        for (const auto &sh : m_shards) {
+            guards.emplace_back(sh.mutex);
+        }
+        return guards;
+    }
+
+    static void do_copy_shard(const shard &sh,
+                              std::vector<std::pair<sepulca_id, cell>> &cells)
+    {
+        cells.clear();
+
+        std::shared_lock guard(sh.mutex);
+        cells.reserve(sh.cells.size());
+        for (const auto &[sid, c] : sh.cells) {
+            cells.emplace_back(sid, c);
+        }
+    }
+
+    static void make_cell_view(const sepulca_id &sid, const cell &c,
+                               sepulca_view &view)
+    {
+        view.reset(sid);
+        view.set_version(c.version);
+        for (const auto &[k, v] : c.attrs) {
+            view.add_attr(k, v);
+        }
+        view.finish();
+    }
+
+    void do_load_snapshot()
+    {
+        std::ifstream ifs(m_opts.snapshot);
+        if (!ifs) {
+            if (std::filesystem::exists(m_opts.snapshot)) {
+                throw std::runtime_error("Failed to open snapshot file '" +
+                    m_opts.snapshot.string() + "'");
+            }
+            return;
+        }
+
+        ndjson_parser parser;
+        sepulca_id_generator gen;
+        sepulca_id sid;
+        attributes attrs;
+        uint64_t version;
+        size_t n = 0;
+        for (std::string line; std::getline(ifs, line);) {
+            ++n;
+            if (line.empty()) {
+                continue;
+            }
+
+            try {
+                parser.parse(line, sid, attrs, &version);
+            } catch (const std::exception &err) {
+                throw std::runtime_error("Invalid snapshot file '" +
+                    m_opts.snapshot.string() + "', line " +
+                    std::to_string(n) + ": " + err.what());
+            }
+
+            while (!sid) {
+                sid = gen.new_id();
+                if (get_shard(sid).cells.contains(sid)) {
+                    sid = {};
+                }
+            }
+            get_shard(sid).cells.insert_or_assign(
+                sid, cell{std::move(attrs), version});
+        }
+
+        if (ifs.bad()) {
+            throw std::runtime_error("Failed to read snapshot file '" +
+                m_opts.snapshot.string() + "'");
+        }
+    }
+
+    const memory_storage_options m_opts;
+    std::array<shard, shard_count> m_shards;
+};
+
+}
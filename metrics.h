@@ -0,0 +1,584 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+namespace cosmica
+{
+
+/**
+ * Measured durations.
+ */
+enum class timer_metric : size_t
+{
+    // Storage operations.
+    create,
+    get,
+    exists,
+    apply,
+    commit,
+    erase,
+    get_many,
+
+    // Waiting for a storage lock or a stripe, including the acquisition.
+    lock_wait,
+    stripe_wait,
+
+    // Encoding sepulcas for storing (with buffered writes, for file
+    // storage) and decoding loaded ones.
+    serialize,
+    deserialize,
+
+    count
+};
+
+inline constexpr const char *timer_metric_names[] = {
+    "create",
+    "get",
+    "exists",
+    "apply",
+    "commit",
+    "erase",
+    "get_many",
+    "lock_wait",
+    "stripe_wait",
+    "serialize",
+    "deserialize",
+};
+
+/**
+ * Counted quantities.
+ */
+enum class counter_metric : size_t
+{
+    bytes_read,
+    bytes_written,
+
+    count
+};
+
+inline constexpr const char *counter_metric_names[] = {
+    "bytes_read",
+    "bytes_written",
+};
+
+inline constexpr size_t timer_metrics_count =
+    static_cast<size_t>(timer_metric::count);
+inline constexpr size_t counter_metrics_count =
+    static_cast<size_t>(counter_metric::count);
+
+static_assert(std::size(timer_metric_names) == timer_metrics_count);
+static_assert(std::size(counter_metric_names) == counter_metrics_count);
+
+/**
+ * Histogram of durations in nanoseconds.
+ *
+ * Buckets are log-linear: every power of two is split into four buckets,
+ * so percentiles are accurate to 25%.
+ */
+struct duration_histogram
+{
+    static constexpr size_t bucket_count = 4 * 63;
+
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::array<uint64_t, bucket_count> buckets = {};
+
+    static size_t bucket(uint64_t v)
+    {
+        if (v < 4) {
+            return static_cast<size_t>(v);
+        }
+        const size_t e = std::bit_width(v) - 1;
+        return 4 * (e - 1) + ((v >> (e - 2)) & 3);
+    }
+
+    /**
+     * Returns the lowest value of the bucket.
+     */
+    static uint64_t value(size_t b)
+    {
+        if (b < 4) {
+            return b;
+        }
+        return (4 + b % 4) << (b / 4 - 1);
+    }
+
+    void add(uint64_t v)
+    {
+        ++count;
+        sum += v;
+        max = std::max(max, v);
+        ++buckets[bucket(v)];
+    }
+
+    void merge(const duration_histogram &other)
+    {
+        count += other.count;
+        sum += other.sum;
+        max = std::max(max, other.max);
+        for (size_t b = 0; b < bucket_count; ++b) {
+            buckets[b] += other.buckets[b];
+        }
+    }
+
+    uint64_t mean() const {
+        return count ? sum / count : 0;
+    }
+
+    /**
+     * Returns the lowest value of the bucket of the given percentile,
+     * which is a fraction in [0, 1].
+     */
+    uint64_t percentile(double p) const
+    {
+        const auto rank = static_cast<uint64_t>(p * static_cast<double>(count));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < bucket_count; ++b) {
+            seen += buckets[b];
+            if (seen > rank) {
+                return std::min(value(b), max);
+            }
+        }
+        return max;
+    }
+};
+
+/**
+ * Metrics aggregated from threads (or processes).
+ */
+struct metrics_snapshot
+{
+    std::array<uint64_t, counter_metrics_count> counters = {};
+    std::array<duration_histogram, timer_metrics_count> timers;
+
+    uint64_t get(counter_metric c) const {
+        return counters[static_cast<size_t>(c)];
+    }
+
+    const duration_histogram &get(timer_metric t) const {
+        return timers[static_cast<size_t>(t)];
+    }
+
+    void merge(const metrics_snapshot &other)
+    {
+        for (size_t i = 0; i < counter_metrics_count; ++i) {
+            counters[i] += other.counters[i];
+        }
+        for (size_t i = 0; i < timer_metrics_count; ++i) {
+            timers[i].merge(other.timers[i]);
+        }
+    }
+
+    /**
+     * Writes the metrics in the text form read by read().
+     * Every line is a counter ("<name> <value>") or a timer
+     * ("<name> <count> <sum> <max> <bucket>:<count>...").
+     */
+    void write(std::ostream &os) const
+    {
+        for (size_t i = 0; i < counter_metrics_count; ++i) {
+            os << counter_metric_names[i] << " " << counters[i] << "\n";
+        }
+        for (size_t i = 0; i < timer_metrics_count; ++i) {
+            const auto &h = timers[i];
+            os << timer_metric_names[i] << " " << h.count << " " << h.sum
+                << " " << h.max;
+            for (size_t b = 0; b < duration_histogram::bucket_count; ++b) {
+                if (h.buckets[b]) {
+                    os << " " << b << ":" << h.buckets[b];
+                }
+            }
+            os << "\n";
+        }
+    }
+
+    /**
+     * Reads metrics written by write(), ignoring unknown lines.
+     */
+    static metrics_snapshot read(std::istream &is)
+    {
+        metrics_snapshot res;
+        for (std::string line; std::getline(is, line);) {
+            std::istringstream ls(line);
+            std::string name;
+            ls >> name;
+
+            for (size_t i = 0; i < counter_metrics_count; ++i) {
+                if (name == counter_metric_names[i]) {
+                    ls >> res.counters[i];
+                }
+            }
+            for (size_t i = 0; i < timer_metrics_count; ++i) {
+                if (name != timer_metric_names[i]) {
+                    continue;
+                }
+                auto &h = res.timers[i];
+                ls >> h.count >> h.sum >> h.max;
+
+                size_t b;
+                char sep;
+                uint64_t n;
+                while (ls >> b >> sep >> n) {
+                    if (b < duration_histogram::bucket_count) {
+                        h.buckets[b] = n;
+                    }
+                }
+            }
+        }
+        return res;
+    }
+
+    /**
+     * Prints the metrics as a table.
+     */
+    void print(std::ostream &os) const
+    {
+        os << std::left << std::setw(14) << "timer" << std::right
+            << std::setw(12) << "count" << std::setw(12) << "mean ns"
+            << std::setw(12) << "p50 ns" << std::setw(12) << "p99 ns"
+            << std::setw(14) << "max ns" << "\n";
+        for (size_t i = 0; i < timer_metrics_count; ++i) {
+            const auto &h = timers[i];
+            os << std::left << std::setw(14) << timer_metric_names[i]
+                << std::right << std::setw(12) << h.count
+                << std::setw(12) << h.mean()
+                << std::setw(12) << h.percentile(0.5)
+                << std::setw(12) << h.percentile(0.99)
+                << std::setw(14) << h.max << "\n";
+        }
+        for (size_t i = 0; i < counter_metrics_count; ++i) {
+            os << std::left << std::setw(14) << counter_metric_names[i]
+                << std::right << std::setw(12) << counters[i] << "\n";
+        }
+    }
+};
+
+/**
+ * Process-wide metrics.
+ *
+ * Every thread updates metrics of its own, which are only summed when read,
+ * so that measuring does not make threads contend. Metrics of finished
+ * threads are kept.
+ *
+ * Measuring is enabled unless the SEPULCA_METRICS environment variable
+ * is "0". If SEPULCA_METRICS_DIR is set, the metrics are dumped to
+ * "<pid>.txt" in that directory every SEPULCA_METRICS_INTERVAL seconds
+ * (10 by default) and at exit, see metrics_snapshot::write().
+ */
+class metrics
+{
+public:
+    static metrics &instance()
+    {
+        static metrics m;
+        return m;
+    }
+
+    // Disable copy and move of metrics.
+    metrics(const metrics &) = delete;
+    metrics(metrics &&) = delete;
+
+    ~metrics()
+    {
+        if (m_dumper.joinable()) {
+            {
+                std::lock_guard guard(m_dump_mutex);
+                m_stop = true;
+            }
+            m_dump_cv.notify_all();
+            m_dumper.join();
+        }
+    }
+
+    static bool is_enabled() noexcept {
+        return enabled().load(std::memory_order_relaxed);
+    }
+
+    static void set_enabled(bool on) noexcept {
+        enabled().store(on, std::memory_order_relaxed);
+    }
+
+    static void add(counter_metric c, uint64_t n)
+    {
+        if (is_enabled()) {
+            bump(local().counters[static_cast<size_t>(c)], n);
+        }
+    }
+
+    static void record(timer_metric t, uint64_t ns)
+    {
+        if (!is_enabled()) {
+            return;
+        }
+
+        auto &h = local().timers[static_cast<size_t>(t)];
+        bump(h.count, 1);
+        bump(h.sum, ns);
+        if (ns > h.max.load(std::memory_order_relaxed)) {
+            h.max.store(ns, std::memory_order_relaxed);
+        }
+        bump(h.buckets[duration_histogram::bucket(ns)], 1);
+    }
+
+    /**
+     * Returns the metrics of all threads so far.
+     */
+    metrics_snapshot snapshot() const
+    {
+        std::lock_guard guard(m_mutex);
+
+        auto res = m_retired;
+        for (const auto *block : m_blocks) {
+            res.merge(block->load());
+        }
+        return res;
+    }
+
+    /**
+     * Writes the metrics to SEPULCA_METRICS_DIR, if set; e.g. before
+     * the process exits without running destructors.
+     */
+    void dump() const
+    {
+        if (!m_dump_dir.empty()) {
+            dump(m_dump_dir);
+        }
+    }
+
+    /**
+     * Writes the metrics to "<pid>.txt" in the directory, replacing
+     * the file atomically.
+     */
+    void dump(const std::filesystem::path &dir) const
+    {
+        std::filesystem::create_directories(dir);
+
+        const auto p = dir / (std::to_string(getpid()) + ".txt");
+        auto tmp = p;
+        tmp += ".tmp";
+        {
+            std::ofstream ofs(tmp, std::ofstream::trunc);
+            snapshot().write(ofs);
+            ofs.close();
+            if (!ofs) {
+                throw std::runtime_error("Failed to write metrics file '" +
+                    tmp.string() + "'");
+            }
+        }
+        std::filesystem::rename(tmp, p);
+    }
+
+private:
+    /**
+     * Metrics of a thread. Only the owner thread updates them, so updates
+     * need no atomic read-modify-write; readers may see them slightly
+     * out of date.
+     */
+    struct thread_block
+    {
+        struct timer
+        {
+            std::atomic<uint64_t> count{0};
+            std::atomic<uint64_t> sum{0};
+            std::atomic<uint64_t> max{0};
+            std::array<std::atomic<uint64_t>,
+                       duration_histogram::bucket_count> buckets{};
+        };
+
+        std::array<std::atomic<uint64_t>, counter_metrics_count> counters{};
+        std::array<timer, timer_metrics_count> timers;
+
+        metrics_snapshot load() const
+        {
+            constexpr auto relaxed = std::memory_order_relaxed;
+
+            metrics_snapshot res;
+            for (size_t i = 0; i < counter_metrics_count; ++i) {
+                res.counters[i] = counters[i].load(relaxed);
+            }
+            for (size_t i = 0; i < timer_metrics_count; ++i) {
+                auto &h = res.timers[i];
+                h.count = timers[i].count.load(relaxed);
+                h.sum = timers[i].sum.load(relaxed);
+                h.max = timers[i].max.load(relaxed);
+                for (size_t b = 0; b < duration_histogram::bucket_count; ++b) {
+                    h.buckets[b] = timers[i].buckets[b].load(relaxed);
+                }
+            }
+            return res;
+        }
+    };
+
+    /**
+     * Registers the block of the thread on first use and retires it
+     * when the thread exits.
+     */
+    struct thread_slot
+    {
+        thread_block *block = nullptr;
+
+        ~thread_slot()
+        {
+            if (block) {
+                instance().retire(block);
+            }
+        }
+    };
+
+    metrics()
+    {
+        if (const char *dir = std::getenv("SEPULCA_METRICS_DIR"); dir && *dir) {
+            m_dump_dir = dir;
+
+            std::chrono::seconds interval(10);
+            if (const char *s = std::getenv("SEPULCA_METRICS_INTERVAL")) {
+                interval = std::chrono::seconds(
+                    std::max(1L, std::strtol(s, nullptr, 10)));
+            }
+            m_dumper = std::thread([this, interval] {
+                dump_loop(interval);
+            });
+        }
+    }
+
+    static std::atomic<bool> &enabled() noexcept
+    {
+        static std::atomic<bool> on = [] {
+            const char *s = std::getenv("SEPULCA_METRICS");
+            return !s || std::string_view(s) != "0";
+        }();
+        return on;
+    }
+
+    static void bump(std::atomic<uint64_t> &v, uint64_t n) noexcept {
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static thread_block &local()
+    {
+        thread_local thread_slot slot;
+        if (!slot.block) {
+            slot.block = instance().attach();
+        }
+        return *slot.block;
+    }
+
+    thread_block *attach()
+    {
+        auto block = std::make_unique<thread_block>();
+
+        std::lock_guard guard(m_mutex);
+        m_blocks.push_back(block.get());
+        return block.release();
+    }
+
+    void retire(thread_block *block)
+    {
+        std::unique_ptr<thread_block> owned(block);
+
+        std::lock_guard guard(m_mutex);
+        m_retired.merge(block->load());
+        std::erase(m_blocks, block);
+    }
+
+    void dump_loop(std::chrono::seconds interval)
+    {
+        std::unique_lock guard(m_dump_mutex);
+        for (;;) {
+            const bool stop = m_dump_cv.wait_for(guard, interval,
+                                                 [this] { return m_stop; });
+            try {
+                dump();
+            } catch (const std::exception &err) {
+                std::cerr << "Failed to dump metrics: " << err.what()
+                    << std::endl;
+            }
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+    mutable std::mutex m_mutex;
+    std::vector<thread_block *> m_blocks;
+    metrics_snapshot m_retired;
+
+    std::filesystem::path m_dump_dir;
+    std::mutex m_dump_mutex;
+    std::condition_variable m_dump_cv;
+    bool m_stop = false;
+    std::thread m_dumper;
+};
+
+/**
+ * Records the duration of its scope.
+ */
+class scoped_timer
+{
+public:
+    explicit scoped_timer(timer_metric t) noexcept :
+        m_timer(t),
+        m_enabled(metrics::is_enabled())
+    {
+        if (m_enabled) {
+            m_begin = std::chrono::steady_clock::now();
+        }
+    }
+
+    // Disable copy and move of timers.
+    scoped_timer(const scoped_timer &) = delete;
+    scoped_timer(scoped_timer &&) = delete;
+
+    ~scoped_timer()
+    {
+        if (m_enabled) {
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - m_begin).count();
+            metrics::record(m_timer, static_cast<uint64_t>(ns));
+        }
+    }
+
+private:
+    const timer_metric m_timer;
+    const bool m_enabled;
+    std::chrono::steady_clock::time_point m_begin;
+};
+
+}
@@ -0,0 +1,349 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "attributes.h"
+#include "sepulca_id.h"
+#include <charconv>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace cosmica
+{
+
+/**
+ * Sepulcas in newline-delimited JSON: one object per line,
+ *
+ *     {"id":"{0123-4567-89ab-cdef}","attrs":{"name":"value",...}}
+ *
+ * Attribute values are strings. The identifier may be omitted on import,
+ * in which case a new one is assigned. Sepulcas having a version have
+ * a "version" field as well.
+ */
+
+/**
+ * Appends a JSON string literal of the text to `out`.
+ */
+inline void write_json_string(std::string_view text, std::string &out)
+{
+    static constexpr char hex[] = "0123456789abcdef";
+
+    out += '"';
+    for (const char c : text) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+/**
+ * Appends a line of a sepulca or a sepulca view to `out`.
+ */
+template<typename Sepulca>
+void write_ndjson(const Sepulca &s, std::string &out)
+{
+    out += "{\"id\":\"";
+    out += s.get_id().to_string();
+    out += '"';
+    if (s.get_version() != 0) {
+        out += ",\"version\":";
+        out += std::to_string(s.get_version());
+    }
+    out += ",\"attrs\":{";
+
+    bool first = true;
+    for (const auto &[k, v] : s.get_attrs()) {
+        if (!first) {
+            out += ',';
+        }
+        first = false;
+
+        write_json_string(k, out);
+        out += ':';
+        write_json_string(v, out);
+    }
+    out += "}}\n";
+}
+
+/**
+ * Parser of sepulca lines. Throws an exception on malformed lines.
+ */
+class ndjson_parser
+{
+public:
+    /**
+     * Parses a line without the newline. The identifier is left empty
+     * if the line has none, and the version, if requested, zero.
+     */
+    void parse(std::string_view line, sepulca_id &sid, attributes &attrs,
+               uint64_t *version = nullptr)
+    {
+        m_data = line;
+        m_pos = 0;
+        sid = {};
+        attrs.clear();
+        if (version) {
+            *version = 0;
+        }
+
+        bool has_id = false, has_version = false, has_attrs = false;
+        expect('{');
+        if (!consume('}')) {
+            do {
+                const auto key = parse_string();
+                expect(':');
+                if (key == "id" && !has_id) {
+                    const auto text = parse_string();
+                    auto parsed = sepulca_id::parse(text);
+                    if (!parsed) {
+                        throw std::runtime_error("Invalid Sepulca identifier '" +
+                            text + "'");
+                    }
+                    sid = *parsed;
+                    has_id = true;
+                } else if (key == "version" && !has_version) {
+                    const auto v = parse_number();
+                    if (version) {
+                        *version = v;
+                    }
+                    has_version = true;
+                } else if (key == "attrs" && !has_attrs) {
+                    parse_attrs(attrs);
+                    has_attrs = true;
+                } else {
+                    throw std::runtime_error("Unexpected field '" + key + "'");
+                }
+            } while (consume(','));
+            expect('}');
+        }
+
+        skip_space();
+        if (m_pos != m_data.size()) {
+            fail("end of line");
+        }
+    }
+
+private:
+    void parse_attrs(attributes &attrs)
+    {
+        expect('{');
+        if (consume('}')) {
+            return;
+        }
+
+        do {
+            auto name = parse_string();
+            expect(':');
+            if (!attrs.emplace(std::move(name), parse_string()).second) {
+                throw std::runtime_error("Duplicate attribute");
+            }
+        } while (consume(','));
+        expect('}');
+    }
+
+    std::string parse_string()
+    {
+        expect('"');
+
+        std::string res;
+        for (;;) {
+            const auto end = m_data.find_first_of("\"\\", m_pos);
+            if (end == std::string_view::npos) {
+                fail("'\"'");
+            }
+            res.append(m_data.substr(m_pos, end - m_pos));
+            m_pos = end + 1;
+            if (m_data[end] == '"') {
+                return res;
+            }
+
+            if (m_pos == m_data.size()) {
+                fail("escape sequence");
+            }
+            switch (const char c = m_data[m_pos++]) {
+            case '"':
+            case '\\':
+            case '/':
+                res += c;
+                break;
+            case 'b':
+                res += '\b';
+                break;
+            case 'f':
+                res += '\f';
+                break;
+            case 'n':
+                res += '\n';
+                break;
+            case 'r':
+                res += '\r';
+                break;
+            case 't':
+                res += '\t';
+                break;
+            case 'u':
+                append_utf8(parse_code_point(), res);
+                break;
+            default:
+                fail("escape sequence");
+            }
+        }
+    }
+
+    uint64_t parse_number()
+    {
+        skip_space();
+        const auto begin = m_data.data() + m_pos;
+        const auto end = m_data.data() + m_data.size();
+
+        uint64_t res;
+        const auto [p, ec] = std::from_chars(begin, end, res);
+        if (ec != std::errc()) {
+            fail("number");
+        }
+        m_pos += p - begin;
+        return res;
+    }
+
+    uint32_t parse_code_point()
+    {
+        uint32_t cp = parse_hex4();
+        if (cp >= 0xd800 && cp < 0xdc00) {
+            // A high surrogate must be followed by a low one.
+            if (m_data.substr(m_pos, 2) != "\\u") {
+                fail("low surrogate");
+            }
+            m_pos += 2;
+            const uint32_t low = parse_hex4();
+            if (low < 0xdc00 || low >= 0xe000) {
+                fail("low surrogate");
+            }
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        } else if (cp >= 0xdc00 && cp < 0xe000) {
+            fail("high surrogate");
+        }
+        return cp;
+    }
+
+    uint32_t parse_hex4()
+    {
+        if (m_data.size() - m_pos < 4) {
+            fail("hex digits");
+        }
+
+        uint32_t res = 0;
+        for (int i = 0; i < 4; ++i) {
+            const char c = m_data[m_pos++];
+            res <<= 4;
+            if (c >= '0' && c <= '9') {
+                res |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                res |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                res |= c - 'A' + 10;
+            } else {
+                fail("hex digits");
+            }
+        }
+        return res;
+    }
+
+    static void append_utf8(uint32_t cp, std::string &out)
+    {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            out += static_cast<char>(0xc0 | cp >> 6);
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        } else if (cp < 0x10000) {
+            out += static_cast<char>(0xe0 | cp >> 12);
+            out += static_cast<char>(0x80 | (cp >> 6 & 0x3f));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        } else {
+            out += static_cast<char>(0xf0 | cp >> 18);
+            out += static_cast<char>(0x80 | (cp >> 12 & 0x3f));
+            out += static_cast<char>(0x80 | (cp >> 6 & 0x3f));
+            out += static_cast<char>(0x80 | (cp & 0x3f));
+        }
+    }
+
+    void skip_space()
+    {
+        while (m_pos < m_data.size() &&
+               (m_data[m_pos] == ' ' || m_data[m_pos] == '\t' ||
+                m_data[m_pos] == '\r')) {
+            ++m_pos;
+        }
+    }
+
+    bool consume(char c)
+    {
+        skip_space();
+        if (m_pos < m_data.size() && m_data[m_pos] == c) {
+            ++m_pos;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c)
+    {
+        if (!consume(c)) {
+            fail(std::string("'") + c + "'");
+        }
+    }
+
+    [[noreturn]] void fail(const std::string &expected) const
+    {
+        throw std::runtime_error("Expected " + expected + " at column " +
+            std::to_string(m_pos + 1));
+    }
+
+    std::string_view m_data;
+    size_t m_pos = 0;
+};
+
+}
@@ -0,0 +1,535 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "sepulca.h"
+#include "storage_protocol.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace cosmica
+{
+
+/**
+ * Storage served by a storage_server over a Unix domain socket.
+ *
+ * Every operation is a request to the server, which keeps the actual
+ * storage open. Operations on many sepulcas are split into requests
+ * which are pipelined, so that the server processes one while the client
+ * sends the next and reads the replies to previous ones.
+ *
+ * The connection is shared by all threads; requests of different threads
+ * are serialized.
+ */
+class remote_storage : public storage
+{
+public:
+    /**
+     * Connects to the server listening on the given socket.
+     */
+    explicit remote_storage(const std::filesystem::path &socket) :
+        m_socket(socket)
+    {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (socket.native().size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Socket path '" + socket.string() +
+                "' is too long");
+        }
+        strcpy(addr.sun_path, socket.c_str());
+
+        m_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (m_fd == -1 || connect(m_fd, reinterpret_cast<const sockaddr *>(
+                &addr), sizeof(addr)) != 0) {
+            auto err = errno;
+            if (m_fd != -1) {
+                close(m_fd);
+            }
+            throw std::runtime_error("Failed to connect to storage server '" +
+                socket.string() + "': " + strerror(err));
+        }
+    }
+
+    virtual ~remote_storage() override
+    {
+        if (m_fd != -1) {
+            close(m_fd);
+        }
+    }
+
+    virtual sepulca_ptr create(attributes attrs = {}) override
+    {
+        scoped_timer timer(timer_metric::create);
+        std::lock_guard guard(m_mutex);
+
+        do_request(storage_op::create).put_attrs(attrs);
+        auto reply = do_call();
+        return do_get_sepulca(reply);
+    }
+
+    virtual sepulca_ptr get(const sepulca_id &sid) const override
+    {
+        scoped_timer timer(timer_metric::get);
+        std::lock_guard guard(m_mutex);
+
+        do_request(storage_op::get).put_id(sid);
+        auto reply = do_call();
+        return do_get_sepulca(reply);
+    }
+
+    virtual bool exists(const sepulca_id &sid) const override
+    {
+        scoped_timer timer(timer_metric::exists);
+        std::lock_guard guard(m_mutex);
+
+        do_request(storage_op::exists).put_id(sid);
+        return do_call().get_u8();
+    }
+
+    virtual std::vector<sepulca_ptr> get_many(
+        std::span<const sepulca_id> ids) const override
+    {
+        scoped_timer timer(timer_metric::get_many);
+        std::lock_guard guard(m_mutex);
+
+        std::vector<sepulca_ptr> res;
+        res.reserve(ids.size());
+        do_pipeline(storage_op::get_many, ids, [&](frame_reader &reply,
+                                                   size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                res.push_back(reply.get_u8() ? do_get_sepulca(reply) : nullptr);
+            }
+        });
+        return res;
+    }
+
+    virtual std::vector<bool> exists_many(
+        std::span<const sepulca_id> ids) const override
+    {
+        std::lock_guard guard(m_mutex);
+
+        std::vector<bool> res;
+        res.reserve(ids.size());
+        do_pipeline(storage_op::exists_many, ids, [&](frame_reader &reply,
+                                                      size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                res.push_back(reply.get_u8());
+            }
+        });
+        return res;
+    }
+
+    /**
+     * Sepulcas are loaded in batches by scan(), so the callback is
+     * invoked with no request in progress and may use the storage.
+     */
+    virtual void enumerate(std::function<bool(sepulca_ptr)> cb) const override
+    {
+        std::optional<sepulca_id> after;
+        do {
+            auto batch = scan(after, enumerate_batch_size);
+            for (auto &s : batch.sepulcas) {
+                if (!cb(std::move(s))) {
+                    return;
+                }
+            }
+            after = batch.next;
+        } while (after);
+    }
+
+    virtual std::vector<sepulca_id> scan_ids(
+        std::optional<sepulca_id> start_after, size_t limit) const override
+    {
+        if (limit > UINT32_MAX) {
+            throw std::runtime_error("Scan limit " + std::to_string(limit) +
+                " is too large");
+        }
+
+        std::lock_guard guard(m_mutex);
+        auto req = do_request(storage_op::scan_ids);
+        req.put_u8(start_after.has_value());
+        req.put_id(start_after.value_or(sepulca_id()));
+        req.put_u32(static_cast<uint32_t>(limit));
+        auto reply = do_call();
+
+        std::vector<sepulca_id> ids(reply.get_u32());
+        for (auto &sid : ids) {
+            sid = reply.get_id();
+        }
+        return ids;
+    }
+
+    virtual void enumerate_ids(
+        std::function<bool(const sepulca_id &)> cb) const override
+    {
+        for (const auto &sid : do_enumerate_ids()) {
+            if (!cb(sid)) {
+                return;
+            }
+        }
+    }
+
+    virtual std::vector<sepulca_ptr> apply(const write_batch &batch) override
+    {
+        scoped_timer timer(timer_metric::apply);
+        std::lock_guard guard(m_mutex);
+
+        auto req = do_request(storage_op::apply);
+        req.put_u32(static_cast<uint32_t>(batch.size()));
+        for (const auto &op : batch.get_ops()) {
+            req.put_u8(static_cast<uint8_t>(op.type));
+            req.put_id(op.sid);
+            req.put_attrs(op.attrs);
+            req.put_u64(op.version);
+        }
+        auto reply = do_call();
+        auto res = do_get_sepulcas(reply);
+
+        std::unordered_map<sepulca_id, uint64_t> versions;
+        for (const auto &op : batch.get_ops()) {
+            if (op.type == write_batch::op_type::put) {
+                versions[op.sid] = reply.get_u64();
+            }
+        }
+        finish_commits(batch, [&](const sepulca_id &sid) {
+            const auto version = versions.at(sid);
+            return version ? std::optional(version) : std::nullopt;
+        });
+        return res;
+    }
+
+    virtual void create_index(const std::string &name) override
+    {
+        std::lock_guard guard(m_mutex);
+        do_request(storage_op::create_index).put_string(name);
+        do_call();
+    }
+
+    virtual void drop_index(const std::string &name) override
+    {
+        std::lock_guard guard(m_mutex);
+        do_request(storage_op::drop_index).put_string(name);
+        do_call();
+    }
+
+    virtual std::vector<std::string> get_indexes() const override
+    {
+        std::lock_guard guard(m_mutex);
+        do_request(storage_op::get_indexes);
+        auto reply = do_call();
+
+        std::vector<std::string> names(reply.get_u32());
+        for (auto &name : names) {
+            name = reply.get_string();
+        }
+        return names;
+    }
+
+    virtual std::vector<sepulca_ptr> find(
+        const std::string &name, const std::string &value) const override
+    {
+        std::lock_guard guard(m_mutex);
+
+        auto req = do_request(storage_op::find);
+        req.put_string(name);
+        req.put_string(value);
+        auto reply = do_call();
+        return do_get_sepulcas(reply);
+    }
+
+protected:
+    virtual void erase(sepulca &s) override
+    {
+        scoped_timer timer(timer_metric::erase);
+        std::lock_guard guard(m_mutex);
+
+        do_request(storage_op::erase).put_id(s.get_id());
+        do_call();
+    }
+
+    virtual std::optional<uint64_t> commit(
+        sepulca &s, std::optional<uint64_t> expected) override
+    {
+        scoped_timer timer(timer_metric::commit);
+        std::lock_guard guard(m_mutex);
+
+        auto req = do_request(storage_op::commit);
+        req.put_sepulca(s);
+        req.put_u8(expected.has_value());
+        req.put_u64(expected.value_or(0));
+
+        const auto *changed = s.get_changed_attrs();
+        req.put_u8(changed == nullptr);
+        req.put_u32(changed ? static_cast<uint32_t>(changed->size()) : 0);
+        if (changed) {
+            for (const auto &name : *changed) {
+                req.put_string(name);
+            }
+        }
+
+        auto reply = do_call();
+        const bool committed = reply.get_u8();
+        const auto version = reply.get_u64();
+        if (committed && changed) {
+            refresh_attrs(s, reply.get_attrs());
+        }
+        return committed ? std::optional(version) : std::nullopt;
+    }
+
+private:
+    // Identifiers sent in a single get_many or exists_many request.
+    static constexpr size_t request_batch_size = 1024;
+
+    // Requests sent ahead of reading their replies, kept small enough
+    // for the socket buffer, so that sending never waits for the server
+    // which in turn waits for its replies to be read.
+    static constexpr size_t pipeline_depth = 8;
+
+    // Sepulcas loaded at once by enumerate().
+    static constexpr size_t enumerate_batch_size =
+        request_batch_size * pipeline_depth;
+
+    // The connection is read in chunks of this size.
+    static constexpr size_t read_chunk_size = 64 * 1024;
+
+    /**
+     * Starts a request frame in the output buffer. The request is sent
+     * by do_call() or do_flush().
+     */
+    frame_writer do_request(storage_op op) const
+    {
+        if (m_fd == -1) {
+            throw std::runtime_error("Connection to storage server '" +
+                m_socket.string() + "' is broken");
+        }
+        m_requests.push_back(m_out.size());
+        return frame_writer(m_out, ++m_sent, static_cast<uint8_t>(op));
+    }
+
+    /**
+     * Sends the pending request and returns its reply.
+     * Throws the exception the server has reported, if any.
+     */
+    frame_reader do_call() const
+    {
+        do_flush();
+        auto reply = do_receive();
+        do_check(reply);
+        return reply;
+    }
+
+    /**
+     * Sends requests for chunks of `ids` with at most pipeline_depth of
+     * them in flight, and passes the replies in order to the handler
+     * together with the number of identifiers of the chunk.
+     * If any request fails, the rest are still read and the first error
+     * is thrown afterwards.
+     */
+    template<typename Handler>
+    void do_pipeline(storage_op op, std::span<const sepulca_id> ids,
+                     Handler &&handler) const
+    {
+        const auto chunks = (ids.size() + request_batch_size - 1) /
+            request_batch_size;
+        auto get_count = [&](size_t chunk) {
+            return std::min(request_batch_size,
+                            ids.size() - chunk * request_batch_size);
+        };
+
+        std::string error;
+        size_t sent = 0;
+        for (size_t received = 0; received < chunks; ++received) {
+            for (; sent < chunks && sent < received + pipeline_depth; ++sent) {
+                auto req = do_request(op);
+                req.put_u32(static_cast<uint32_t>(get_count(sent)));
+                for (const auto &sid : ids.subspan(
+                        sent * request_batch_size, get_count(sent))) {
+                    req.put_id(sid);
+                }
+            }
+            do_flush();
+
+            auto reply = do_receive();
+            if (!error.empty()) {
+                continue;
+            }
+            try {
+                do_check(reply);
+                handler(reply, get_count(received));
+            } catch (const std::exception &err) {
+                error = err.what();
+            }
+        }
+
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+
+    std::vector<sepulca_id> do_enumerate_ids() const
+    {
+        std::lock_guard guard(m_mutex);
+        do_request(storage_op::enumerate);
+        auto reply = do_call();
+
+        std::vector<sepulca_id> ids(reply.get_u64());
+        for (auto &sid : ids) {
+            sid = reply.get_id();
+        }
+        return ids;
+    }
+
+    /**
+     * Sets the sizes of pending requests and sends them.
+     */
+    void do_flush() const
+    {
+        // Frames are finished here rather than by their builders, so that
+        // a request is sent only when complete.
+        for (size_t i = 0; i < m_requests.size(); ++i) {
+            const auto end = i + 1 < m_requests.size() ?
+                m_requests[i + 1] : m_out.size();
+            const auto size = static_cast<uint32_t>(
+                end - m_requests[i] - sizeof(uint32_t));
+            if (size > max_frame_size) {
+                do_break();
+                throw std::runtime_error("Request of " + std::to_string(size) +
+                    " bytes is too large");
+            }
+            memcpy(m_out.data() + m_requests[i], &size, sizeof(size));
+        }
+        m_requests.clear();
+
+        size_t pos = 0;
+        while (pos < m_out.size()) {
+            const auto n = send(m_fd, m_out.data() + pos, m_out.size() - pos,
+                                MSG_NOSIGNAL);
+            if (n >= 0) {
+                pos += n;
+            } else if (errno != EINTR) {
+                auto err = errno;
+                do_break();
+                throw std::runtime_error("Failed to send request to storage "
+                    "server '" + m_socket.string() + "': " + strerror(err));
+            }
+        }
+        m_out.clear();
+    }
+
+    /**
+     * Reads the next reply, which stays valid until the next call.
+     */
+    frame_reader do_receive() const
+    {
+        m_in.erase(0, m_in_used);
+        m_in_used = 0;
+
+        size_t size;
+        try {
+            while ((size = get_frame_size(m_in)) == 0) {
+                const auto used = m_in.size();
+                m_in.resize(used + read_chunk_size);
+                const auto n = recv(m_fd, m_in.data() + used, read_chunk_size,
+                                    0);
+                m_in.resize(used + std::max<ssize_t>(n, 0));
+                if (n == 0) {
+                    throw std::runtime_error("Storage server '" +
+                        m_socket.string() + "' has closed the connection");
+                } else if (n < 0 && errno != EINTR) {
+                    throw std::runtime_error("Failed to receive reply from "
+                        "storage server '" + m_socket.string() + "': " +
+                        strerror(errno));
+                }
+            }
+        } catch (...) {
+            do_break();
+            throw;
+        }
+
+        m_in_used = size;
+        frame_reader reply(std::string_view(m_in).substr(0, size));
+        if (reply.get_tag() != ++m_received) {
+            do_break();
+            throw std::runtime_error("Unexpected reply from storage server '" +
+                m_socket.string() + "'");
+        }
+        return reply;
+    }
+
+    /**
+     * Throws the exception reported by the server, if any.
+     */
+    static void do_check(frame_reader &reply)
+    {
+        if (reply.get_code() != static_cast<uint8_t>(reply_status::ok)) {
+            throw std::runtime_error(std::string(reply.get_string()));
+        }
+    }
+
+    /**
+     * Closes a connection left in an unknown state by a failure,
+     * so that later requests fail instead of reading wrong replies.
+     */
+    void do_break() const noexcept
+    {
+        if (m_fd != -1) {
+            close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    sepulca_ptr do_get_sepulca(frame_reader &reply) const
+    {
+        auto sid = reply.get_id();
+        const auto version = reply.get_u64();
+        return make_sepulca(*this, std::move(sid), reply.get_attrs(), version);
+    }
+
+    std::vector<sepulca_ptr> do_get_sepulcas(frame_reader &reply) const
+    {
+        std::vector<sepulca_ptr> res(reply.get_u32());
+        for (auto &s : res) {
+            s = do_get_sepulca(reply);
+        }
+        return res;
+    }
+
+    const std::filesystem::path m_socket;
+    mutable std::mutex m_mutex;
+    mutable int m_fd = -1;
+
+    mutable std::string m_out;              // Requests not sent yet.
+    mutable std::vector<size_t> m_requests; // Offsets of unfinished requests.
+    mutable std::string m_in;               // Replies received.
+    mutable size_t m_in_used = 0;           // Size of the last reply.
+    mutable uint32_t m_sent = 0;
+    mutable uint32_t m_received = 0;
+};
+
+}
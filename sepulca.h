@@ -21,7 +21,11 @@
 #pragma once
 
 #include "storage.h"
+#include <algorithm>
 #include <any>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace cosmica
 {
@@ -45,20 +49,84 @@ public:
         return m_sid;
     }
 
+    /**
+     * Returns the version of the sepulca as of its loading or last commit.
+     *
+     * Every commit of a sepulca stores a version greater than any version
+     * stored before, so a changed version means a changed sepulca.
+     * Sepulcas stored without versions have version zero.
+     */
+    uint64_t get_version() const noexcept {
+        return m_version;
+    }
+
     /**
      * Erases the sepulca from the associated storage.
      * This sepulca object continues to be valid and can be committed
-     * to the storage again.
+     * to the storage again, which writes all its attributes.
      */
-    void erase() {
+    void erase()
+    {
         m_stor.erase(*this);
+        m_dirty_all = true;
     }
 
     /**
      * Commits the current sepulca state to the associated storage.
+     *
+     * Only attributes set or deleted since the sepulca has been loaded or
+     * last committed are written, so committing an unchanged sepulca does
+     * nothing. Storages may persist just these changes, merging them with
+     * changes of other attributes committed meanwhile; the sepulca then
+     * gets the merged attributes.
+     */
+    void commit()
+    {
+        if (!is_dirty()) {
+            return;
+        }
+        m_version = *m_stor.commit(*this, std::nullopt);
+        m_dirty.clear();
+        m_dirty_all = false;
+    }
+
+    /**
+     * Commits the sepulca only if the stored sepulca still has the given
+     * version, usually get_version() of this sepulca, so that concurrent
+     * read-modify-write cycles need no lock held between the read and
+     * the commit.
+     *
+     * Returns false without writing anything if the sepulca has been
+     * committed or erased meanwhile; the caller then reloads the sepulca
+     * and retries. Unlike commit(), this stores a new version even if
+     * nothing has changed, so a successful commit also confirms the reads.
+     */
+    bool commit_if(uint64_t version)
+    {
+        const auto committed = m_stor.commit(*this, version);
+        if (!committed) {
+            return false;
+        }
+        m_version = *committed;
+        m_dirty.clear();
+        m_dirty_all = false;
+        return true;
+    }
+
+    /**
+     * Checks if the sepulca has changes not committed yet.
      */
-    void commit() {
-        m_stor.commit(*this);
+    bool is_dirty() const noexcept {
+        return m_dirty_all || !m_dirty.empty();
+    }
+
+    /**
+     * Returns the ordered names of attributes set or deleted since
+     * the sepulca has been loaded or last committed, or null if the whole
+     * sepulca has to be written (e.g. after erase()).
+     */
+    const std::vector<std::string_view> *get_changed_attrs() const noexcept {
+        return m_dirty_all ? nullptr : &m_dirty;
     }
 
     /**
@@ -91,7 +159,14 @@ public:
      */
     void set_attr(const std::string &name, const std::string &value)
     {
-        m_attrs[name] = value;
+        auto [i, inserted] = m_attrs.emplace(name, value);
+        if (!inserted) {
+            if (i->second == value) {
+                return;
+            }
+            i->second = value;
+        }
+        mark_dirty(i->first);
     }
 
     /**
@@ -105,7 +180,9 @@ public:
     void delete_attr(const std::string &name)
     {
         if (auto i = m_attrs.find(name); i != m_attrs.end()) {
+            const auto interned = i->first;
             m_attrs.erase(i);
+            mark_dirty(interned);
         } else {
             throw std::runtime_error("Attribute '" + name + "' not found");
         }
@@ -136,25 +213,292 @@ public:
     }
 
 private:
-    // Every sepulca storage class must be declared friend here
-    // in order to be able create sepulcas.
-    friend class file_storage;
+    // Storages create sepulcas through storage::make_sepulca().
+    friend class storage;
 
     /**
      * Sepulca object costructor.
      * Clients can create sepulca objects only by storage interface.
      */
-    sepulca(storage &stor, sepulca_id &&sid, attributes &&attrs) :
+    sepulca(storage &stor, sepulca_id &&sid, attributes &&attrs,
+            uint64_t version) :
         m_stor(stor),
         m_sid(sid),
-        m_attrs(attrs)
+        m_attrs(attrs),
+        m_version(version)
     {
     }
 
+    /**
+     * Records a change of the attribute with the given interned name.
+     */
+    void mark_dirty(std::string_view name)
+    {
+        if (m_dirty_all) {
+            return;
+        }
+        auto i = std::lower_bound(m_dirty.begin(), m_dirty.end(), name);
+        if (i == m_dirty.end() || *i != name) {
+            m_dirty.insert(i, name);
+        }
+    }
+
     storage &m_stor;
     const sepulca_id m_sid;
     attributes m_attrs;
+    uint64_t m_version;
+    std::vector<std::string_view> m_dirty;
+    bool m_dirty_all = false;
     std::any m_transient_data;
 };
 
+/**
+ * A handle of a sepulca loaded from the storage on first access.
+ * Handles are not thread-safe.
+ */
+class lazy_sepulca
+{
+public:
+    lazy_sepulca(const storage &stor, const sepulca_id &sid) :
+        m_stor(&stor),
+        m_sid(sid)
+    {
+    }
+
+    /**
+     * Returns sepulca's unique ID without loading the sepulca.
+     */
+    const sepulca_id &get_id() const noexcept {
+        return m_sid;
+    }
+
+    /**
+     * Checks if the sepulca has been loaded.
+     */
+    bool is_loaded() const noexcept {
+        return m_sepulca != nullptr;
+    }
+
+    /**
+     * Returns the sepulca, loading it on the first call.
+     * Throws an exception if the sepulca is not found.
+     */
+    sepulca &get() const
+    {
+        if (!m_sepulca) {
+            m_sepulca = m_stor->get(m_sid);
+        }
+        return *m_sepulca;
+    }
+
+    sepulca &operator*() const {
+        return get();
+    }
+
+    sepulca *operator->() const {
+        return &get();
+    }
+
+    /**
+     * Passes the sepulca to the caller, loading it if needed.
+     */
+    sepulca_ptr release()
+    {
+        get();
+        return std::move(m_sepulca);
+    }
+
+private:
+    const storage *m_stor;
+    sepulca_id m_sid;
+    mutable sepulca_ptr m_sepulca;
+};
+
+// Storage interface functions defined here as they need the complete
+// sepulca type.
+
+inline void make_view(const sepulca &s, sepulca_view &view)
+{
+    view.reset(s.get_id());
+    view.set_version(s.get_version());
+    for (const auto &[k, v] : s.get_attrs()) {
+        view.add_attr(k, v);
+    }
+    view.finish();
+}
+
+inline sepulca_ptr storage::make_sepulca(const storage &stor, sepulca_id sid,
+                                         attributes attrs, uint64_t version)
+{
+    return sepulca_ptr(new sepulca(const_cast<storage &>(stor),
+                                   std::move(sid), std::move(attrs),
+                                   version));
+}
+
+inline sepulca_ptr storage::make_changed_sepulca(
+    const storage &stor, sepulca_id sid, attributes attrs, uint64_t version,
+    const std::vector<std::string> *changed)
+{
+    auto s = make_sepulca(stor, std::move(sid), std::move(attrs), version);
+    if (!changed) {
+        s->m_dirty_all = true;
+        return s;
+    }
+
+    for (const auto &name : *changed) {
+        s->mark_dirty(intern_attribute_name(name));
+    }
+    return s;
+}
+
+inline void write_batch::commit(sepulca &s)
+{
+    m_ops.push_back(op{op_type::put, s.get_id(), s.get_attrs(),
+                       s.get_version(), &s});
+}
+
+inline void storage::finish_commits(
+    const write_batch &batch,
+    const std::function<std::optional<uint64_t>(const sepulca_id &)>
+        &get_version)
+{
+    for (const auto &op : batch.get_ops()) {
+        if (!op.source) {
+            continue;
+        }
+
+        // A sepulca erased afterwards is written whole by its next commit,
+        // as after sepulca::erase().
+        if (const auto version = get_version(op.sid)) {
+            op.source->m_version = *version;
+            op.source->m_dirty.clear();
+            op.source->m_dirty_all = false;
+        } else {
+            op.source->m_dirty_all = true;
+        }
+    }
+}
+
+inline void storage::refresh_attrs(sepulca &s, attributes attrs)
+{
+    s.m_attrs = std::move(attrs);
+}
+
+inline std::vector<sepulca_ptr> storage::find(const std::string &name,
+                                              const std::string &value) const
+{
+    std::vector<sepulca_ptr> res;
+    enumerate([&](sepulca_ptr s) {
+        if (auto i = s->get_attrs().find(name);
+            i != s->get_attrs().end() && i->second == value) {
+            res.push_back(std::move(s));
+        }
+        return true;
+    });
+    return res;
+}
+
+inline void storage::visit(const sepulca_id &sid,
+                           std::function<void(const sepulca_view &)> cb) const
+{
+    sepulca_view view;
+    make_view(*get(sid), view);
+    cb(view);
+}
+
+inline void storage::enumerate_views(
+    std::function<bool(const sepulca_view &)> cb) const
+{
+    sepulca_view view;
+    enumerate([&](sepulca_ptr s) {
+        make_view(*s, view);
+        return cb(view);
+    });
+}
+
+inline void storage::enumerate_ids(
+    std::function<bool(const sepulca_id &)> cb) const
+{
+    std::vector<sepulca_id> ids;
+    enumerate_views([&](const sepulca_view &view) {
+        ids.push_back(view.get_id());
+        return true;
+    });
+
+    for (const auto &sid : ids) {
+        if (!cb(sid)) {
+            break;
+        }
+    }
+}
+
+inline scan_batch storage::scan(std::optional<sepulca_id> start_after,
+                                size_t limit) const
+{
+    if (limit == 0) {
+        throw std::runtime_error("Scan limit must be positive");
+    }
+
+    scan_batch batch;
+    const auto ids = scan_ids(start_after, limit);
+    if (ids.size() == limit) {
+        batch.next = ids.back();
+    }
+
+    // Sepulcas erased since their identifiers were selected are skipped.
+    for (auto &s : get_many(ids)) {
+        if (s) {
+            batch.sepulcas.push_back(std::move(s));
+        }
+    }
+    return batch;
+}
+
+inline std::vector<sepulca_id> storage::scan_ids(
+    std::optional<sepulca_id> start_after, size_t limit) const
+{
+    scan_window window(start_after, limit);
+    enumerate_ids([&](const sepulca_id &sid) {
+        window.add(sid);
+        return true;
+    });
+    return window.take();
+}
+
+inline std::vector<sepulca_ptr> storage::get_many(
+    std::span<const sepulca_id> ids) const
+{
+    scoped_timer timer(timer_metric::get_many);
+
+    std::vector<sepulca_ptr> res;
+    if (load_many(ids, res)) {
+        return res;
+    }
+
+    // A sepulca may be erased by another thread or process at any time,
+    // so its absence is only checked after a failed load.
+    res.clear();
+    res.reserve(ids.size());
+    for (const auto &sid : ids) {
+        try {
+            res.push_back(get(sid));
+        } catch (const std::runtime_error &) {
+            if (exists(sid)) {
+                throw;
+            }
+            res.push_back(nullptr);
+        }
+    }
+    return res;
+}
+
+inline void storage::enumerate_lazy(
+    std::function<bool(lazy_sepulca &)> cb) const
+{
+    enumerate_ids([&](const sepulca_id &sid) {
+        lazy_sepulca s(*this, sid);
+        return cb(s);
+    });
+}
+
 }
@@ -0,0 +1,177 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "storage.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace cosmica
+{
+
+/**
+ * Bounded LRU cache of sepulca attributes.
+ *
+ * Every entry is tagged with a generation supplied by the storage;
+ * a lookup with a different generation is a miss, which is how
+ * the storage invalidates entries changed by other processes.
+ */
+class sepulca_cache
+{
+public:
+    /**
+     * Creates a cache holding at most the given number of entries and
+     * approximately the given number of bytes. Zero means no limit.
+     */
+    sepulca_cache(size_t max_entries, size_t max_bytes) :
+        m_max_entries(max_entries),
+        m_max_bytes(max_bytes)
+    {
+    }
+
+    /**
+     * Returns cached attributes of a sepulca, storing its version in
+     * `version`, if they have been cached with the given generation.
+     */
+    std::shared_ptr<const attributes> get(const sepulca_id &sid,
+                                          uint64_t gen, uint64_t &version)
+    {
+        std::lock_guard guard(m_mutex);
+
+        auto i = m_index.find(sid);
+        if (i == m_index.end()) {
+            ++m_misses;
+            return {};
+        }
+
+        if (i->second->gen != gen) {
+            do_remove(i);
+            ++m_misses;
+            return {};
+        }
+
+        m_lru.splice(m_lru.begin(), m_lru, i->second);
+        ++m_hits;
+        version = i->second->version;
+        return i->second->attrs;
+    }
+
+    /**
+     * Caches attributes and the version of a sepulca with the given
+     * generation.
+     */
+    void put(const sepulca_id &sid, uint64_t gen, const attributes &attrs,
+             uint64_t version)
+    {
+        auto e = entry{
+            sid, gen, std::make_shared<const attributes>(attrs), version, 0
+        };
+        e.bytes = estimate_size(attrs);
+
+        std::lock_guard guard(m_mutex);
+
+        if (auto i = m_index.find(sid); i != m_index.end()) {
+            do_remove(i);
+        }
+
+        m_lru.push_front(std::move(e));
+        m_index.emplace(sid, m_lru.begin());
+        m_bytes += m_lru.front().bytes;
+
+        while (!m_lru.empty() &&
+               ((m_max_entries && m_index.size() > m_max_entries) ||
+                (m_max_bytes && m_bytes > m_max_bytes))) {
+            do_remove(m_index.find(m_lru.back().sid));
+        }
+    }
+
+    /**
+     * Removes a sepulca from the cache.
+     */
+    void remove(const sepulca_id &sid)
+    {
+        std::lock_guard guard(m_mutex);
+
+        if (auto i = m_index.find(sid); i != m_index.end()) {
+            do_remove(i);
+        }
+    }
+
+    size_t get_hits() const
+    {
+        std::lock_guard guard(m_mutex);
+        return m_hits;
+    }
+
+    size_t get_misses() const
+    {
+        std::lock_guard guard(m_mutex);
+        return m_misses;
+    }
+
+private:
+    struct entry
+    {
+        sepulca_id sid;
+        uint64_t gen;
+        std::shared_ptr<const attributes> attrs;
+        uint64_t version;
+        size_t bytes;
+    };
+
+    using entry_list = std::list<entry>;
+
+    void do_remove(std::unordered_map<sepulca_id,
+                   entry_list::iterator>::iterator i)
+    {
+        m_bytes -= i->second->bytes;
+        m_lru.erase(i->second);
+        m_index.erase(i);
+    }
+
+    /**
+     * Approximate memory footprint of cached attributes.
+     */
+    static size_t estimate_size(const attributes &attrs)
+    {
+        // Entry, list and index nodes, plus a vector element and a value
+        // per attribute; names are interned and not accounted for.
+        size_t size = 128;
+        for (const auto &[k, v] : attrs) {
+            size += sizeof(attributes::value_type) + v.size();
+        }
+        return size;
+    }
+
+    const size_t m_max_entries;
+    const size_t m_max_bytes;
+
+    mutable std::mutex m_mutex;
+    entry_list m_lru;
+    std::unordered_map<sepulca_id, entry_list::iterator> m_index;
+    size_t m_bytes = 0;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+};
+
+}
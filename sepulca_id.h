@@ -20,18 +20,125 @@
 
 #pragma once
 
-#include <string>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <ostream>
 #include <random>
-#include <sstream>
-#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 
 namespace cosmica
 {
 
 /**
- * Storage-wide unique Sepulca unidetifier.
+ * Storage-wide unique Sepulca identifier.
+ *
+ * An identifier is a 64-bit value. Its text form, used in file names and
+ * by the command line, is "{xxxx-xxxx-xxxx-xxxx}" with the value written
+ * in hex digits, most significant first.
  */
-using sepulca_id = std::string;
+struct sepulca_id
+{
+    uint64_t value = 0;
+
+    /**
+     * Creates a nil identifier. The nil identifier is never generated.
+     */
+    constexpr sepulca_id() noexcept = default;
+
+    constexpr explicit sepulca_id(uint64_t v) noexcept :
+        value(v)
+    {
+    }
+
+    /**
+     * Creates an identifier from its text form.
+     * Throws an exception if the text is not a valid identifier.
+     */
+    explicit sepulca_id(std::string_view text)
+    {
+        if (auto sid = parse(text)) {
+            value = sid->value;
+        } else {
+            throw std::runtime_error("Invalid Sepulca identifier '" +
+                std::string(text) + "'");
+        }
+    }
+
+    /**
+     * Parses identifier's text form.
+     */
+    static std::optional<sepulca_id> parse(std::string_view text) noexcept
+    {
+        if (text.size() != text_size || text.front() != '{' ||
+            text.back() != '}') {
+            return {};
+        }
+
+        uint64_t v = 0;
+        for (size_t i = 1; i + 1 < text.size(); ++i) {
+            const char c = text[i];
+            if (i % 5 == 0) {
+                if (c != '-') {
+                    return {};
+                }
+                continue;
+            }
+
+            uint64_t d;
+            if (c >= '0' && c <= '9') {
+                d = c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                d = c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                d = c - 'A' + 10;
+            } else {
+                return {};
+            }
+            v = (v << 4) | d;
+        }
+        return sepulca_id(v);
+    }
+
+    /**
+     * Returns identifier's text form.
+     */
+    std::string to_string() const
+    {
+        static constexpr char digits[] = "0123456789abcdef";
+
+        std::string text(text_size, '-');
+        text.front() = '{';
+        text.back() = '}';
+
+        uint64_t v = value;
+        for (size_t i = text_size - 2; i > 0; --i) {
+            if (i % 5 != 0) {
+                text[i] = digits[v & 0xf];
+                v >>= 4;
+            }
+        }
+        return text;
+    }
+
+    explicit operator bool() const noexcept {
+        return value != 0;
+    }
+
+    auto operator<=>(const sepulca_id &) const noexcept = default;
+
+    /**
+     * Length of identifier's text form.
+     */
+    static constexpr size_t text_size = sizeof("{xxxx-xxxx-xxxx-xxxx}") - 1;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const sepulca_id &sid)
+{
+    return os << sid.to_string();
+}
 
 /**
  * Generator of unique (random) Sepulca IDs.
@@ -44,29 +151,43 @@ public:
      */
     sepulca_id new_id() const
     {
-        std::ostringstream oss;
-        oss << "{";
-        for (int i = 0; i < 8; ++i) {
-            if (i > 0 && i % 2 == 0) {
-                oss << "-";
-            }
-            oss << std::hex
-                << std::setw(2)
-                << std::setfill('0')
-                << static_cast<uint32_t>(random_num());
-        }
-        oss << "}";
-        return oss.str();
+        auto &gen = engine();
+
+        uint64_t v;
+        do {
+            v = gen();
+        } while (v == 0);
+        return sepulca_id(v);
     }
 
 private:
-    static uint8_t random_num()
+    /**
+     * Returns the random engine of the calling thread.
+     * The engine is seeded only once per thread.
+     */
+    static std::mt19937_64 &engine()
     {
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_int_distribution<> dis(0, 255);
-        return dis(gen);
+        thread_local std::mt19937_64 gen = [] {
+            std::random_device rd;
+            std::seed_seq seq{rd(), rd(), rd(), rd()};
+            return std::mt19937_64(seq);
+        }();
+        return gen;
     }
 };
 
 }
+
+template<>
+struct std::hash<cosmica::sepulca_id>
+{
+    size_t operator()(const cosmica::sepulca_id &sid) const noexcept
+    {
+        // Identifiers are random, but imported ones need not be:
+        // mix the bits anyway (splitmix64 finalizer).
+        uint64_t x = sid.value;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return static_cast<size_t>(x ^ (x >> 31));
+    }
+};
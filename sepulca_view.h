@@ -0,0 +1,178 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "sepulca_id.h"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace cosmica
+{
+
+/**
+ * Read-only view of a sepulca state.
+ *
+ * Views refer to memory owned by the storage (e.g. a mapped file) and are
+ * valid only during the call they are passed to. Unlike sepulca objects,
+ * views do not own copies of attribute names and values.
+ */
+class sepulca_view
+{
+public:
+    using attribute = std::pair<std::string_view, std::string_view>;
+
+    /**
+     * Returns sepulca's unique ID.
+     */
+    const sepulca_id &get_id() const noexcept {
+        return m_sid;
+    }
+
+    /**
+     * Checks if the sepulca has the given attribute.
+     */
+    bool has_attr(std::string_view name) const noexcept {
+        return find(name) != m_attrs.end();
+    }
+
+    /**
+     * Returns a value of a given attribute.
+     * Throws an expection if the attribute is not found.
+     */
+    std::string_view get_attr(std::string_view name) const
+    {
+        if (auto i = find(name); i != m_attrs.end()) {
+            return i->second;
+        } else {
+            throw std::runtime_error("Attribute '" + std::string(name) +
+                "' not found");
+        }
+    }
+
+    /**
+     * Returns the version of the sepulca state, see sepulca::get_version().
+     */
+    uint64_t get_version() const noexcept {
+        return m_version;
+    }
+
+    /**
+     * Returns all attributes ordered by name.
+     */
+    const std::vector<attribute> &get_attrs() const noexcept {
+        return m_attrs;
+    }
+
+    /**
+     * Resets the view to the given identifier, no attributes and
+     * version zero, keeping the allocated memory for reuse.
+     */
+    void reset(const sepulca_id &sid) noexcept
+    {
+        m_sid = sid;
+        m_version = 0;
+        m_attrs.clear();
+    }
+
+    void set_version(uint64_t version) noexcept {
+        m_version = version;
+    }
+
+    /**
+     * Adds an attribute. Call finish() after the last attribute.
+     */
+    void add_attr(std::string_view name, std::string_view value) {
+        m_attrs.emplace_back(name, value);
+    }
+
+    /**
+     * Orders attributes by name. Of duplicate attributes the first added
+     * one is kept.
+     */
+    void finish()
+    {
+        auto less = [](const attribute &a, const attribute &b) {
+            return a.first < b.first;
+        };
+
+        if (!std::is_sorted(m_attrs.begin(), m_attrs.end(), less)) {
+            std::stable_sort(m_attrs.begin(), m_attrs.end(), less);
+        }
+
+        m_attrs.erase(std::unique(m_attrs.begin(), m_attrs.end(),
+                                  [](const attribute &a, const attribute &b) {
+                                      return a.first == b.first;
+                                  }),
+                      m_attrs.end());
+    }
+
+    /**
+     * Sets a value of an attribute after finish(), keeping the order.
+     */
+    void set_attr(std::string_view name, std::string_view value)
+    {
+        auto i = lower_bound(name);
+        if (i != m_attrs.end() && i->first == name) {
+            i->second = value;
+        } else {
+            m_attrs.emplace(i, name, value);
+        }
+    }
+
+    /**
+     * Removes an attribute after finish(), if present.
+     */
+    void erase_attr(std::string_view name)
+    {
+        if (auto i = lower_bound(name);
+            i != m_attrs.end() && i->first == name) {
+            m_attrs.erase(i);
+        }
+    }
+
+private:
+    std::vector<attribute>::iterator lower_bound(std::string_view name)
+    {
+        return std::lower_bound(m_attrs.begin(), m_attrs.end(), name,
+                                [](const attribute &a, std::string_view n) {
+                                    return a.first < n;
+                                });
+    }
+
+    std::vector<attribute>::const_iterator find(std::string_view name) const
+    {
+        auto i = std::lower_bound(m_attrs.begin(), m_attrs.end(), name,
+                                  [](const attribute &a, std::string_view n) {
+                                      return a.first < n;
+                                  });
+        return i != m_attrs.end() && i->first == name ? i : m_attrs.end();
+    }
+
+    sepulca_id m_sid;
+    uint64_t m_version = 0;
+    std::vector<attribute> m_attrs;
+};
+
+}
@@ -0,0 +1,125 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cosmica
+{
+
+/**
+ * An array of 64-bit counters stored at the beginning of a file and shared
+ * by all processes mapping the same file.
+ *
+ * Counters are updated with atomic operations on the shared mapping, so
+ * reading one costs no system call.
+ */
+class shared_counters
+{
+    static_assert(std::atomic_ref<uint64_t>::is_always_lock_free);
+
+public:
+    /**
+     * Maps the given number of counters of the file, growing the file
+     * with zero counters if needed.
+     */
+    shared_counters(const std::filesystem::path &path, size_t count) :
+        m_size(count * sizeof(uint64_t))
+    {
+        int fd = open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0777);
+        if (fd == -1) {
+            throw std::runtime_error("Failed to open counters file '" +
+                path.string() + "': " + strerror(errno));
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 ||
+            (static_cast<size_t>(st.st_size) < m_size &&
+             ftruncate(fd, static_cast<off_t>(m_size)) != 0)) {
+            auto err = errno;
+            close(fd);
+            throw std::runtime_error("Failed to size counters file '" +
+                path.string() + "': " + strerror(err));
+        }
+
+        auto p = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+        auto err = errno;
+        close(fd);
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Failed to map counters file '" +
+                path.string() + "': " + strerror(err));
+        }
+        m_counters = static_cast<uint64_t *>(p);
+    }
+
+    // Disable copy and move of shared counters.
+    shared_counters(const shared_counters &) = delete;
+    shared_counters(shared_counters &&) = delete;
+
+    ~shared_counters()
+    {
+        munmap(m_counters, m_size);
+    }
+
+    /**
+     * Returns the current value of a counter.
+     */
+    uint64_t load(size_t i) const noexcept {
+        return std::atomic_ref(m_counters[i]).load(std::memory_order_acquire);
+    }
+
+    /**
+     * Sets a counter.
+     */
+    void store(size_t i, uint64_t v) noexcept {
+        std::atomic_ref(m_counters[i]).store(v, std::memory_order_release);
+    }
+
+    /**
+     * Increments a counter, returning its new value.
+     */
+    uint64_t increment(size_t i) noexcept {
+        return std::atomic_ref(m_counters[i]).fetch_add(
+            1, std::memory_order_acq_rel) + 1;
+    }
+
+    /**
+     * Decrements a counter, returning its new value.
+     */
+    uint64_t decrement(size_t i) noexcept {
+        return std::atomic_ref(m_counters[i]).fetch_sub(
+            1, std::memory_order_acq_rel) - 1;
+    }
+
+private:
+    uint64_t *m_counters = nullptr;
+    const size_t m_size;
+};
+
+}
@@ -20,20 +20,139 @@
 
 #pragma once
 
+#include "attributes.h"
+#include "metrics.h"
 #include "sepulca_id.h"
+#include "sepulca_view.h"
+#include <algorithm>
+#include <functional>
 #include <memory>
-#include <map>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace cosmica
 {
 
 class sepulca;
+class lazy_sepulca;
+class async_storage;
+class storage_server;
 using sepulca_ptr = std::unique_ptr<sepulca>;
 
 /**
- * Sepulca attributes.
+ * A set of sepulca creations, commits and erasures to be applied
+ * to a storage atomically, see storage::apply().
  */
-using attributes = std::map<std::string, std::string>;
+class write_batch
+{
+public:
+    enum class op_type
+    {
+        create,
+        put,
+        erase,
+    };
+
+    struct op
+    {
+        op_type type;
+        sepulca_id sid;
+        attributes attrs;
+        uint64_t version = 0;       // Version of the committed sepulca.
+        sepulca *source = nullptr;  // Sepulca committed by commit().
+    };
+
+    /**
+     * Adds creation of a sepulca with a new unique identifier.
+     * Created sepulcas are returned by storage::apply().
+     */
+    void create(attributes attrs = {}) {
+        m_ops.push_back(op{op_type::create, {}, std::move(attrs)});
+    }
+
+    /**
+     * Adds committing the current state of a sepulca.
+     *
+     * Unlike put(), the new version is greater than the version of
+     * the sepulca object, and once the batch has been applied, the sepulca
+     * has the new version and no uncommitted changes, as after
+     * sepulca::commit(). The sepulca must stay alive until then.
+     */
+    void commit(sepulca &s);
+
+    /**
+     * Adds writing a sepulca with the given identifier and attributes,
+     * whether the sepulca exists or not.
+     */
+    void put(const sepulca_id &sid, attributes attrs) {
+        m_ops.push_back(op{op_type::put, sid, std::move(attrs)});
+    }
+
+    /**
+     * Adds erasing a sepulca.
+     * Applying the batch fails if the sepulca does not exist at that point.
+     */
+    void erase(const sepulca_id &sid) {
+        m_ops.push_back(op{op_type::erase, sid, {}});
+    }
+
+    const std::vector<op> &get_ops() const noexcept {
+        return m_ops;
+    }
+
+    size_t size() const noexcept {
+        return m_ops.size();
+    }
+
+    bool empty() const noexcept {
+        return m_ops.empty();
+    }
+
+    void clear() noexcept {
+        m_ops.clear();
+    }
+
+private:
+    std::vector<op> m_ops;
+};
+
+/**
+ * Options of storage::parallel_enumerate().
+ */
+struct enumerate_options
+{
+    /**
+     * Number of worker threads; zero means the number of hardware threads.
+     */
+    size_t threads = 0;
+
+    /**
+     * Deliver sepulcas one at a time in the order of identifiers.
+     * Otherwise the callback is invoked concurrently from worker threads
+     * in no particular order.
+     */
+    bool ordered = false;
+};
+
+/**
+ * Batch of sepulcas returned by storage::scan().
+ */
+struct scan_batch
+{
+    /**
+     * Sepulcas ordered by identifier.
+     */
+    std::vector<sepulca_ptr> sepulcas;
+
+    /**
+     * Identifier to resume the scan after, or nothing if the scan has
+     * reached the end of the storage.
+     */
+    std::optional<sepulca_id> next;
+};
 
 /**
  * Sepulca storage abstract class.
@@ -65,13 +184,248 @@ public:
      */
     virtual bool exists(const sepulca_id &sid) const = 0;
 
+    /**
+     * Loads sepulcas with the given identifiers, returning them in the same
+     * order; sepulcas not found are null.
+     *
+     * By default the sepulcas are passed to load_many(), or loaded one by
+     * one if the storage cannot overlap loads.
+     */
+    virtual std::vector<sepulca_ptr> get_many(
+        std::span<const sepulca_id> ids) const;
+
+    /**
+     * Checks which sepulcas with the given identifiers exist, returning
+     * the results in the same order.
+     *
+     * By default every sepulca is checked by exists(); storages override
+     * this to check them all under a single lock acquisition.
+     */
+    virtual std::vector<bool> exists_many(
+        std::span<const sepulca_id> ids) const
+    {
+        std::vector<bool> res;
+        res.reserve(ids.size());
+        for (const auto &sid : ids) {
+            res.push_back(exists(sid));
+        }
+        return res;
+    }
+
     /**
      * Enumerate all sepulcas.
+     *
+     * The callback is invoked without holding storage locks, so it may
+     * use the storage, e.g. commit or erase the enumerated sepulcas.
+     * Sepulcas created or erased meanwhile may or may not be reported.
      */
     virtual void enumerate(std::function<bool(sepulca_ptr)> cb) const = 0;
 
+    /**
+     * Enumerate identifiers of all sepulcas without loading them.
+     *
+     * The callback is invoked without holding storage locks, so it may
+     * use the storage. Sepulcas created or erased meanwhile may or may not
+     * be reported.
+     *
+     * By default identifiers are collected from enumerate_views();
+     * storages override this to avoid reading sepulcas at all.
+     */
+    virtual void enumerate_ids(
+        std::function<bool(const sepulca_id &)> cb) const;
+
+    /**
+     * Loads up to `limit` sepulcas with identifiers greater than
+     * `start_after`, or from the first one, ordered by identifier.
+     * Scanning from the returned `next` identifier until there is none
+     * visits every sepulca once.
+     *
+     * Unlike enumerate(), a scan keeps no state between batches, so it
+     * may be stopped and resumed later, and workers may scan disjoint
+     * identifier ranges. Sepulcas created or erased during the scan may
+     * or may not be returned.
+     */
+    scan_batch scan(std::optional<sepulca_id> start_after,
+                    size_t limit) const;
+
+    /**
+     * Returns up to `limit` identifiers greater than `start_after`, or from
+     * the first one, in order; see scan().
+     *
+     * By default identifiers are selected from enumerate_ids(); storages
+     * override this to select them under short lock acquisitions.
+     */
+    virtual std::vector<sepulca_id> scan_ids(
+        std::optional<sepulca_id> start_after, size_t limit) const;
+
+    /**
+     * Enumerate all sepulcas by handles loading them on first access,
+     * see enumerate_ids().
+     */
+    void enumerate_lazy(std::function<bool(lazy_sepulca &)> cb) const;
+
+    /**
+     * Enumerate all sepulcas, loading them on a pool of worker threads.
+     *
+     * Unless ordered mode is requested, the callback must be thread-safe.
+     * As for enumerate(), the callback may use the storage.
+     * Returning false from the callback stops the enumeration; sepulcas
+     * already being loaded may still be delivered in unordered mode.
+     *
+     * By default this falls back to the serial enumerate(), which satisfies
+     * both modes' guarantees.
+     */
+    virtual void parallel_enumerate(std::function<bool(sepulca_ptr)> cb,
+                                    enumerate_options opts = {}) const
+    {
+        (void)opts;
+        enumerate(std::move(cb));
+    }
+
+    /**
+     * Passes a read-only view of a sepulca with a given identifier
+     * to the callback. Throws an exception if the sepulca is not found.
+     * As for enumerate(), the callback may use the storage.
+     *
+     * Storages override this to avoid materializing the sepulca.
+     */
+    virtual void visit(const sepulca_id &sid,
+                       std::function<void(const sepulca_view &)> cb) const;
+
+    /**
+     * Enumerate all sepulcas by read-only views, see enumerate().
+     *
+     * Storages override this to avoid materializing sepulcas.
+     */
+    virtual void enumerate_views(
+        std::function<bool(const sepulca_view &)> cb) const;
+
+    /**
+     * Applies all operations of the batch in order under a single lock
+     * acquisition and makes them durable at once.
+     *
+     * The batch is atomic: either all operations take effect or, if any of
+     * them fails or the process crashes, none of them.
+     * Returns sepulcas created by the batch in the order of creation.
+     */
+    virtual std::vector<sepulca_ptr> apply(const write_batch &batch) = 0;
+
+    /**
+     * Declares an index on the given attribute, building it from
+     * the existing sepulcas. Declaring an existing index does nothing.
+     * Indexes are persistent and maintained by all storage operations.
+     */
+    virtual void create_index(const std::string &name)
+    {
+        throw std::runtime_error("Cannot index attribute '" + name +
+            "': attribute indexes are not supported by this storage");
+    }
+
+    /**
+     * Removes an index on the given attribute.
+     */
+    virtual void drop_index(const std::string &name)
+    {
+        throw std::runtime_error("Cannot drop index on attribute '" + name +
+            "': attribute indexes are not supported by this storage");
+    }
+
+    /**
+     * Returns the names of indexed attributes.
+     */
+    virtual std::vector<std::string> get_indexes() const {
+        return {};
+    }
+
+    /**
+     * Loads all sepulcas having the given attribute value.
+     *
+     * Only matching sepulcas are loaded if the attribute is indexed;
+     * otherwise this is a full scan.
+     */
+    virtual std::vector<sepulca_ptr> find(const std::string &name,
+                                          const std::string &value) const;
+
 protected:
+    /**
+     * Selects identifiers of a scan batch, see scan_ids(), from
+     * identifiers added in any order.
+     */
+    class scan_window
+    {
+    public:
+        scan_window(std::optional<sepulca_id> start_after, size_t limit) :
+            m_start_after(start_after),
+            m_limit(limit)
+        {}
+
+        void add(const sepulca_id &sid)
+        {
+            if ((m_start_after && sid <= *m_start_after) || m_limit == 0) {
+                return;
+            }
+
+            if (m_ids.size() < m_limit) {
+                m_ids.push_back(sid);
+                std::push_heap(m_ids.begin(), m_ids.end());
+            } else if (sid < m_ids.front()) {
+                std::pop_heap(m_ids.begin(), m_ids.end());
+                m_ids.back() = sid;
+                std::push_heap(m_ids.begin(), m_ids.end());
+            }
+        }
+
+        /**
+         * Returns the selected identifiers in order.
+         */
+        std::vector<sepulca_id> take()
+        {
+            std::sort_heap(m_ids.begin(), m_ids.end());
+            return std::move(m_ids);
+        }
+
+    private:
+        const std::optional<sepulca_id> m_start_after;
+        const size_t m_limit;
+        std::vector<sepulca_id> m_ids;  // Max-heap of the smallest ones.
+    };
+
     friend class sepulca;
+    friend class async_storage;
+    friend class storage_server;
+
+    /**
+     * Creates a sepulca object associated with the storage. Storages
+     * construct all sepulcas they return through this function.
+     */
+    static sepulca_ptr make_sepulca(const storage &stor, sepulca_id sid,
+                                    attributes attrs, uint64_t version);
+
+    /**
+     * Creates a sepulca as make_sepulca() does, with uncommitted changes
+     * of the named attributes, or of the whole sepulca if `changed` is
+     * null, so that a commit made elsewhere can be replayed.
+     */
+    static sepulca_ptr make_changed_sepulca(
+        const storage &stor, sepulca_id sid, attributes attrs,
+        uint64_t version, const std::vector<std::string> *changed);
+
+    /**
+     * Updates the sepulcas committed by an applied batch, see
+     * write_batch::commit(), to the stored versions returned by
+     * the function, none for sepulcas erased later in the batch.
+     */
+    static void finish_commits(
+        const write_batch &batch,
+        const std::function<std::optional<uint64_t>(const sepulca_id &)>
+            &get_version);
+
+    /**
+     * Replaces the attributes of a sepulca being committed with the stored
+     * ones, when its changes have been merged with attributes committed
+     * by other writers, so that the sepulca holds the version it gets.
+     */
+    static void refresh_attrs(sepulca &s, attributes attrs);
 
     /**
      * Erase a sepulca.
@@ -79,9 +433,28 @@ protected:
     virtual void erase(sepulca &s) = 0;
 
     /**
-     * Commit a sepulca.
+     * Commit a sepulca, if an expected version is given only if the stored
+     * sepulca has that version (zero if it does not exist).
+     * Returns the new version, greater than both the stored version and
+     * the version of the sepulca object, or nothing on a version mismatch.
+     */
+    virtual std::optional<uint64_t> commit(
+        sepulca &s, std::optional<uint64_t> expected) = 0;
+
+    /**
+     * Loads sepulcas with the given identifiers into `res`, overlapping
+     * the I/O of the loads; sepulcas not found are null.
+     *
+     * Returns false if the storage cannot overlap loads, so that callers
+     * load the sepulcas one by one instead, which is the default.
      */
-    virtual void commit(sepulca &s) = 0;
+    virtual bool load_many(std::span<const sepulca_id> ids,
+                           std::vector<sepulca_ptr> &res) const
+    {
+        (void)ids;
+        (void)res;
+        return false;
+    }
 };
 
 }
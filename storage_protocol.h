@@ -0,0 +1,291 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "attributes.h"
+#include "sepulca_id.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace cosmica
+{
+
+/**
+ * Binary protocol between storage_server and remote_storage.
+ *
+ * Every request and reply is a frame: a 32-bit size of the rest of
+ * the frame, a 32-bit tag, an 8-bit code and the payload. Fields are
+ * stored in the host byte order, as both ends are on the same host.
+ *
+ * The code of a request is its operation, the code of a reply its status.
+ * Clients may send any number of requests without waiting for replies
+ * (pipelining); the server replies to them in order, repeating the tags.
+ *
+ * Payloads are sequences of fixed-size integers, strings (a 32-bit size
+ * followed by the bytes), attributes (a 32-bit count followed by names and
+ * values) and sepulcas (the identifier, the version and the attributes).
+ */
+enum class storage_op : uint8_t
+{
+    get = 1,        // id -> sepulca
+    get_many,       // u32 count, ids -> (u8 found, sepulca if found)...
+    exists,         // id -> u8
+    exists_many,    // u32 count, ids -> u8...
+    create,         // attributes -> sepulca
+    commit,         // sepulca, u8 has expected, u64 expected, u8 all,
+                    // u32 count, changed names -> u8 committed, u64 version,
+                    // merged attributes if committed and not all
+    erase,          // id -> nothing
+    enumerate,      // nothing -> u64 count, ids
+    apply,          // u32 count, (u8 type, id, attributes, u64 version)...
+                    // -> u32 count, created sepulcas, u64 new version of
+                    // every put, zero if erased by the batch
+    find,           // name, value -> u32 count, sepulcas
+    create_index,   // name -> nothing
+    drop_index,     // name -> nothing
+    get_indexes,    // nothing -> u32 count, names
+    scan_ids,       // u8 has start, start id, u32 limit -> u32 count, ids
+};
+
+enum class reply_status : uint8_t
+{
+    ok = 0,
+    error = 1,      // The operation has thrown; the payload is the message.
+};
+
+/**
+ * Size of the frame header following the size field.
+ */
+inline constexpr size_t frame_header_size = 2 * sizeof(uint32_t) + 1;
+
+/**
+ * Frames larger than this are rejected as malformed.
+ */
+inline constexpr size_t max_frame_size = 256 << 20;
+
+/**
+ * Returns the size of the frame at the beginning of `data`, including
+ * the size field, or zero if the frame is not complete yet.
+ * Throws an exception if the frame is malformed.
+ */
+inline size_t get_frame_size(std::string_view data)
+{
+    uint32_t size;
+    if (data.size() < sizeof(size)) {
+        return 0;
+    }
+
+    memcpy(&size, data.data(), sizeof(size));
+    if (size < frame_header_size - sizeof(size) || size > max_frame_size) {
+        throw std::runtime_error("Malformed frame of " +
+            std::to_string(size) + " bytes");
+    }
+    return data.size() < sizeof(size) + size ? 0 : sizeof(size) + size;
+}
+
+/**
+ * Appends a frame to a buffer. The frame size is set by finish().
+ */
+class frame_writer
+{
+public:
+    frame_writer(std::string &out, uint32_t tag, uint8_t code) :
+        m_out(out),
+        m_start(out.size())
+    {
+        put_u32(0);
+        put_u32(tag);
+        put_u8(code);
+    }
+
+    void put_u8(uint8_t v) {
+        m_out += static_cast<char>(v);
+    }
+
+    void put_u32(uint32_t v) {
+        m_out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+
+    void put_u64(uint64_t v) {
+        m_out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+
+    void put_id(const sepulca_id &sid) {
+        put_u64(sid.value);
+    }
+
+    void put_string(std::string_view s)
+    {
+        put_u32(static_cast<uint32_t>(s.size()));
+        m_out += s;
+    }
+
+    void put_attrs(const attributes &attrs)
+    {
+        put_u32(static_cast<uint32_t>(attrs.size()));
+        for (const auto &[k, v] : attrs) {
+            put_string(k);
+            put_string(v);
+        }
+    }
+
+    template<typename Sepulca>
+    void put_sepulca(const Sepulca &s)
+    {
+        put_id(s.get_id());
+        put_u64(s.get_version());
+        put_attrs(s.get_attrs());
+    }
+
+    /**
+     * Sets the size of the frame. Throws an exception if the frame is too
+     * large, removing it from the buffer.
+     */
+    void finish()
+    {
+        const auto size = m_out.size() - m_start - sizeof(uint32_t);
+        if (size > max_frame_size) {
+            m_out.resize(m_start);
+            throw std::runtime_error("Frame of " + std::to_string(size) +
+                " bytes is too large");
+        }
+
+        const auto size32 = static_cast<uint32_t>(size);
+        memcpy(m_out.data() + m_start, &size32, sizeof(size32));
+    }
+
+private:
+    std::string &m_out;
+    const size_t m_start;
+};
+
+/**
+ * Reads a complete frame. Throws an exception on reading past its end.
+ */
+class frame_reader
+{
+public:
+    explicit frame_reader(std::string_view frame) :
+        m_data(frame)
+    {
+        get_u32();
+        m_tag = get_u32();
+        m_code = get_u8();
+    }
+
+    uint32_t get_tag() const noexcept {
+        return m_tag;
+    }
+
+    uint8_t get_code() const noexcept {
+        return m_code;
+    }
+
+    bool empty() const noexcept {
+        return m_data.empty();
+    }
+
+    uint8_t get_u8()
+    {
+        uint8_t v;
+        get(&v, sizeof(v));
+        return v;
+    }
+
+    uint32_t get_u32()
+    {
+        uint32_t v;
+        get(&v, sizeof(v));
+        return v;
+    }
+
+    uint64_t get_u64()
+    {
+        uint64_t v;
+        get(&v, sizeof(v));
+        return v;
+    }
+
+    sepulca_id get_id() {
+        return sepulca_id(get_u64());
+    }
+
+    /**
+     * Returns a string referring to the frame.
+     */
+    std::string_view get_string()
+    {
+        const auto size = get_u32();
+        check(size);
+        auto s = m_data.substr(0, size);
+        m_data.remove_prefix(size);
+        return s;
+    }
+
+    attributes get_attrs()
+    {
+        return get_attrs([](std::string_view) {});
+    }
+
+    /**
+     * Reads attributes, passing every name to `check_name` before it is
+     * interned; the check rejects a name by throwing.
+     */
+    template<typename Check>
+    attributes get_attrs(Check &&check_name)
+    {
+        attributes attrs;
+        const auto count = get_u32();
+        attrs.reserve(std::min<size_t>(count, m_data.size()));
+        for (uint32_t i = 0; i < count; ++i) {
+            // Attributes are written in order, so this appends.
+            const auto k = get_string();
+            check_name(k);
+            attrs.emplace_hint(attrs.end(), k, get_string());
+        }
+        return attrs;
+    }
+
+private:
+    void check(size_t size) const
+    {
+        if (m_data.size() < size) {
+            throw std::runtime_error("Malformed frame");
+        }
+    }
+
+    void get(void *v, size_t size)
+    {
+        check(size);
+        memcpy(v, m_data.data(), size);
+        m_data.remove_prefix(size);
+    }
+
+    std::string_view m_data;
+    uint32_t m_tag = 0;
+    uint8_t m_code = 0;
+};
+
+}
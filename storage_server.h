@@ -0,0 +1,613 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "sepulca.h"
+#include "storage_protocol.h"
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace cosmica
+{
+
+/**
+ * Serves a storage to remote_storage clients over a Unix domain socket,
+ * see storage_protocol.h.
+ *
+ * A single thread runs an epoll loop over all connections and executes
+ * requests in the order they arrive, so the storage stays open with warm
+ * caches between requests, and requests of a connection are answered
+ * in order. Reading from a connection pauses while too many replies are
+ * waiting to be sent to it.
+ */
+class storage_server
+{
+public:
+    /**
+     * Listens on the given socket, replacing a socket file left behind
+     * by a server which is not running anymore.
+     * Throws an exception if another server is listening on the socket.
+     */
+    storage_server(storage &stor, const std::filesystem::path &socket) :
+        m_stor(stor),
+        m_socket(socket)
+    {
+        try {
+            do_listen();
+
+            m_epoll = epoll_create1(EPOLL_CLOEXEC);
+            m_stop = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (m_epoll == -1 || m_stop == -1) {
+                throw std::runtime_error(std::string(
+                    "Failed to create server event loop: ") +
+                    strerror(errno));
+            }
+
+            do_watch(m_listen, EPOLLIN, EPOLL_CTL_ADD);
+            do_watch(m_stop, EPOLLIN, EPOLL_CTL_ADD);
+        } catch (...) {
+            do_close();
+            throw;
+        }
+    }
+
+    // Disable copy and move of servers.
+    storage_server(const storage_server &) = delete;
+    storage_server(storage_server &&) = delete;
+
+    ~storage_server()
+    {
+        do_close();
+    }
+
+    /**
+     * Serves clients until stop() is called.
+     */
+    void run()
+    {
+        std::array<epoll_event, 64> events;
+        for (;;) {
+            const int n = epoll_wait(m_epoll, events.data(),
+                                     static_cast<int>(events.size()), -1);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string(
+                    "Failed to wait for server events: ") + strerror(errno));
+            }
+
+            for (int i = 0; i < n; ++i) {
+                const int fd = events[i].data.fd;
+                if (fd == m_stop) {
+                    uint64_t count;
+                    if (read(m_stop, &count, sizeof(count)) != sizeof(count)) {
+                        // Reset by another call already.
+                    }
+                    return;
+                } else if (fd == m_listen) {
+                    do_accept();
+                } else if (auto c = m_conns.find(fd); c != m_conns.end()) {
+                    do_serve(c->second, events[i].events);
+                }
+            }
+        }
+    }
+
+    /**
+     * Makes run() return. Can be called from any thread and from signal
+     * handlers.
+     */
+    void stop() noexcept
+    {
+        const uint64_t one = 1;
+        if (write(m_stop, &one, sizeof(one)) != sizeof(one)) {
+            // The counter is non-zero already.
+        }
+    }
+
+private:
+    struct connection
+    {
+        int fd = -1;
+        std::string in;
+        std::string out;
+        size_t out_pos = 0;  // Bytes of `out` sent already.
+        uint32_t events = 0; // Events watched.
+    };
+
+    // Reading pauses while more reply bytes than this are pending.
+    static constexpr size_t max_pending_output = 16 << 20;
+
+    // Connections are read in chunks of this size.
+    static constexpr size_t read_chunk_size = 64 * 1024;
+
+    // Attribute names new to the process which clients may send.
+    static constexpr size_t max_new_names = 1 << 16;
+
+    void do_listen()
+    {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (m_socket.native().size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Socket path '" + m_socket.string() +
+                "' is too long");
+        }
+        strcpy(addr.sun_path, m_socket.c_str());
+
+        m_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+        if (m_listen == -1) {
+            throw std::runtime_error(std::string(
+                "Failed to create server socket: ") + strerror(errno));
+        }
+
+        auto *sa = reinterpret_cast<const sockaddr *>(&addr);
+        if (bind(m_listen, sa, sizeof(addr)) != 0) {
+            if (errno != EADDRINUSE) {
+                throw std::runtime_error("Failed to bind socket '" +
+                    m_socket.string() + "': " + strerror(errno));
+            }
+
+            // A socket file nobody accepts connections on is stale.
+            const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            const bool live = probe != -1 &&
+                connect(probe, sa, sizeof(addr)) == 0;
+            if (probe != -1) {
+                close(probe);
+            }
+            if (live) {
+                throw std::runtime_error("A server is already listening on '" +
+                    m_socket.string() + "'");
+            }
+
+            unlink(m_socket.c_str());
+            if (bind(m_listen, sa, sizeof(addr)) != 0) {
+                throw std::runtime_error("Failed to bind socket '" +
+                    m_socket.string() + "': " + strerror(errno));
+            }
+        }
+        m_bound = true;
+
+        if (listen(m_listen, SOMAXCONN) != 0) {
+            throw std::runtime_error("Failed to listen on socket '" +
+                m_socket.string() + "': " + strerror(errno));
+        }
+    }
+
+    void do_close() noexcept
+    {
+        for (const auto &[fd, c] : m_conns) {
+            close(fd);
+        }
+        m_conns.clear();
+
+        for (int *fd : {&m_listen, &m_epoll, &m_stop}) {
+            if (*fd != -1) {
+                close(*fd);
+                *fd = -1;
+            }
+        }
+
+        if (m_bound) {
+            unlink(m_socket.c_str());
+            m_bound = false;
+        }
+    }
+
+    void do_watch(int fd, uint32_t events, int op)
+    {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(m_epoll, op, fd, &ev) != 0) {
+            throw std::runtime_error(std::string(
+                "Failed to watch server socket: ") + strerror(errno));
+        }
+    }
+
+    void do_accept()
+    {
+        for (;;) {
+            const int fd = accept4(m_listen, nullptr, nullptr,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != EINTR) {
+                    std::cerr << "Failed to accept connection: "
+                        << strerror(errno) << std::endl;
+                }
+                return;
+            }
+
+            auto &c = m_conns[fd];
+            c.fd = fd;
+            c.events = EPOLLIN;
+            try {
+                do_watch(fd, c.events, EPOLL_CTL_ADD);
+            } catch (const std::exception &err) {
+                std::cerr << "Failed to accept connection: " << err.what()
+                    << std::endl;
+                do_disconnect(c);
+            }
+        }
+    }
+
+    /**
+     * Reads requests of a ready connection, executes them and sends
+     * the replies, closing the connection on errors and hang-ups.
+     */
+    void do_serve(connection &c, uint32_t events)
+    {
+        try {
+            if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !do_read(c)) {
+                do_disconnect(c);
+                return;
+            }
+
+            // Requests left unprocessed while the output was full are
+            // processed once it drains.
+            for (;;) {
+                const bool more = do_process(c);
+                do_write(c);
+                if (!more || c.out_pos < c.out.size()) {
+                    break;
+                }
+            }
+
+            uint32_t want = 0;
+            if (c.out.size() - c.out_pos < max_pending_output) {
+                want |= EPOLLIN;
+            }
+            if (c.out_pos < c.out.size()) {
+                want |= EPOLLOUT;
+            }
+            if (want != c.events) {
+                c.events = want;
+                do_watch(c.fd, want, EPOLL_CTL_MOD);
+            }
+        } catch (const std::exception &err) {
+            std::cerr << "Closing connection: " << err.what() << std::endl;
+            do_disconnect(c);
+        }
+    }
+
+    void do_disconnect(connection &c)
+    {
+        const int fd = c.fd;
+        close(fd);
+        m_conns.erase(fd);
+    }
+
+    /**
+     * Reads everything available. Returns false if the peer has closed
+     * the connection.
+     */
+    bool do_read(connection &c)
+    {
+        for (;;) {
+            const auto size = c.in.size();
+            c.in.resize(size + read_chunk_size);
+            const auto n = recv(c.fd, c.in.data() + size, read_chunk_size, 0);
+            c.in.resize(size + std::max<ssize_t>(n, 0));
+
+            if (n > 0) {
+                continue;
+            }
+            if (n == 0) {
+                return false;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if (errno != EINTR) {
+                throw std::runtime_error(std::string("Failed to read: ") +
+                    strerror(errno));
+            }
+        }
+    }
+
+    /**
+     * Sends as much of the pending output as the socket accepts.
+     */
+    void do_write(connection &c)
+    {
+        while (c.out_pos < c.out.size()) {
+            const auto n = send(c.fd, c.out.data() + c.out_pos,
+                                c.out.size() - c.out_pos, MSG_NOSIGNAL);
+            if (n >= 0) {
+                c.out_pos += n;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno != EINTR) {
+                throw std::runtime_error(std::string("Failed to write: ") +
+                    strerror(errno));
+            }
+        }
+
+        if (c.out_pos == c.out.size()) {
+            c.out.clear();
+            c.out_pos = 0;
+        }
+    }
+
+    /**
+     * Executes complete requests read so far, as long as the output is
+     * not full. Returns true if complete requests are left.
+     */
+    bool do_process(connection &c)
+    {
+        size_t pos = 0;
+        bool more = false;
+        while (size_t size = get_frame_size(std::string_view(c.in).substr(pos))) {
+            if (c.out.size() - c.out_pos >= max_pending_output) {
+                more = true;
+                break;
+            }
+
+            frame_reader req(std::string_view(c.in).substr(pos, size));
+            do_execute(req, c.out);
+            pos += size;
+        }
+        c.in.erase(0, pos);
+        return more;
+    }
+
+    /**
+     * Executes a request, appending the reply to `out`. Exceptions thrown
+     * by the storage are sent to the client.
+     */
+    void do_execute(frame_reader &req, std::string &out)
+    {
+        const auto start = out.size();
+        try {
+            frame_writer reply(out, req.get_tag(),
+                               static_cast<uint8_t>(reply_status::ok));
+            do_dispatch(static_cast<storage_op>(req.get_code()), req, reply);
+            reply.finish();
+        } catch (const std::exception &err) {
+            out.resize(start);
+            frame_writer reply(out, req.get_tag(),
+                               static_cast<uint8_t>(reply_status::error));
+            reply.put_string(err.what());
+            reply.finish();
+        }
+    }
+
+    void do_dispatch(storage_op op, frame_reader &req, frame_writer &reply)
+    {
+        switch (op) {
+        case storage_op::get:
+            reply.put_sepulca(*m_stor.get(req.get_id()));
+            break;
+        case storage_op::get_many:
+            for (const auto &s : m_stor.get_many(get_ids(req))) {
+                reply.put_u8(s != nullptr);
+                if (s) {
+                    reply.put_sepulca(*s);
+                }
+            }
+            break;
+        case storage_op::exists:
+            reply.put_u8(m_stor.exists(req.get_id()));
+            break;
+        case storage_op::exists_many:
+            for (const bool e : m_stor.exists_many(get_ids(req))) {
+                reply.put_u8(e);
+            }
+            break;
+        case storage_op::create:
+            reply.put_sepulca(*m_stor.create(do_get_attrs(req)));
+            break;
+        case storage_op::commit:
+            do_commit(req, reply);
+            break;
+        case storage_op::erase: {
+            auto s = storage::make_sepulca(m_stor, req.get_id(), {}, 0);
+            m_stor.erase(*s);
+            break;
+        }
+        case storage_op::enumerate: {
+            std::vector<sepulca_id> ids;
+            m_stor.enumerate_ids([&](const sepulca_id &sid) {
+                ids.push_back(sid);
+                return true;
+            });
+            reply.put_u64(ids.size());
+            for (const auto &sid : ids) {
+                reply.put_id(sid);
+            }
+            break;
+        }
+        case storage_op::apply:
+            do_apply(req, reply);
+            break;
+        case storage_op::find: {
+            const auto name = req.get_string();
+            const auto value = req.get_string();
+            put_sepulcas(reply, m_stor.find(std::string(name),
+                                            std::string(value)));
+            break;
+        }
+        case storage_op::create_index:
+            m_stor.create_index(std::string(req.get_string()));
+            break;
+        case storage_op::drop_index:
+            m_stor.drop_index(std::string(req.get_string()));
+            break;
+        case storage_op::scan_ids: {
+            const bool has_start = req.get_u8();
+            const auto start = req.get_id();
+            const auto ids = m_stor.scan_ids(
+                has_start ? std::optional(start) : std::nullopt,
+                req.get_u32());
+            reply.put_u32(static_cast<uint32_t>(ids.size()));
+            for (const auto &sid : ids) {
+                reply.put_id(sid);
+            }
+            break;
+        }
+        case storage_op::get_indexes: {
+            const auto names = m_stor.get_indexes();
+            reply.put_u32(static_cast<uint32_t>(names.size()));
+            for (const auto &name : names) {
+                reply.put_string(name);
+            }
+            break;
+        }
+        default:
+            throw std::runtime_error("Unknown storage operation " +
+                std::to_string(static_cast<int>(op)));
+        }
+    }
+
+    /**
+     * Replays a commit of a client's sepulca, with the same changes.
+     */
+    void do_commit(frame_reader &req, frame_writer &reply)
+    {
+        auto sid = req.get_id();
+        const auto version = req.get_u64();
+        auto attrs = do_get_attrs(req);
+
+        const bool has_expected = req.get_u8();
+        const auto expected = req.get_u64();
+        const bool all = req.get_u8();
+
+        std::vector<std::string> changed;
+        for (auto n = req.get_u32(); n > 0; --n) {
+            const auto name = req.get_string();
+            do_check_name(name);
+            changed.emplace_back(name);
+        }
+
+        auto s = storage::make_changed_sepulca(
+            m_stor, std::move(sid), std::move(attrs), version,
+            all ? nullptr : &changed);
+        const auto committed = m_stor.commit(
+            *s, has_expected ? std::optional(expected) : std::nullopt);
+
+        reply.put_u8(committed.has_value());
+        reply.put_u64(committed.value_or(0));
+        if (committed && !all) {
+            reply.put_attrs(s->get_attrs());
+        }
+    }
+
+    attributes do_get_attrs(frame_reader &req)
+    {
+        return req.get_attrs([this](std::string_view name) {
+            do_check_name(name);
+        });
+    }
+
+    /**
+     * Rejects attribute names new to the process once clients have sent
+     * max_new_names of them, as interned names are never freed.
+     */
+    void do_check_name(std::string_view name)
+    {
+        if (is_attribute_name_interned(name)) {
+            return;
+        }
+        if (m_new_names == max_new_names) {
+            throw std::runtime_error("Too many distinct attribute names");
+        }
+        ++m_new_names;
+    }
+
+    static std::vector<sepulca_id> get_ids(frame_reader &req)
+    {
+        std::vector<sepulca_id> ids(req.get_u32());
+        for (auto &sid : ids) {
+            sid = req.get_id();
+        }
+        return ids;
+    }
+
+    /**
+     * Applies a batch whose puts commit sepulcas made for them with
+     * the versions of the client's sepulcas, and replies with their new
+     * versions, see write_batch::commit().
+     */
+    void do_apply(frame_reader &req, frame_writer &reply)
+    {
+        write_batch batch;
+        std::vector<sepulca_ptr> committed;
+        for (auto n = req.get_u32(); n > 0; --n) {
+            const auto type = static_cast<write_batch::op_type>(req.get_u8());
+            const auto sid = req.get_id();
+            auto attrs = do_get_attrs(req);
+            const auto version = req.get_u64();
+            switch (type) {
+            case write_batch::op_type::create:
+                batch.create(std::move(attrs));
+                break;
+            case write_batch::op_type::put:
+                committed.push_back(storage::make_sepulca(
+                    m_stor, sid, std::move(attrs), version));
+                batch.commit(*committed.back());
+                break;
+            case write_batch::op_type::erase:
+                batch.erase(sid);
+                break;
+            default:
+                throw std::runtime_error("Unknown batch operation");
+            }
+        }
+
+        put_sepulcas(reply, m_stor.apply(batch));
+        for (const auto &s : committed) {
+            reply.put_u64(s->is_dirty() ? 0 : s->get_version());
+        }
+    }
+
+    static void put_sepulcas(frame_writer &reply,
+                             const std::vector<sepulca_ptr> &sepulcas)
+    {
+        reply.put_u32(static_cast<uint32_t>(sepulcas.size()));
+        for (const auto &s : sepulcas) {
+            reply.put_sepulca(*s);
+        }
+    }
+
+    storage &m_stor;
+    const std::filesystem::path m_socket;
+    bool m_bound = false;
+
+    int m_listen = -1;
+    int m_epoll = -1;
+    int m_stop = -1;
+    std::unordered_map<int, connection> m_conns;
+    size_t m_new_names = 0;
+};
+
+}
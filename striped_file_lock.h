@@ -0,0 +1,211 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include "metrics.h"
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace cosmica
+{
+
+/**
+ * A fixed set of system-wide readers-writer mutexes (stripes) implemented
+ * via byte-range locks on a single file: stripe N locks byte N of the file.
+ *
+ * Objects are mapped onto stripes by hash, so that operations on unrelated
+ * objects rarely contend. All processes sharing the file must use the same
+ * number of stripes.
+ *
+ * Open file description locks (F_OFD_SETLKW) are used: unlike classic POSIX
+ * record locks they are not released when the process closes another
+ * descriptor of the same file, and they do not interfere with flock() locks
+ * on it. As with file_lock, threads are excluded by in-process mutexes.
+ */
+class striped_file_lock
+{
+public:
+    /**
+     * A single stripe.
+     * This class is compatible with std::lock_guard, std::unique_lock
+     * and std::shared_lock.
+     */
+    class stripe
+    {
+    public:
+        /**
+         * Acquires the stripe exclusively.
+         */
+        void lock()
+        {
+            scoped_timer timer(timer_metric::stripe_wait);
+            m_mutex.lock();
+
+            try {
+                m_owner.set_lock(m_index, F_WRLCK);
+            } catch (...) {
+                m_mutex.unlock();
+                throw;
+            }
+        }
+
+        /**
+         * Releases the exclusively owned stripe.
+         */
+        void unlock()
+        {
+            try {
+                m_owner.set_lock(m_index, F_UNLCK);
+            } catch (...) {
+                m_mutex.unlock();
+                throw;
+            }
+            m_mutex.unlock();
+        }
+
+        /**
+         * Acquires the stripe in the shared mode.
+         */
+        void lock_shared()
+        {
+            scoped_timer timer(timer_metric::stripe_wait);
+            m_mutex.lock_shared();
+
+            std::lock_guard guard(m_shared_mutex);
+            if (m_shared_count == 0) {
+                try {
+                    m_owner.set_lock(m_index, F_RDLCK);
+                } catch (...) {
+                    m_mutex.unlock_shared();
+                    throw;
+                }
+            }
+            ++m_shared_count;
+        }
+
+        /**
+         * Releases the stripe owned in the shared mode.
+         */
+        void unlock_shared()
+        {
+            try {
+                std::lock_guard guard(m_shared_mutex);
+                if (--m_shared_count == 0) {
+                    m_owner.set_lock(m_index, F_UNLCK);
+                }
+            } catch (...) {
+                m_mutex.unlock_shared();
+                throw;
+            }
+            m_mutex.unlock_shared();
+        }
+
+    private:
+        friend class striped_file_lock;
+
+        stripe(striped_file_lock &owner, size_t index) :
+            m_owner(owner),
+            m_index(index)
+        {
+        }
+
+        striped_file_lock &m_owner;
+        const size_t m_index;
+        std::shared_mutex m_mutex;
+        std::mutex m_shared_mutex;
+        size_t m_shared_count = 0;
+    };
+
+    /**
+     * Creates a striped lock object for the given file.
+     */
+    striped_file_lock(std::filesystem::path path, size_t stripes) :
+        m_path(std::move(path))
+    {
+        m_fd = open(m_path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0777);
+        if (m_fd == -1) {
+            throw std::runtime_error("Failed to open lock file '" +
+                m_path.string() + "': " + strerror(errno));
+        }
+
+        m_stripes.reserve(stripes);
+        for (size_t i = 0; i < stripes; ++i) {
+            m_stripes.emplace_back(new stripe(*this, i));
+        }
+    }
+
+    // Stripes refer to their owner.
+    striped_file_lock(const striped_file_lock &) = delete;
+    striped_file_lock(striped_file_lock &&) = delete;
+
+    /**
+     * Destroys the lock object, releasing all owned stripes.
+     */
+    ~striped_file_lock()
+    {
+        close(m_fd);
+    }
+
+    /**
+     * Returns the stripe for an object with the given hash.
+     */
+    stripe &get_stripe(size_t hash) {
+        return *m_stripes[hash % m_stripes.size()];
+    }
+
+    /**
+     * Returns lock's file path.
+     */
+    const auto &get_lock_file_path() const {
+        return m_path;
+    }
+
+private:
+    void set_lock(size_t index, short type)
+    {
+        struct flock fl = {};
+        fl.l_type = type;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = static_cast<off_t>(index);
+        fl.l_len = 1;
+
+        while (fcntl(m_fd, F_OFD_SETLKW, &fl) != 0) {
+            if (errno != EINTR) {
+                throw std::runtime_error("Failed to " +
+                    std::string(type == F_UNLCK ? "unlock" : "lock") +
+                    " stripe " + std::to_string(index) + " of file '" +
+                    m_path.string() + "': " + strerror(errno));
+            }
+        }
+    }
+
+    const std::filesystem::path m_path;
+    std::vector<std::unique_ptr<stripe>> m_stripes;
+    int m_fd = -1;
+};
+
+}
@@ -0,0 +1,1591 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+/*
+ * Storage tests.
+ *
+ * Every test gets a fresh temporary directory for its storages and fails
+ * by throwing. Tests named on the command line are run, or all of them
+ * if none is named.
+ */
+
+#include "file_storage.h"
+#include "log_storage.h"
+#include "memory_storage.h"
+#include "remote_storage.h"
+#include "storage_server.h"
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace cosmica;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool cond, const char *what, int line)
+{
+    if (!cond) {
+        throw std::runtime_error("tests.cpp:" + std::to_string(line) +
+            ": check failed: " + what);
+    }
+}
+
+/**
+ * Attributes are used as a std::map<std::string, std::string>, names
+ * included.
+ */
+static void test_attributes(const std::filesystem::path &)
+{
+    attributes attrs = {{"b", "2"}, {"a", "1"}};
+    attrs.emplace(std::string("c"), "3");
+    attrs["d"] = "4";
+    CHECK(attrs.size() == 4 && attrs.at("c") == "3");
+
+    auto i = attrs.begin();
+    std::string name = i->first;
+    const std::string &ref = i->first;
+    CHECK(name == "a" && ref == name && i->first == name);
+    CHECK(i->first.size() == 1 && !i->first.empty());
+    CHECK(i->first < std::next(i)->first && i->first != "b");
+
+    std::map<std::string, std::string> copy(attrs.begin(), attrs.end());
+    CHECK(copy.size() == attrs.size());
+    for (const auto &[k, v] : attrs) {
+        CHECK(copy.at(k) == v);
+    }
+
+    attrs.erase("b");
+    attrs.insert_or_assign("a", "5");
+    CHECK(!attrs.contains("b") && attrs.find("a")->second == "5");
+    CHECK(attrs != attributes({{"a", "5"}}));
+}
+
+/**
+ * Finds the cell file of a sepulca in a file storage directory.
+ */
+static std::filesystem::path find_cell(const std::filesystem::path &dir,
+                                       const sepulca_id &sid)
+{
+    const auto name = sid.to_string() + ".txt";
+    for (const auto &e : std::filesystem::recursive_directory_iterator(dir)) {
+        if (e.path().filename() == name) {
+            return e.path();
+        }
+    }
+    throw std::runtime_error("Cell of '" + sid.to_string() + "' not found");
+}
+
+/**
+ * A batch whose writer has crashed after committing its journal is
+ * finished by the next apply() of a storage opened before the crash,
+ * and stays applied after reopening.
+ */
+static void test_batch_journal(const std::filesystem::path &dir)
+{
+    const auto path = dir / "files";
+    auto s = std::make_unique<file_storage>(path);
+    auto x = s->create({{"a", "1"}});
+    const auto sid = x->get_id();
+
+    // Leave the state of a crash right after the commit point: the new
+    // cell and the journal in the batch directory, no cell in place.
+    std::filesystem::create_directory(path / "batch");
+    std::filesystem::copy_file(find_cell(path, sid),
+                               path / "batch" / (sid.to_string() + ".txt"));
+    x->erase();
+    std::ofstream(path / "batch" / "journal") << "put " << sid << "\n";
+    CHECK(!s->exists(sid));
+
+    write_batch batch;
+    batch.create({{"b", "2"}});
+    s->apply(batch);
+    CHECK(s->exists(sid));
+    CHECK(s->get(sid)->get_attr("a") == "1");
+
+    s = std::make_unique<file_storage>(path);
+    CHECK(s->exists(sid));
+    CHECK(s->get(sid)->get_attr("a") == "1");
+    CHECK(!std::filesystem::exists(path / "batch"));
+}
+
+/**
+ * Batches of a writer process killed at random points are seen either
+ * whole or not at all by a process having the storage open, both before
+ * and after its next apply() and after reopening.
+ */
+static void test_batch_crash(const std::filesystem::path &dir)
+{
+    const auto path = dir / "files";
+    auto s = std::make_unique<file_storage>(path);
+
+    constexpr size_t count = 32;
+    std::vector<sepulca_id> ids;
+    for (size_t i = 0; i < count; ++i) {
+        ids.push_back(s->create({{"n", "0"}})->get_id());
+    }
+
+    auto check_whole = [&] {
+        const auto res = s->get_many(ids);
+        for (const auto &x : res) {
+            CHECK(x && x->get_attr("n") == res[0]->get_attr("n"));
+        }
+    };
+
+    std::mt19937_64 rnd(std::random_device{}());
+    for (int round = 0; round < 10; ++round) {
+        const auto pid = fork();
+        if (pid == -1) {
+            throw std::runtime_error(std::string("fork() failed: ") +
+                strerror(errno));
+        } else if (pid == 0) {
+            try {
+                file_storage w(path);
+                for (uint64_t n = 1;; ++n) {
+                    write_batch batch;
+                    for (const auto &sid : ids) {
+                        batch.put(sid, {{"n", std::to_string(n)}});
+                    }
+                    w.apply(batch);
+                }
+            } catch (...) {
+            }
+            _exit(1);
+        }
+
+        std::this_thread::sleep_for(std::chrono::microseconds(
+            1000 + rnd() % 20000));
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+
+        check_whole();
+        write_batch batch;
+        batch.create();
+        s->apply(batch);
+        check_whole();
+    }
+
+    s = std::make_unique<file_storage>(path);
+    check_whole();
+}
+
+/**
+ * Returns the segment files of a log storage, in order.
+ */
+static std::vector<std::filesystem::path> list_segments(
+    const std::filesystem::path &dir)
+{
+    std::vector<std::filesystem::path> res;
+    for (const auto &e : std::filesystem::directory_iterator(dir)) {
+        if (e.path().extension() == ".log") {
+            res.push_back(e.path());
+        }
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+/**
+ * Compaction of a log storage keeps the live sepulcas and their versions,
+ * reclaims the rest, and is seen by another storage object having the log
+ * open and after reopening.
+ */
+static void test_log_compaction(const std::filesystem::path &dir)
+{
+    const auto path = dir / "log";
+    log_storage_options opts;
+    opts.compaction_interval = std::chrono::milliseconds(0);
+    opts.max_segment_size = 64 * 1024;
+
+    log_storage s(path, opts);
+    const log_storage other(path, opts);
+    std::vector<sepulca_ptr> live;
+    for (int i = 0; i < 200; ++i) {
+        auto x = s.create({{"n", std::to_string(i)}});
+        for (int j = 0; j < 10; ++j) {
+            x->set_attr("v", std::string(100, 'a' + j));
+            x->commit();
+        }
+        if (i % 2 == 0) {
+            x->erase();
+        } else {
+            live.push_back(std::move(x));
+        }
+    }
+
+    auto check_live = [&](const storage &stor) {
+        size_t count = 0;
+        stor.enumerate_ids([&](const sepulca_id &) {
+            ++count;
+            return true;
+        });
+        CHECK(count == live.size());
+        for (const auto &x : live) {
+            const auto y = stor.get(x->get_id());
+            CHECK(y->get_version() == x->get_version());
+            CHECK(y->get_attrs() == x->get_attrs());
+        }
+    };
+
+    const auto segments = list_segments(path);
+    CHECK(segments.size() > 1);
+    check_live(other);
+
+    s.compact();
+    const auto compacted = list_segments(path);
+    CHECK(compacted.size() == 1 && compacted[0] > segments.back());
+    check_live(s);
+    check_live(other);
+
+    // Both objects keep appending to the compacted log.
+    live[0]->set_attr("after", "1");
+    live[0]->commit();
+    auto y = other.get(live[1]->get_id());
+    y->set_attr("after", "2");
+    y->commit();
+    live[1] = std::move(y);
+    check_live(s);
+    check_live(log_storage(path, opts));
+}
+
+/**
+ * A torn record left by a writer process killed while appending is
+ * dropped, and overwritten by the next append, also of a storage object
+ * having the log open.
+ */
+static void test_log_torn_tail(const std::filesystem::path &dir)
+{
+    const auto path = dir / "log";
+    log_storage_options opts;
+    opts.compaction_interval = std::chrono::milliseconds(0);
+
+    log_storage s(path, opts);
+    auto x = s.create({{"a", "1"}});
+    const auto segment = list_segments(path).back();
+    const auto valid = std::filesystem::file_size(segment);
+
+    // The header of a record larger than what follows it.
+    {
+        std::ofstream f(segment, std::ios::app | std::ios::binary);
+        const uint32_t hdr[4] = {SEPULCA_LOG_MAGIC, 1, 1 << 20, 0};
+        f.write(reinterpret_cast<const char *>(hdr), sizeof(hdr));
+        f << std::string(4096, 'x');
+    }
+
+    CHECK(log_storage(path, opts).get(x->get_id())->get_attr("a") == "1");
+    x->set_attr("a", "2");
+    x->commit();
+    CHECK(std::filesystem::file_size(segment) < valid + 4096);
+
+    log_storage reopened(path, opts);
+    auto y = reopened.get(x->get_id());
+    CHECK(y->get_attr("a") == "2" && y->get_version() == x->get_version());
+    y->set_attr("b", "3");
+    y->commit();
+    CHECK(s.get(x->get_id())->get_attr("b") == "3");
+}
+
+/**
+ * Returns the first bytes of a file.
+ */
+static std::string read_prefix(const std::filesystem::path &p, size_t size)
+{
+    std::string res(size, '\0');
+    std::ifstream(p, std::ios::binary).read(res.data(), res.size());
+    return res;
+}
+
+/**
+ * Cells of both formats are read alike, v1 cells with their change records
+ * are migrated to v2 keeping versions, and torn change records of v2 cells
+ * are ignored.
+ */
+static void test_cell_formats(const std::filesystem::path &dir)
+{
+    const auto path = dir / "files";
+    file_storage_options v1;
+    v1.format = cell_format::v1;
+
+    std::vector<std::pair<sepulca_id, uint64_t>> cells;
+    {
+        file_storage s(path, v1);
+        for (int i = 0; i < 10; ++i) {
+            auto x = s.create({{"n", std::to_string(i)}});
+            x->set_attr("m", "1");
+            x->commit();
+            cells.emplace_back(x->get_id(), x->get_version());
+        }
+    }
+    CHECK(read_prefix(find_cell(path, cells[0].first), 10) == SEPULCA_SIG);
+
+    auto check_cells = [&](const storage &s) {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            const auto x = s.get(cells[i].first);
+            CHECK(x->get_version() == cells[i].second);
+            CHECK(x->get_attr("n") == std::to_string(i));
+            CHECK(x->get_attr("m") == "1");
+        }
+    };
+
+    file_storage s(path);
+    check_cells(s);
+    CHECK(s.migrate() == cells.size());
+    CHECK(s.migrate() == 0);
+    check_cells(s);
+    CHECK(read_prefix(find_cell(path, cells[0].first), 8) ==
+          std::string(SEPULCA_MAGIC, 8));
+
+    // Names and values v1 cannot hold.
+    auto y = s.create({{"multi\nline", "a\nb"}, {"empty", ""}});
+    y->set_attr("c", "d");
+    y->commit();
+
+    std::ofstream(find_cell(path, y->get_id()), std::ios::app) << "torn";
+    CHECK(s.get(y->get_id())->get_attr("c") == "d");
+    y->set_attr("e", "f");
+    y->commit();
+
+    const file_storage reopened(path, v1);
+    check_cells(reopened);
+    const auto z = reopened.get(y->get_id());
+    CHECK(z->get_attr("multi\nline") == "a\nb" && z->has_attr("empty"));
+    CHECK(z->get_attr("c") == "d" && z->get_attr("e") == "f");
+    CHECK(z->get_version() == y->get_version());
+}
+
+/**
+ * Moves the cells of a file storage into the storage directory itself,
+ * as in the flat layout, leaving the layout markers as they are.
+ */
+static void flatten_cells(const std::filesystem::path &dir,
+                          const std::vector<sepulca_id> &ids)
+{
+    for (const auto &sid : ids) {
+        std::filesystem::rename(find_cell(dir, sid),
+                                dir / (sid.to_string() + ".txt"));
+    }
+}
+
+/**
+ * Storages with the flat layout are migrated to the sharded one in place,
+ * also by the next open if the migration has been interrupted. Handles
+ * opened before a migration keep reading and writing all cells.
+ */
+static void test_sharding(const std::filesystem::path &dir)
+{
+    const auto path = dir / "files";
+    std::vector<sepulca_id> ids;
+    {
+        file_storage s(path);
+        CHECK(s.is_sharded());
+        for (int i = 0; i < 20; ++i) {
+            ids.push_back(s.create({{"n", std::to_string(i)}})->get_id());
+        }
+    }
+
+    // A storage written before sharding: cells in the storage directory
+    // and no layout marker.
+    flatten_cells(path, ids);
+    std::filesystem::remove(path / "sharded");
+
+    auto check_cells = [&](const storage &s) {
+        for (size_t i = 0; i < ids.size(); ++i) {
+            CHECK(s.get(ids[i])->get_attr("n") == std::to_string(i));
+        }
+        size_t count = 0;
+        s.enumerate([&](sepulca_ptr) {
+            ++count;
+            return true;
+        });
+        CHECK(count == ids.size());
+    };
+
+    file_storage flat(path);
+    CHECK(!flat.is_sharded());
+    check_cells(flat);
+    const auto x = flat.create({{"n", std::to_string(ids.size())}});
+    ids.push_back(x->get_id());
+    CHECK(find_cell(path, x->get_id()).parent_path() == path);
+
+    file_storage other(path);
+    other.shard();
+    CHECK(flat.is_sharded());
+    for (const auto &sid : ids) {
+        CHECK(find_cell(path, sid).parent_path().parent_path().parent_path() ==
+              path);
+    }
+    check_cells(flat);
+
+    auto y = flat.get(ids[0]);
+    y->set_attr("m", "1");
+    y->commit();
+    CHECK(other.get(ids[0])->get_attr("m") == "1");
+    CHECK(find_cell(path, ids[0]).parent_path() != path);
+
+    // A migration interrupted half-way: the sharding marker is left
+    // instead of the sharded one, and some cells are still in the storage
+    // directory.
+    std::ofstream(path / "sharding").close();
+    std::filesystem::remove(path / "sharded");
+    flatten_cells(path, {ids.begin(), ids.begin() + ids.size() / 2});
+
+    const file_storage reopened(path);
+    CHECK(reopened.is_sharded());
+    CHECK(!std::filesystem::exists(path / "sharding"));
+    CHECK(std::filesystem::exists(path / "sharded"));
+    for (const auto &sid : ids) {
+        CHECK(find_cell(path, sid).parent_path() != path);
+    }
+    check_cells(reopened);
+    check_cells(flat);
+}
+
+/**
+ * Cached sepulcas are reloaded once another handle, possibly of another
+ * process, commits, erases or applies a batch to them.
+ */
+static void test_cache_coherence(const std::filesystem::path &dir)
+{
+    const auto path = dir / "files";
+    file_storage_options opts;
+    opts.cache_entries = 100;
+    file_storage a(path, opts);
+    file_storage b(path, opts);
+
+    const auto sid = a.create({{"n", "0"}})->get_id();
+    CHECK(a.get(sid)->get_attr("n") == "0");
+    CHECK(b.get(sid)->get_attr("n") == "0");
+
+    auto x = b.get(sid);
+    x->set_attr("n", "1");
+    x->commit();
+    CHECK(a.get(sid)->get_attr("n") == "1");
+    CHECK(a.get(sid)->get_version() == x->get_version());
+
+    write_batch batch;
+    batch.put(sid, {{"n", "2"}});
+    b.apply(batch);
+    CHECK(a.get(sid)->get_attr("n") == "2");
+
+    const auto pid = fork();
+    if (pid == -1) {
+        throw std::runtime_error(std::string("fork() failed: ") +
+            strerror(errno));
+    } else if (pid == 0) {
+        try {
+            file_storage c(path, opts);
+            auto y = c.get(sid);
+            y->set_attr("n", "3");
+            y->commit();
+        } catch (...) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(a.get(sid)->get_attr("n") == "3");
+    CHECK(b.get(sid)->get_attr("n") == "3");
+
+    b.get(sid)->erase();
+    CHECK(!a.exists(sid));
+    bool found = true;
+    try {
+        a.get(sid);
+    } catch (const std::exception &) {
+        found = false;
+    }
+    CHECK(!found);
+}
+
+/**
+ * Returns the number of entries of the attribute indexes of a file storage.
+ */
+static size_t count_index_entries(const std::filesystem::path &dir)
+{
+    size_t count = 0;
+    std::error_code ec;
+    for (const auto &e :
+         std::filesystem::recursive_directory_iterator(dir / "index", ec)) {
+        if (e.is_regular_file() && e.path().filename() != "ready") {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/**
+ * Indexes are built for existing sepulcas and kept up to date by creations,
+ * commits and erasures of any handle; dropped indexes leave no entries
+ * and finds fall back to a scan.
+ */
+static void test_indexes(const std::filesystem::path &dir)
+{
+    const auto path = dir / "files";
+    file_storage s(path);
+
+    auto find_ids = [&](const std::string &value) {
+        std::vector<sepulca_id> ids;
+        for (const auto &x : s.find("color", value)) {
+            ids.push_back(x->get_id());
+        }
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+    auto sorted = [](std::vector<sepulca_id> ids) {
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+
+    auto red = s.create({{"color", "red"}});
+    auto blue = s.create({{"color", "blue"}, {"shape", "round"}});
+    s.create({{"shape", "square"}});
+    s.create_index("color");
+    CHECK(s.get_indexes() == std::vector<std::string>{"color"});
+    CHECK(find_ids("red") == std::vector{red->get_id()});
+    CHECK(count_index_entries(path) == 2);
+
+    // Commits of whole sepulcas and of changes move entries.
+    blue->set_attr("color", "red");
+    blue->commit();
+    CHECK(find_ids("red") == sorted({red->get_id(), blue->get_id()}));
+    CHECK(find_ids("blue").empty());
+    CHECK(count_index_entries(path) == 2);
+
+    red->delete_attr("color");
+    red->commit();
+    CHECK(find_ids("red") == std::vector{blue->get_id()});
+    CHECK(count_index_entries(path) == 1);
+
+    blue->set_attr("shape", "flat");
+    blue->commit();
+    CHECK(find_ids("red") == std::vector{blue->get_id()});
+    CHECK(count_index_entries(path) == 1);
+
+    // Other handles find the index and maintain it as well.
+    file_storage other(path);
+    const auto green = other.create({{"color", "green"}})->get_id();
+    CHECK(find_ids("green") == std::vector{green});
+    CHECK(count_index_entries(path) == 2);
+
+    other.get(green)->erase();
+    CHECK(find_ids("green").empty());
+    blue->erase();
+    CHECK(find_ids("red").empty());
+    CHECK(count_index_entries(path) == 0);
+
+    s.create({{"color", "red"}});
+    CHECK(count_index_entries(path) == 1);
+    other.drop_index("color");
+    CHECK(s.get_indexes().empty());
+    CHECK(count_index_entries(path) == 0);
+    CHECK(find_ids("red").size() == 1);
+
+    bool dropped = false;
+    try {
+        s.drop_index("color");
+    } catch (const std::exception &) {
+        dropped = true;
+    }
+    CHECK(dropped);
+
+    // Sepulcas committed after the drop are found by a scan, and by
+    // the index once it is built again.
+    red->set_attr("color", "red");
+    red->commit();
+    CHECK(find_ids("red").size() == 2);
+    CHECK(count_index_entries(path) == 0);
+    s.create_index("color");
+    CHECK(find_ids("red").size() == 2);
+    CHECK(count_index_entries(path) == 2);
+}
+
+/**
+ * Stripes exclude writers of the same stripe, in any handle, but neither
+ * writers of other stripes nor readers of each other. Processes committing
+ * different sepulcas and the same one concurrently lose no updates.
+ */
+static void test_stripe_locks(const std::filesystem::path &dir)
+{
+    striped_file_lock a(dir / "lock.txt", 8);
+    striped_file_lock b(dir / "lock.txt", 8);
+
+    // Locks another handle's stripe in a thread, returning whether it has
+    // been acquired before the given stripe of `a` is released.
+    auto contends = [&](size_t stripe, bool shared,
+                        striped_file_lock::stripe &held) {
+        std::atomic<bool> acquired = false;
+        std::thread t([&] {
+            auto &other = b.get_stripe(stripe);
+            if (shared) {
+                std::shared_lock guard(other);
+                acquired = true;
+            } else {
+                std::lock_guard guard(other);
+                acquired = true;
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const bool blocked = !acquired;
+        held.unlock();
+        t.join();
+        CHECK(acquired);
+        return blocked;
+    };
+
+    a.get_stripe(3).lock();
+    CHECK(!contends(4, false, a.get_stripe(3)));
+    a.get_stripe(3).lock();
+    CHECK(contends(3, false, a.get_stripe(3)));
+    a.get_stripe(3).lock();
+    CHECK(contends(3, true, a.get_stripe(3)));
+
+    auto &shared = a.get_stripe(5);
+    shared.lock_shared();
+    {
+        std::shared_lock guard(b.get_stripe(5));
+    }
+    shared.unlock_shared();
+
+    const auto path = dir / "files";
+    file_storage s(path);
+    constexpr int processes = 4;
+    constexpr int increments = 50;
+    const auto common = s.create({{"n", "0"}})->get_id();
+    std::vector<sepulca_id> own;
+    for (int p = 0; p < processes; ++p) {
+        own.push_back(s.create({{"n", "0"}})->get_id());
+    }
+
+    std::vector<pid_t> pids;
+    for (int p = 0; p < processes; ++p) {
+        const auto pid = fork();
+        if (pid == -1) {
+            throw std::runtime_error(std::string("fork() failed: ") +
+                strerror(errno));
+        } else if (pid == 0) {
+            try {
+                file_storage w(path);
+                for (int i = 0; i < increments; ++i) {
+                    auto x = w.get(own[p]);
+                    x->set_attr("n", std::to_string(i + 1));
+                    x->commit();
+                    for (;;) {
+                        auto c = w.get(common);
+                        const auto n = std::stoi(c->get_attr("n"));
+                        c->set_attr("n", std::to_string(n + 1));
+                        if (c->commit_if(c->get_version())) {
+                            break;
+                        }
+                    }
+                }
+            } catch (...) {
+                _exit(1);
+            }
+            _exit(0);
+        }
+        pids.push_back(pid);
+    }
+
+    for (const auto pid : pids) {
+        int status;
+        waitpid(pid, &status, 0);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    for (const auto &sid : own) {
+        CHECK(s.get(sid)->get_attr("n") == std::to_string(increments));
+    }
+    CHECK(s.get(common)->get_attr("n") ==
+          std::to_string(processes * increments));
+}
+
+/**
+ * Memory storages saved to a snapshot, explicitly or when destroyed, are
+ * loaded back with the same sepulcas, attributes and versions; a corrupted
+ * snapshot fails to load.
+ */
+static void test_memory_snapshot(const std::filesystem::path &dir)
+{
+    memory_storage_options opts;
+    opts.snapshot = dir / "snapshot.ndjson";
+
+    std::map<sepulca_id, std::pair<attributes, uint64_t>> expected;
+    auto check_loaded = [&] {
+        const memory_storage s(opts);
+        size_t count = 0;
+        s.enumerate([&](sepulca_ptr x) {
+            ++count;
+            auto i = expected.find(x->get_id());
+            CHECK(i != expected.end());
+            CHECK(x->get_attrs() == i->second.first);
+            CHECK(x->get_version() == i->second.second);
+            return true;
+        });
+        CHECK(count == expected.size());
+    };
+
+    sepulca_id erased;
+    {
+        memory_storage s(opts);
+        auto x = s.create({{"plain", "value"}, {"empty", ""}});
+        x->set_attr("quoted \"name\"", "back\\slash\nnew line\ttab");
+        x->commit();
+        auto y = s.create({{"utf-8", "\xd0\xbc\xd0\xb8\xd1\x80"}});
+        auto z = s.create();
+        erased = s.create({{"gone", "1"}})->get_id();
+        s.get(erased)->erase();
+        for (const auto *v : {&x, &y, &z}) {
+            expected[(*v)->get_id()] = {(*v)->get_attrs(),
+                                        (*v)->get_version()};
+        }
+        s.save();
+        CHECK(!std::filesystem::exists(dir / "snapshot.ndjson.tmp"));
+    }
+    check_loaded();
+
+    // Changes after a load are saved when the storage is destroyed.
+    {
+        memory_storage s(opts);
+        CHECK(!s.exists(erased));
+        auto x = s.get(expected.begin()->first);
+        x->set_attr("plain", "changed");
+        x->commit();
+        expected[x->get_id()] = {x->get_attrs(), x->get_version()};
+    }
+    check_loaded();
+
+    std::ofstream(opts.snapshot, std::ios::app) << "{not json\n";
+    bool failed = false;
+    try {
+        memory_storage s(opts);
+    } catch (const std::exception &) {
+        failed = true;
+    }
+    CHECK(failed);
+}
+
+/**
+ * Returns the temporary cell files in a file storage directory.
+ */
+static std::vector<std::filesystem::path> find_temp_cells(
+    const std::filesystem::path &dir)
+{
+    std::vector<std::filesystem::path> res;
+    for (const auto &e : std::filesystem::recursive_directory_iterator(dir)) {
+        if (e.path().extension() == ".tmp") {
+            res.push_back(e.path());
+        }
+    }
+    return res;
+}
+
+/**
+ * Temporary cells left by writer processes killed while writing them are
+ * removed by the next exclusive operation of a storage opened before the
+ * crash, or when the storage is opened.
+ */
+static void test_temp_cells(const std::filesystem::path &dir)
+{
+    const auto path = dir / "files";
+    auto s = std::make_unique<file_storage>(path);
+
+    // Large cells make the writer likely to be killed between writing
+    // a temporary cell and renaming it.
+    const std::string value(1 << 20, 'x');
+    std::mt19937_64 rnd(std::random_device{}());
+    for (int round = 0; round < 200; ++round) {
+        const auto pid = fork();
+        if (pid == -1) {
+            throw std::runtime_error(std::string("fork() failed: ") +
+                strerror(errno));
+        } else if (pid == 0) {
+            try {
+                file_storage w(path);
+                for (;;) {
+                    w.create({{"a", value}})->erase();
+                }
+            } catch (...) {
+            }
+            _exit(1);
+        }
+
+        std::this_thread::sleep_for(std::chrono::microseconds(
+            1000 + rnd() % 5000));
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        if (find_temp_cells(path).empty()) {
+            continue;
+        }
+
+        if (round % 2 == 0) {
+            write_batch batch;
+            batch.create();
+            s->apply(batch);
+        } else {
+            s = std::make_unique<file_storage>(path);
+        }
+        CHECK(find_temp_cells(path).empty());
+        return;
+    }
+    throw std::runtime_error("No temporary cell left by killed writers");
+}
+
+/**
+ * Synced writes of all kinds are seen after reopening, and a write failing
+ * after its temporary cell has been written leaves no temporary cell.
+ */
+static void test_sync_writes(const std::filesystem::path &dir)
+{
+    const auto path = dir / "files";
+    file_storage_options opts;
+    opts.durability = file_durability::sync;
+
+    sepulca_id kept, erased, put;
+    {
+        file_storage s(path, opts);
+        auto x = s.create({{"a", "1"}});
+        x->set_attr("b", "2");
+        x->commit();
+        kept = x->get_id();
+        erased = s.create()->get_id();
+        s.get(erased)->erase();
+
+        put = s.create()->get_id();
+        write_batch batch;
+        batch.put(put, {{"c", "3"}});
+        s.apply(batch);
+    }
+
+    file_storage s(path, opts);
+    CHECK(s.get(kept)->get_attr("b") == "2");
+    CHECK(!s.exists(erased));
+    CHECK(s.get(put)->get_attr("c") == "3");
+
+    // A file size limit makes the write fail half-way through.
+    rlimit old_limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    rlimit limit = old_limit;
+    limit.rlim_cur = 1 << 16;
+    const auto old_handler = signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    bool failed = false;
+    try {
+        s.create({{"big", std::string(1 << 20, 'x')}});
+    } catch (const std::exception &) {
+        failed = true;
+    }
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+    CHECK(failed);
+    CHECK(find_temp_cells(path).empty());
+}
+
+/**
+ * The io_uring reader reads whole files of any size and leaves missing
+ * ones empty, if the kernel supports the operations it uses.
+ */
+static void test_io_uring_reader(const std::filesystem::path &dir)
+{
+    std::unique_ptr<io_uring_reader> reader;
+    try {
+        reader = std::make_unique<io_uring_reader>(4);
+    } catch (const std::exception &err) {
+        std::cout << "io_uring is not available: " << err.what()
+            << std::endl;
+        return;
+    }
+
+    std::vector<std::filesystem::path> paths;
+    std::vector<std::string> expected;
+    for (size_t size : {0, 1, 4096, 100000}) {
+        paths.push_back(dir / std::to_string(size));
+        expected.emplace_back(size, 'x');
+        std::ofstream(paths.back()) << expected.back();
+    }
+    paths.push_back(dir / "missing");
+
+    // More files than the ring holds are read at once.
+    const auto files = paths;
+    for (int i = 0; i < 3; ++i) {
+        paths.insert(paths.end(), files.begin(), files.end());
+    }
+
+    std::vector<std::optional<std::string>> res;
+    reader->read_files(paths, res);
+    CHECK(res.size() == paths.size());
+    for (size_t i = 0; i < res.size(); ++i) {
+        if (i % 5 == 4) {
+            CHECK(!res[i]);
+        } else {
+            CHECK(res[i] && *res[i] == expected[i % 5]);
+        }
+    }
+}
+
+/**
+ * Serves a storage on a socket from a thread, while in scope.
+ */
+class serving
+{
+public:
+    serving(storage &stor, const std::filesystem::path &socket) :
+        m_server(stor, socket),
+        m_thread([this] { m_server.run(); })
+    {
+    }
+
+    ~serving()
+    {
+        m_server.stop();
+        m_thread.join();
+    }
+
+private:
+    storage_server m_server;
+    std::thread m_thread;
+};
+
+/**
+ * Calls the function for a fresh storage of every kind, for a file storage
+ * rewriting cells in place, and for a memory storage served through
+ * a socket.
+ */
+static void for_each_storage(const std::filesystem::path &dir,
+                             const std::function<void(storage &)> &fn)
+{
+    {
+        file_storage s(dir / "files");
+        fn(s);
+    }
+    {
+        file_storage_options opts;
+        opts.durability = file_durability::none;
+        file_storage s(dir / "files_in_place", opts);
+        fn(s);
+    }
+    {
+        log_storage s(dir / "log");
+        fn(s);
+    }
+    {
+        memory_storage s;
+        fn(s);
+    }
+    {
+        memory_storage served;
+        serving server(served, dir / "socket");
+        remote_storage s(dir / "socket");
+        fn(s);
+    }
+}
+
+/**
+ * Callbacks of enumerations and visits may commit and erase sepulcas
+ * of the storage being enumerated.
+ */
+static void test_enumerate_reentry(const std::filesystem::path &dir)
+{
+    for_each_storage(dir, [](storage &s) {
+        std::vector<sepulca_id> ids;
+        for (int i = 0; i < 3; ++i) {
+            ids.push_back(s.create({{"n", std::to_string(i)}})->get_id());
+        }
+
+        s.enumerate([&](sepulca_ptr x) {
+            x->set_attr("a", "1");
+            x->commit();
+            return true;
+        });
+
+        enumerate_options opts;
+        opts.ordered = true;
+        s.parallel_enumerate([&](sepulca_ptr x) {
+            x->set_attr("b", "2");
+            x->commit();
+            return true;
+        }, opts);
+
+        // The view stays valid while the callback rewrites the sepulca.
+        s.visit(ids[0], [&](const sepulca_view &view) {
+            auto x = s.get(view.get_id());
+            x->set_attr("c", "3");
+            x->commit();
+            CHECK(view.get_attr("a") == "1" && !view.has_attr("c"));
+        });
+
+        size_t count = 0;
+        s.enumerate_views([&](const sepulca_view &view) {
+            auto x = s.get(view.get_id());
+            CHECK(x->get_attr("a") == "1" && x->get_attr("b") == "2");
+            count += x->has_attr("c");
+            x->erase();
+            return true;
+        });
+        CHECK(count == 1);
+
+        s.enumerate_ids([&](const sepulca_id &) {
+            CHECK(false);
+            return true;
+        });
+    });
+}
+
+/**
+ * Sepulcas committed by a batch get the new versions and no uncommitted
+ * changes, as after sepulca::commit().
+ */
+static void test_batch_versions(const std::filesystem::path &dir)
+{
+    for_each_storage(dir, [](storage &s) {
+        auto x = s.create({{"a", "1"}});
+        auto y = s.create();
+        x->set_attr("a", "2");
+        y->set_attr("b", "3");
+
+        write_batch batch;
+        batch.commit(*x);
+        batch.commit(*y);
+        batch.erase(y->get_id());
+        s.apply(batch);
+
+        CHECK(!x->is_dirty());
+        CHECK(x->get_version() > 1);
+        CHECK(x->get_version() == s.get(x->get_id())->get_version());
+        CHECK(x->commit_if(x->get_version()));
+        CHECK(x->get_version() == s.get(x->get_id())->get_version());
+
+        // A sepulca erased later in the batch is written whole by its
+        // next commit.
+        CHECK(y->is_dirty() && !s.exists(y->get_id()));
+        y->commit();
+        CHECK(s.get(y->get_id())->get_attr("b") == "3");
+
+        // The new version exceeds the version of the sepulca object,
+        // even if the sepulca is not stored.
+        x->erase();
+        const auto erased = x->get_version();
+        batch.clear();
+        batch.commit(*x);
+        s.apply(batch);
+        CHECK(x->get_version() > erased);
+        CHECK(x->get_version() == s.get(x->get_id())->get_version());
+        CHECK(s.get(x->get_id())->get_attr("a") == "2");
+    });
+}
+
+/**
+ * Compare-and-commit fails if the sepulca has been committed or erased
+ * since the expected version, so that concurrent read-modify-write cycles
+ * retried on failure lose no updates.
+ */
+static void test_commit_if(const std::filesystem::path &dir)
+{
+    for_each_storage(dir, [](storage &s) {
+        auto x = s.create({{"n", "0"}});
+        auto y = s.get(x->get_id());
+        CHECK(x->get_version() == y->get_version());
+
+        x->set_attr("n", "1");
+        CHECK(x->commit_if(x->get_version()));
+        y->set_attr("n", "2");
+        CHECK(!y->commit_if(y->get_version()));
+        CHECK(y->is_dirty());
+        CHECK(s.get(x->get_id())->get_attr("n") == "1");
+
+        // A successful commit confirms the reads even without changes.
+        y = s.get(x->get_id());
+        const auto read = y->get_version();
+        CHECK(y->commit_if(read) && y->get_version() > read);
+        CHECK(!x->commit_if(x->get_version()));
+
+        s.get(x->get_id())->erase();
+        CHECK(!y->commit_if(y->get_version()));
+        CHECK(!s.exists(x->get_id()));
+
+        // Changes merged with another writer's are handed back, so that
+        // every holder of a version sees the same attributes.
+        auto a = s.create({{"n", "0"}});
+        auto b = s.get(a->get_id());
+        a->set_attr("p", "1");
+        a->commit();
+        b->set_attr("q", "2");
+        b->commit();
+        CHECK(b->get_attrs() == s.get(a->get_id())->get_attrs());
+        CHECK(!a->commit_if(a->get_version()));
+        a = s.get(a->get_id());
+        CHECK(a->commit_if(a->get_version()));
+        CHECK(a->get_attrs() == b->get_attrs());
+        CHECK(a->get_attrs() == s.get(a->get_id())->get_attrs());
+
+        // Increments of concurrent threads retrying on conflicts.
+        constexpr int threads = 4;
+        constexpr int increments = 50;
+        const auto sid = s.create({{"n", "0"}})->get_id();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&] {
+                for (int i = 0; i < increments; ++i) {
+                    for (;;) {
+                        auto c = s.get(sid);
+                        const auto n = std::stoi(c->get_attr("n"));
+                        c->set_attr("n", std::to_string(n + 1));
+                        if (c->commit_if(c->get_version())) {
+                            break;
+                        }
+                    }
+                }
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+        CHECK(s.get(sid)->get_attr("n") ==
+              std::to_string(threads * increments));
+    });
+}
+
+/**
+ * Scans return every sepulca once in identifier order, whatever the batch
+ * size, and resume after identifiers erased meanwhile.
+ */
+static void test_scan(const std::filesystem::path &dir)
+{
+    for_each_storage(dir, [](storage &s) {
+        std::vector<sepulca_id> ids;
+        for (int i = 0; i < 100; ++i) {
+            ids.push_back(s.create({{"n", std::to_string(i)}})->get_id());
+        }
+        std::sort(ids.begin(), ids.end());
+
+        auto scan_all = [&](size_t limit) {
+            std::vector<sepulca_id> res;
+            std::optional<sepulca_id> next;
+            do {
+                auto batch = s.scan(next, limit);
+                CHECK(batch.sepulcas.size() <= limit);
+                for (const auto &x : batch.sepulcas) {
+                    res.push_back(x->get_id());
+                }
+                CHECK(!batch.next || *batch.next == res.back());
+                next = batch.next;
+            } while (next);
+            return res;
+        };
+
+        for (size_t limit : {1, 7, 100, 1000}) {
+            CHECK(scan_all(limit) == ids);
+        }
+
+        // Resuming after an erased identifier, and skipping the ones
+        // erased during the scan.
+        auto batch = s.scan(std::nullopt, 10);
+        CHECK(batch.next == ids[9]);
+        s.get(ids[9])->erase();
+        s.get(ids[10])->erase();
+        batch = s.scan(batch.next, 10);
+        CHECK(batch.sepulcas.size() == 10);
+        CHECK(batch.sepulcas.front()->get_id() == ids[11]);
+
+        ids.erase(ids.begin() + 9, ids.begin() + 11);
+        CHECK(scan_all(13) == ids);
+        CHECK(s.scan(ids.back(), 10).sepulcas.empty());
+
+        try {
+            s.scan(std::nullopt, 0);
+            CHECK(false);
+        } catch (const std::runtime_error &) {
+        }
+    });
+}
+
+/**
+ * Sepulcas erased concurrently with the default get_many() are returned
+ * as null.
+ */
+static void test_get_many_erased(const std::filesystem::path &)
+{
+    // Erases every sepulca right before loading it, and cannot overlap
+    // loads, so that the default get_many() loads one by one.
+    class erasing_storage : public memory_storage
+    {
+    public:
+        virtual sepulca_ptr get(const sepulca_id &sid) const override
+        {
+            if (memory_storage::exists(sid)) {
+                memory_storage::get(sid)->erase();
+            }
+            return memory_storage::get(sid);
+        }
+
+        virtual bool load_many(std::span<const sepulca_id>,
+                               std::vector<sepulca_ptr> &) const override
+        {
+            return false;
+        }
+    };
+
+    erasing_storage s;
+    const std::vector<sepulca_id> ids = {s.create()->get_id(),
+                                         s.create()->get_id()};
+    const auto res = s.get_many(ids);
+    CHECK(res.size() == 2 && !res[0] && !res[1]);
+}
+
+/**
+ * Connects to a storage server socket.
+ */
+static int connect_socket(const std::filesystem::path &path)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK(fd != -1 && connect(fd, reinterpret_cast<const sockaddr *>(&addr),
+                              sizeof(addr)) == 0);
+    return fd;
+}
+
+/**
+ * Sends a request frame to a storage server and returns the reply frame.
+ */
+static std::string call(int fd, const std::string &req)
+{
+    CHECK(send(fd, req.data(), req.size(), MSG_NOSIGNAL) ==
+          static_cast<ssize_t>(req.size()));
+
+    std::string reply;
+    char buf[4096];
+    while (get_frame_size(reply) == 0) {
+        const auto n = recv(fd, buf, sizeof(buf), 0);
+        CHECK(n > 0);
+        reply.append(buf, n);
+    }
+    return reply;
+}
+
+/**
+ * The server interns a bounded number of attribute names sent by clients,
+ * and rejects requests with further new names.
+ */
+static void test_server_names(const std::filesystem::path &dir)
+{
+    memory_storage stor;
+    serving server(stor, dir / "socket");
+    const int fd = connect_socket(dir / "socket");
+
+    // Names are sent raw, as attributes would intern them in this process.
+    auto create = [&](const std::vector<std::string> &names) {
+        std::string req;
+        frame_writer w(req, 1, static_cast<uint8_t>(storage_op::create));
+        w.put_u32(static_cast<uint32_t>(names.size()));
+        for (const auto &name : names) {
+            w.put_string(name);
+            w.put_string("v");
+        }
+        w.finish();
+
+        const auto reply = call(fd, req);
+        return frame_reader(reply).get_code() ==
+            static_cast<uint8_t>(reply_status::ok);
+    };
+
+    // Attributes are sent in order, as by clients.
+    std::vector<std::string> names;
+    for (size_t i = 0; i <= 1 << 16; ++i) {
+        char name[32];
+        snprintf(name, sizeof(name), "server_names_%06zu", i);
+        names.push_back(name);
+    }
+    CHECK(!create(names));
+    CHECK(!is_attribute_name_interned(names.back()));
+    CHECK(!create({"server_names_new"}));
+    CHECK(!is_attribute_name_interned("server_names_new"));
+
+    // Names interned already are accepted.
+    CHECK(create({names.front()}));
+    close(fd);
+}
+
+/**
+ * Identifier filters report added identifiers, and a filter written before
+ * the last boot, which may have lost bits, is not trusted by storages.
+ */
+static void test_id_filter(const std::filesystem::path &dir)
+{
+    if (!id_filter::is_supported()) {
+        CHECK(!id_filter(dir / "missing.bloom"));
+        return;
+    }
+
+    std::vector<sepulca_id> ids;
+    for (uint64_t i = 1; i <= 1000; ++i) {
+        ids.emplace_back(i * 0x9e3779b97f4a7c15);
+    }
+    {
+        id_filter filter(dir / "ids.bloom", ids.size());
+        for (const auto &sid : ids) {
+            filter.add(sid);
+        }
+    }
+    id_filter filter(dir / "ids.bloom");
+    CHECK(filter && !filter.is_stale());
+    CHECK(std::all_of(ids.begin(), ids.end(), [&](const sepulca_id &sid) {
+        return filter.may_contain(sid);
+    }));
+
+    const auto path = dir / "files";
+    std::vector<sepulca_id> stored;
+    {
+        file_storage s(path);
+        for (int i = 0; i < 100; ++i) {
+            stored.push_back(s.create()->get_id());
+        }
+        CHECK(s.exists(stored.front()));
+    }
+
+    // Clear the bits and the boot identifier, as after a crash of the
+    // system losing the filter pages.
+    const auto size = std::filesystem::file_size(path / "ids.bloom");
+    {
+        std::fstream f(path / "ids.bloom",
+                       std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(32);
+        f << std::string(32, 'f') << std::string(size - 64, '\0');
+    }
+    CHECK(!id_filter(path / "ids.bloom"));
+
+    file_storage s(path);
+    CHECK(std::all_of(stored.begin(), stored.end(),
+                      [&](const sepulca_id &sid) { return s.exists(sid); }));
+    CHECK(std::ranges::all_of(s.exists_many(stored), std::identity()));
+}
+
+/**
+ * Remote storages forward operations and their errors, and the server
+ * answers malformed and pipelined requests in order without dropping
+ * the connection.
+ */
+static void test_server_protocol(const std::filesystem::path &dir)
+{
+    file_storage stor(dir / "files");
+    serving server(stor, dir / "socket");
+    {
+        remote_storage s(dir / "socket");
+        auto x = s.create({{"a", "1"}});
+        auto y = s.create({{"a", "2"}});
+        const sepulca_id missing(1);
+
+        try {
+            s.get(missing);
+            CHECK(false);
+        } catch (const std::runtime_error &err) {
+            CHECK(strstr(err.what(), "not found"));
+        }
+
+        const std::vector<sepulca_id> ids = {y->get_id(), missing,
+                                             x->get_id()};
+        const auto res = s.get_many(ids);
+        CHECK(res.size() == 3 && res[0] && !res[1] && res[2]);
+        CHECK(res[0]->get_attr("a") == "2" && res[2]->get_attr("a") == "1");
+        CHECK(s.exists_many(ids) == std::vector<bool>({true, false, true}));
+
+        s.create_index("a");
+        const auto found = s.find("a", "2");
+        CHECK(found.size() == 1 && found[0]->get_id() == y->get_id());
+
+        // Changes are sent by name, and the server sees them.
+        x->set_attr("b", "3");
+        x->commit();
+        CHECK(stor.get(x->get_id())->get_attr("b") == "3");
+        x->erase();
+        CHECK(!stor.exists(x->get_id()));
+    }
+
+    const int fd = connect_socket(dir / "socket");
+    auto status = [](const std::string &reply) {
+        return static_cast<reply_status>(frame_reader(reply).get_code());
+    };
+
+    // An unknown operation and a truncated request fail alone.
+    std::string req;
+    frame_writer(req, 7, 0xff).finish();
+    auto reply = call(fd, req);
+    CHECK(frame_reader(reply).get_tag() == 7);
+    CHECK(status(reply) == reply_status::error);
+
+    req.clear();
+    frame_writer(req, 8, static_cast<uint8_t>(storage_op::get)).finish();
+    reply = call(fd, req);
+    CHECK(frame_reader(reply).get_tag() == 8);
+    CHECK(status(reply) == reply_status::error);
+
+    // Pipelined requests are answered in order.
+    req.clear();
+    for (uint32_t tag = 10; tag < 13; ++tag) {
+        frame_writer w(req, tag, static_cast<uint8_t>(storage_op::exists));
+        w.put_id(sepulca_id(tag));
+        w.finish();
+    }
+    reply = call(fd, req);
+    for (uint32_t tag = 10; tag < 13; ++tag) {
+        char buf[4096];
+        while (get_frame_size(reply) == 0) {
+            const auto n = recv(fd, buf, sizeof(buf), 0);
+            CHECK(n > 0);
+            reply.append(buf, n);
+        }
+        const auto size = get_frame_size(reply);
+        frame_reader r(std::string_view(reply).substr(0, size));
+        CHECK(r.get_tag() == tag && status(reply) == reply_status::ok);
+        CHECK(r.get_u8() == 0 && r.empty());
+        reply.erase(0, size);
+    }
+    close(fd);
+}
+
+/**
+ * Sepulca lines are parsed back into the same identifiers, versions and
+ * attributes, whatever bytes these hold, and malformed lines are rejected.
+ */
+static void test_ndjson(const std::filesystem::path &)
+{
+    std::string text;
+    for (int c = 0; c < 256; ++c) {
+        text += static_cast<char>(c);
+    }
+
+    memory_storage s;
+    const auto x = s.create({{"plain", "value"}, {"bytes", text},
+                             {text, "name"}, {"empty", ""}});
+    std::string line;
+    write_ndjson(*x, line);
+    CHECK(line.back() == '\n');
+    CHECK(std::count(line.begin(), line.end(), '\n') == 1);
+    line.pop_back();
+
+    ndjson_parser parser;
+    sepulca_id sid;
+    attributes attrs;
+    uint64_t version;
+    parser.parse(line, sid, attrs, &version);
+    CHECK(sid == x->get_id() && version == x->get_version());
+    CHECK(attrs == x->get_attrs());
+
+    parser.parse(R"( {"attrs":{"a":"\u0041\t"}} )", sid, attrs, &version);
+    CHECK(sid == sepulca_id() && version == 0);
+    CHECK(attrs.size() == 1 && attrs.find("a")->second == "A\t");
+
+    for (const char *bad : {"", "{", R"({"attrs":{"a":1}})",
+                            R"({"attrs":{"a":"1","a":"2"}})",
+                            R"({"id":"nope"})", R"({"other":""})",
+                            R"({"attrs":{}} x)"}) {
+        try {
+            parser.parse(bad, sid, attrs);
+            CHECK(false);
+        } catch (const std::runtime_error &err) {
+            CHECK(strstr(err.what(), "check failed") == nullptr);
+        }
+    }
+}
+
+struct test
+{
+    const char *name;
+    void (*run)(const std::filesystem::path &dir);
+};
+
+static const test tests[] = {
+    {"attributes", test_attributes},
+    {"batch_journal", test_batch_journal},
+    {"batch_crash", test_batch_crash},
+    {"batch_versions", test_batch_versions},
+    {"cache_coherence", test_cache_coherence},
+    {"cell_formats", test_cell_formats},
+    {"commit_if", test_commit_if},
+    {"enumerate_reentry", test_enumerate_reentry},
+    {"get_many_erased", test_get_many_erased},
+    {"id_filter", test_id_filter},
+    {"indexes", test_indexes},
+    {"io_uring_reader", test_io_uring_reader},
+    {"log_compaction", test_log_compaction},
+    {"log_torn_tail", test_log_torn_tail},
+    {"memory_snapshot", test_memory_snapshot},
+    {"ndjson", test_ndjson},
+    {"scan", test_scan},
+    {"stripe_locks", test_stripe_locks},
+    {"sync_writes", test_sync_writes},
+    {"temp_cells", test_temp_cells},
+    {"server_names", test_server_names},
+    {"server_protocol", test_server_protocol},
+    {"sharding", test_sharding},
+};
+
+static bool run_test(const test &t)
+{
+    char tmpl[] = "/tmp/sepulcas_test_XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        std::cerr << t.name << ": failed to create directory: "
+            << strerror(errno) << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    try {
+        t.run(tmpl);
+        std::cout << t.name << ": ok" << std::endl;
+    } catch (const std::exception &err) {
+        std::cerr << t.name << ": " << err.what() << std::endl;
+        ok = false;
+    }
+    std::filesystem::remove_all(tmpl);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    bool ok = true;
+    if (argc < 2) {
+        for (const auto &t : tests) {
+            ok = run_test(t) && ok;
+        }
+        return ok ? 0 : 1;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        auto t = std::find_if(std::begin(tests), std::end(tests),
+                              [&](const test &t) {
+                                  return strcmp(t.name, argv[i]) == 0;
+                              });
+        if (t == std::end(tests)) {
+            std::cerr << "Unknown test '" << argv[i] << "'" << std::endl;
+            return 1;
+        }
+        ok = run_test(*t) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+/******************************************************************************
+ *
+ * This file is part of the Sepulca distribution.
+ *
+ * Copyright (C) 2021 Dmitry Savitskiy.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ ******************************************************************************/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace cosmica
+{
+
+/**
+ * A fixed-size pool of worker threads executing submitted tasks
+ * in the submission order.
+ */
+class thread_pool
+{
+public:
+    /**
+     * Starts the given number of worker threads.
+     * Zero means the number of hardware threads.
+     */
+    explicit thread_pool(size_t threads = 0)
+    {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        m_threads.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            m_threads.emplace_back([this] { worker_loop(); });
+        }
+    }
+
+    // Disable copy and move of thread pools.
+    thread_pool(const thread_pool &) = delete;
+    thread_pool(thread_pool &&) = delete;
+
+    /**
+     * Finishes all submitted tasks and stops the worker threads.
+     */
+    ~thread_pool()
+    {
+        {
+            std::lock_guard guard(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+
+        for (auto &t : m_threads) {
+            t.join();
+        }
+    }
+
+    /**
+     * Submits a task, returning the future of its result.
+     */
+    template<typename F>
+    auto submit(F &&f) -> std::future<std::invoke_result_t<F>>
+    {
+        using result = std::invoke_result_t<F>;
+
+        auto task = std::make_shared<std::packaged_task<result()>>(
+            std::forward<F>(f));
+        auto res = task->get_future();
+        {
+            std::lock_guard guard(m_mutex);
+            m_tasks.emplace_back([task] { (*task)(); });
+        }
+        m_cv.notify_one();
+        return res;
+    }
+
+    /**
+     * Returns the number of worker threads.
+     */
+    size_t size() const noexcept {
+        return m_threads.size();
+    }
+
+private:
+    void worker_loop()
+    {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock guard(m_mutex);
+                m_cv.wait(guard, [this] { return m_stop || !m_tasks.empty(); });
+                if (m_tasks.empty()) {
+                    return;
+                }
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_stop = false;
+};
+
+/**
+ * Runs produce(i) for every i in [0, count) on the pool's threads and passes
+ * the results to consume(), which stops the processing by returning false.
+ *
+ * If ordered, consume() is called on the calling thread in the index order,
+ * and workers run at most `window` results ahead of it. Otherwise consume()
+ * is called on the worker threads as soon as results are ready and must be
+ * thread-safe.
+ *
+ * The first exception thrown by produce() or consume() stops the processing
+ * and is rethrown to the caller.
+ */
+template<typename T>
+void parallel_produce(thread_pool &pool, size_t count,
+                      const std::function<T(size_t)> &produce,
+                      const std::function<bool(T)> &consume,
+                      bool ordered, size_t window = 1024)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Ordered results pending delivery; result i is kept in slot
+    // i % window, which is free once result i - window is delivered.
+    std::vector<std::optional<T>> slots(ordered ? std::min(count, window) : 0);
+    size_t delivered = 0;
+    std::atomic<size_t> next = 0;
+    std::atomic<bool> stop = false;
+    std::exception_ptr error;
+
+    auto fail = [&](std::exception_ptr e) {
+        {
+            std::lock_guard guard(mutex);
+            if (!error) {
+                error = e;
+            }
+            stop = true;
+        }
+        cv.notify_all();
+    };
+
+    auto worker = [&] {
+        try {
+            for (;;) {
+                const size_t i = next++;
+                if (i >= count || stop) {
+                    return;
+                }
+
+                if (!ordered) {
+                    if (!consume(produce(i))) {
+                        stop = true;
+                    }
+                    continue;
+                }
+
+                {
+                    std::unique_lock guard(mutex);
+                    cv.wait(guard, [&] { return stop || i < delivered + window; });
+                    if (stop) {
+                        return;
+                    }
+                }
+
+                auto res = produce(i);
+                {
+                    std::lock_guard guard(mutex);
+                    slots[i % window].emplace(std::move(res));
+                }
+                cv.notify_all();
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    };
+
+    std::vector<std::future<void>> workers;
+    const size_t threads = std::min(pool.size(), std::max<size_t>(count, 1));
+    for (size_t t = 0; t < threads; ++t) {
+        workers.push_back(pool.submit(worker));
+    }
+
+    if (ordered) {
+        try {
+            for (size_t i = 0; i < count; ++i) {
+                std::optional<T> res;
+                {
+                    std::unique_lock guard(mutex);
+                    auto &slot = slots[i % window];
+                    cv.wait(guard, [&] { return stop || slot.has_value(); });
+                    if (stop) {
+                        break;
+                    }
+                    res = std::move(slot);
+                    slot.reset();
+                    delivered = i + 1;
+                }
+                cv.notify_all();
+
+                if (!consume(std::move(*res))) {
+                    {
+                        std::lock_guard guard(mutex);
+                        stop = true;
+                    }
+                    cv.notify_all();
+                    break;
+                }
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    }
+
+    for (auto &w : workers) {
+        w.wait();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+}